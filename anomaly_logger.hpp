@@ -0,0 +1,196 @@
+/*
+Anomaly-triggered cycle logging
+
+AnomalyLogger is a Timer observer that logs only:
+
+  - every Nth cycle (decimation, 0 to disable);
+  - any cycle whose dt or TET exceeds an absolute threshold, or the running
+    estimate of a given quantile;
+  - K cycles of context before and after each anomaly, taken from an
+    in-memory ring.
+
+Selected cycles are handed over to a non-RT thread through a lock-free queue
+and written as CSV, so the log size scales with the anomalies, not with the
+run time.
+
+  AnomalyLogger log(1000, 10); // every 1000th cycle, 10 cycles of context
+  log.set_dt_quantile(0.999);
+  log.start_writer("anomalies.csv");
+  t.attach(log);
+*/
+#ifndef ANOMALY_LOGGER_HPP
+#define ANOMALY_LOGGER_HPP
+
+#include "quantile.hpp"
+#include "spsc_queue.hpp"
+#include "timer.hpp"
+#include <atomic>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+class AnomalyLogger : public CycleObserver {
+public:
+  enum Reason { DECIMATED = 1, ANOMALY = 2, CONTEXT = 4 };
+
+  struct Entry {
+    CycleRecord record;
+    int reason;
+  };
+
+  // LIFE-CYCLE ----------------------------------------------------------------
+  explicit AnomalyLogger(size_t every = 1000, size_t context = 10,
+                         size_t queue = 4096)
+      : _every(every), _context(context), _ring(context + 1), _queue(queue) {}
+
+  ~AnomalyLogger() { stop_writer(); }
+
+  AnomalyLogger(const AnomalyLogger &) = delete;
+  AnomalyLogger &operator=(const AnomalyLogger &) = delete;
+
+  // SETTINGS ------------------------------------------------------------------
+  // Set before attaching the logger to a running timer
+
+  void set_dt_threshold(nanoseconds t) { _dt_max = t.count(); }
+  void set_tet_threshold(nanoseconds t) { _tet_max = t.count(); }
+
+  // Quantile thresholds become active after warmup cycles
+  void set_dt_quantile(double p, size_t warmup = 1000) {
+    _dt_q = P2Quantile(p);
+    _dt_q_on = true;
+    _warmup = warmup;
+  }
+
+  void set_tet_quantile(double p, size_t warmup = 1000) {
+    _tet_q = P2Quantile(p);
+    _tet_q_on = true;
+    _warmup = warmup;
+  }
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_cycle(const CycleRecord &record) override {
+    _seen++;
+    bool anomaly = record.dt > _dt_max || record.tet > _tet_max;
+    if (_dt_q_on) {
+      anomaly |= _seen > _warmup && record.dt > _dt_q.value();
+      _dt_q.add(record.dt);
+    }
+    if (_tet_q_on) {
+      anomaly |= _seen > _warmup && record.tet > _tet_q.value();
+      _tet_q.add(record.tet);
+    }
+
+    int reason = 0;
+    if (anomaly) {
+      reason |= ANOMALY;
+      _anomalies++;
+      // context before the anomaly, not logged yet
+      size_t n = min<size_t>(_context, _ring_n);
+      for (size_t i = n; i > 0; i--) {
+        const Entry &e = _ring[(_ring_head + _ring.size() - i) % _ring.size()];
+        if (e.record.seq > _last_seq)
+          emit(e.record, e.reason | CONTEXT);
+      }
+      _post_left = _context;
+    } else if (_post_left > 0) {
+      reason |= CONTEXT;
+      _post_left--;
+    }
+    if (_every > 0 && record.seq % _every == 0) {
+      reason |= DECIMATED;
+    }
+    if (reason) {
+      emit(record, reason);
+    }
+    _ring[_ring_head] = {record, reason};
+    _ring_head = (_ring_head + 1) % _ring.size();
+    _ring_n = min(_ring_n + 1, _ring.size());
+  }
+
+  // NON-RT SIDE ---------------------------------------------------------------
+
+  // Writes the queued entries as CSV rows, returns how many
+  size_t drain(ostream &os) {
+    Entry e;
+    size_t n = 0;
+    while (_queue.pop(e)) {
+      const CycleRecord &r = e.record;
+      os << r.seq << "," << r.wake << "," << r.dt << "," << r.tet << ","
+         << r.lateness << "," << r.ret << "," << reason_name(e.reason) << "\n";
+      n++;
+    }
+    return n;
+  }
+
+  static const char *header() {
+    return "seq,wake,dt,tet,lateness,ret,reason";
+  }
+
+  // Starts a thread that drains the queue into path every poll period
+  void start_writer(const string &path,
+                    milliseconds poll = milliseconds(100)) {
+    stop_writer();
+    _writing = true;
+    _writer = thread([this, path, poll]() {
+      ofstream out(path);
+      out << header() << endl;
+      while (_writing.load()) {
+        drain(out);
+        out.flush();
+        this_thread::sleep_for(poll);
+      }
+      drain(out);
+    });
+  }
+
+  void stop_writer() {
+    _writing = false;
+    if (_writer.joinable()) {
+      _writer.join();
+    }
+  }
+
+  size_t anomalies() const { return _anomalies; }
+
+  // Entries lost because the writer did not keep up
+  size_t dropped() const { return _dropped.load(memory_order_relaxed); }
+
+  double dt_quantile() const { return _dt_q.value(); }
+  double tet_quantile() const { return _tet_q.value(); }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  size_t _every, _context;
+  int64_t _dt_max = INT64_MAX, _tet_max = INT64_MAX;
+  P2Quantile _dt_q, _tet_q;
+  bool _dt_q_on = false, _tet_q_on = false;
+  size_t _warmup = 1000;
+  vector<Entry> _ring; // last cycles, for the context before an anomaly
+  size_t _ring_head = 0, _ring_n = 0;
+  size_t _post_left = 0;
+  uint64_t _last_seq = 0;
+  size_t _seen = 0, _anomalies = 0;
+  SpscQueue<Entry> _queue;
+  atomic<size_t> _dropped{0};
+  atomic<bool> _writing{false};
+  thread _writer;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void emit(const CycleRecord &record, int reason) {
+    if (!_queue.push({record, reason})) {
+      _dropped.fetch_add(1, memory_order_relaxed);
+    }
+    _last_seq = record.seq;
+  }
+
+  static const char *reason_name(int reason) {
+    if (reason & ANOMALY)
+      return "anomaly";
+    if (reason & CONTEXT)
+      return "context";
+    return "decimated";
+  }
+};
+
+#endif // ANOMALY_LOGGER_HPP
@@ -0,0 +1,259 @@
+/*
+Calibrated CPU counter clock
+
+CycleClock reads the CPU counter (CNTVCT_EL0 on arm64, the TSC on x86-64)
+and converts it to nanoseconds on a reference clock (CLOCK_MONOTONIC by
+default) with a 32.32 fixed-point factor, calibrated against the reference
+at construction. A read costs a few ns and no syscall, which makes it fit for
+timestamps inside the cycle (TET, instrumented sections).
+
+The counter is used only if it is trustworthy: on x86-64 the TSC must be
+invariant (CPUID) and be the kernel clocksource (the kernel switches away
+from an unstable TSC); on arm64 the calibrated frequency must agree with
+CNTFRQ_EL0. Otherwise, and on other architectures, now() falls back to
+clock_gettime() on the reference, through the vDSO.
+
+CycleCounterClock is a Timer clock policy timing the cycle with a CycleClock
+on CLOCK_REALTIME, re-anchored and rate-corrected every resync period so that
+it follows NTP adjustments of the clock used for the deadlines (a step of the
+clock only moves the anchor):
+
+  Timer<duration<double>, FullStats, CycleCounterClock> t(...);
+  cout << t.clock().counter().source() << endl; // "tsc", "cntvct" or "vdso"
+*/
+#ifndef CYCLE_CLOCK_HPP
+#define CYCLE_CLOCK_HPP
+
+#include "timer.hpp"
+#include <fstream>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+class CycleClock {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // Calibrates over the given span (the constructor sleeps that long); with
+  // use_counter = false, the clock always reads the reference
+  explicit CycleClock(clockid_t reference = CLOCK_MONOTONIC,
+                      nanoseconds span = milliseconds(10),
+                      bool use_counter = true)
+      : _reference(reference) {
+    _trusted = use_counter && counter_available();
+    if (_trusted) {
+      calibrate(span);
+    }
+  }
+
+  // Shared instance on CLOCK_MONOTONIC, calibrated at first use
+  static const CycleClock &global() {
+    static CycleClock clock;
+    return clock;
+  }
+
+  // METHODS -------------------------------------------------------------------
+
+  // Raw counter value
+  static uint64_t ticks() {
+#if defined(__aarch64__)
+    uint64_t v;
+    __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(v)::"memory");
+    return v;
+#elif defined(__x86_64__)
+    _mm_lfence(); // do not read ahead of the preceding instructions
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  // Time on the reference clock
+  nanoseconds now() const {
+    if (!_trusted) {
+      return reference_now();
+    }
+    return nanoseconds(_base_ns + to_ns(ticks() - _base_ticks));
+  }
+
+  // Cheapest timestamp: ticks() if the counter is trusted, nanoseconds on the
+  // reference clock otherwise
+  uint64_t stamp() const {
+    return _trusted ? ticks() : reference_now().count();
+  }
+
+  // Converts a difference of stamp() (or of ticks(), if trusted) to
+  // nanoseconds
+  int64_t to_ns(uint64_t dticks) const {
+    if (!_trusted) {
+      return (int64_t)dticks;
+    }
+    return (int64_t)(((__int128)(int64_t)dticks * _mult) >> 32);
+  }
+
+  // Converts nanoseconds to a difference of stamp(); a negative ns gives 0,
+  // stamp() differences being unsigned
+  uint64_t to_ticks(int64_t ns) const {
+    if (ns <= 0) {
+      return 0;
+    }
+    if (!_trusted) {
+      return (uint64_t)ns;
+    }
+    return (uint64_t)(((unsigned __int128)ns << 32) / _mult);
+  }
+
+  // Re-anchors to the reference clock and corrects the rate from the time
+  // elapsed since the last anchor; returns the error of now() that was
+  // corrected. An error above MAX_DRIFT of the elapsed time is a step of the
+  // reference (settimeofday, NTP step), not a rate error: the rate is kept.
+  // Call it from the thread using the clock.
+  nanoseconds resync() {
+    if (!_trusted) {
+      return nanoseconds(0);
+    }
+    uint64_t c;
+    int64_t ref = anchor(c);
+    int64_t err = _base_ns + to_ns(c - _base_ticks) - ref;
+    uint64_t dc = c - _base_ticks;
+    bool drift = fabs((double)err) <= MAX_DRIFT * to_ns(dc);
+    if (dc > 0 && ref > _base_ns && drift) {
+      _mult = (uint64_t)(((unsigned __int128)(ref - _base_ns) << 32) / dc);
+    }
+    _base_ticks = c;
+    _base_ns = ref;
+    return nanoseconds(err);
+  }
+
+  // True if now() reads the counter
+  bool trusted() const { return _trusted; }
+
+  // "tsc", "cntvct" or, for the fallback, "vdso"
+  const char *source() const {
+    if (!_trusted) {
+      return "vdso";
+    }
+#if defined(__aarch64__)
+    return "cntvct";
+#else
+    return "tsc";
+#endif
+  }
+
+  // Calibrated counter frequency, Hz (0 for the fallback)
+  double frequency() const {
+    return _trusted ? 1.0E9 * 4294967296.0 / _mult : 0;
+  }
+
+  clockid_t reference() const { return _reference; }
+
+  // Largest rate error corrected by resync(): NTP slews the clock by at most
+  // 500 ppm, and oscillators drift far less
+  static constexpr double MAX_DRIFT = 500.0E-6;
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  clockid_t _reference;
+  bool _trusted = false;
+  uint64_t _base_ticks = 0;
+  int64_t _base_ns = 0;
+  uint64_t _mult = 0; // ns per tick, 32.32 fixed point
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  nanoseconds reference_now() const {
+    struct timespec ts;
+    clock_gettime(_reference, &ts);
+    return seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+  }
+
+  // Reads the counter between two reads of the reference, keeping the
+  // tightest of a few tries; returns the reference time at the counter read
+  int64_t anchor(uint64_t &c) const {
+    int64_t best = INT64_MAX, ref = 0;
+    c = 0;
+    for (int i = 0; i < 5; i++) {
+      int64_t r0 = reference_now().count();
+      uint64_t t = ticks();
+      int64_t r1 = reference_now().count();
+      if (r1 - r0 < best) {
+        best = r1 - r0;
+        ref = r0 + (r1 - r0) / 2;
+        c = t;
+      }
+    }
+    return ref;
+  }
+
+  void calibrate(nanoseconds span) {
+    uint64_t c0 = 0, c1 = 0;
+    int64_t r0 = anchor(c0);
+    this_thread_sleep(span);
+    int64_t r1 = anchor(c1);
+    if (c1 <= c0 || r1 <= r0) {
+      _trusted = false;
+      return;
+    }
+    _mult = (uint64_t)(((unsigned __int128)(r1 - r0) << 32) / (c1 - c0));
+    _base_ticks = c1;
+    _base_ns = r1;
+#if defined(__aarch64__)
+    uint64_t frq;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(frq));
+    if (frq == 0 || fabs(frequency() / frq - 1) > 0.01) {
+      _trusted = false;
+    }
+#endif
+  }
+
+  static void this_thread_sleep(nanoseconds span) {
+    struct timespec ts = {(time_t)(span.count() / 1000000000),
+                          (long)(span.count() % 1000000000)};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+  }
+
+  static bool counter_available() {
+#if defined(__aarch64__)
+    return true;
+#elif defined(__x86_64__)
+    unsigned a, b, c, d;
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1u << 8))) {
+      return false; // no invariant TSC
+    }
+    ifstream f("/sys/devices/system/clocksource/clocksource0/"
+               "current_clocksource");
+    string source;
+    return f >> source && source == "tsc";
+#else
+    return false;
+#endif
+  }
+};
+
+// Timer clock policy: as SystemClock, but now() reads a CycleClock on
+// CLOCK_REALTIME, resynchronized every resync period (on the first now()
+// after it) to follow the adjustments of the system clock
+struct CycleCounterClock : SystemClock {
+  explicit CycleCounterClock(nanoseconds resync = milliseconds(100))
+      : _counter(CLOCK_REALTIME), _resync(resync.count()) {
+    _next = _counter.now().count() + _resync;
+  }
+
+  nanoseconds now() {
+    nanoseconds t = _counter.now();
+    if (t.count() >= _next) {
+      _counter.resync();
+      t = _counter.now();
+      _next = t.count() + _resync;
+    }
+    return t;
+  }
+
+  CycleClock &counter() { return _counter; }
+
+private:
+  CycleClock _counter;
+  int64_t _resync, _next;
+};
+
+#endif // CYCLE_CLOCK_HPP
@@ -0,0 +1,370 @@
+/*
+Fault injection for Timer
+
+FaultyClock<Base> wraps any clock policy (SystemClock, VirtualClock, ...) and
+injects, at chosen cycles or with a given probability:
+
+  - body overruns: time lost at the end of the loop body, in enter_body();
+  - spurious signals: the sleep returns early with EINTR;
+  - late signals: the signal-based sleep is not interrupted by SIGALRM;
+  - clock steps: the clock jumps forward or backward, for good.
+
+fault_campaign() then runs a timed loop under each overrun policy and reports
+how wait() and the statistics reacted to every kind of fault.
+
+A body overrun must be part of the loop body, before wait() takes its
+pre-sleep timestamp, to be measured as TET and not as wake latency: the loop
+calls clock().enter_body() at the end of its body (fault_campaign() does).
+Without it, the fault of the cycle is drawn by the sleep, and an overrun
+drawn there is lost inside the sleep.
+
+Everything is compiled only when TIMER_FAULT_INJECTION is defined: otherwise
+FaultyClock<Base> is Base with no-op injection methods, and costs nothing.
+*/
+#ifndef FAULT_INJECTION_HPP
+#define FAULT_INJECTION_HPP
+
+#include "timer.hpp"
+#include <functional>
+#include <ostream>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+enum FaultType {
+  FAULT_NONE = 0,
+  FAULT_BODY_OVERRUN,
+  FAULT_SPURIOUS_SIGNAL,
+  FAULT_SIGNAL_LATE,
+  FAULT_CLOCK_STEP,
+  FAULT_TYPES
+};
+
+inline const char *fault_name(FaultType type) {
+  static const char *names[FAULT_TYPES] = {"none", "body_overrun",
+                                           "spurious_signal", "signal_late",
+                                           "clock_step"};
+  return names[type];
+}
+
+#ifdef TIMER_FAULT_INJECTION
+
+template <typename Base> class FaultyClock : public Base {
+public:
+  using Base::Base;
+
+  // FAULT PLAN ----------------------------------------------------------------
+  // Magnitude is the lost time for overruns, the step for clock steps (may be
+  // negative) and is ignored otherwise
+
+  void inject_at(size_t cycle, FaultType type,
+                 nanoseconds magnitude = nanoseconds(0)) {
+    _scheduled.push_back({cycle, type, magnitude});
+  }
+
+  void inject_randomly(double probability, FaultType type,
+                       nanoseconds magnitude = nanoseconds(0)) {
+    _random.push_back({probability, type, magnitude});
+  }
+
+  void seed(unsigned seed) { _gen.seed(seed); }
+
+  void clear_faults() {
+    _scheduled.clear();
+    _random.clear();
+    _cycle = 0;
+    _last_fault = FAULT_NONE;
+    _step = nanoseconds(0);
+    _drawn = false;
+  }
+
+  // Loop body hook, right before wait(): draws the fault of the coming sleep,
+  // and loses the time of a body overrun now
+  void enter_body() {
+    if (!_drawn) {
+      _fault = next_fault(_magnitude);
+      _drawn = true;
+      if (_fault == FAULT_BODY_OVERRUN)
+        lose(_magnitude);
+    }
+  }
+
+  // Cycle counter, incremented by every sleep
+  size_t cycle() const { return _cycle; }
+
+  // Fault injected in the last sleep, if any
+  FaultType last_fault() const { return _last_fault; }
+
+  // CLOCK POLICY --------------------------------------------------------------
+
+  nanoseconds now() { return Base::now() + _step; }
+
+  void gettime(struct timespec &ts) {
+    Base::gettime(ts);
+    shift(ts, _step);
+  }
+
+  int sleep_until(const struct timespec &ts) {
+    nanoseconds magnitude;
+    bool in_body = _drawn;
+    switch (_last_fault = take_fault(magnitude)) {
+    case FAULT_BODY_OVERRUN:
+      if (!in_body)
+        lose(magnitude);
+      break;
+    case FAULT_SPURIOUS_SIGNAL:
+      errno = EINTR;
+      return EINTR;
+    case FAULT_CLOCK_STEP:
+      _step += magnitude;
+      break;
+    default:
+      break;
+    }
+    struct timespec base_ts = ts;
+    shift(base_ts, -_step);
+    return Base::sleep_until(base_ts);
+  }
+
+  int sleep(const struct timespec &ts) {
+    nanoseconds magnitude;
+    bool in_body = _drawn;
+    switch (_last_fault = take_fault(magnitude)) {
+    case FAULT_BODY_OVERRUN:
+      if (!in_body)
+        lose(magnitude);
+      break;
+    case FAULT_SPURIOUS_SIGNAL:
+      errno = EINTR;
+      return -1;
+    case FAULT_SIGNAL_LATE:
+      lose(seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec));
+      return 0;
+    case FAULT_CLOCK_STEP:
+      _step += magnitude;
+      break;
+    default:
+      break;
+    }
+    return Base::sleep(ts);
+  }
+
+private:
+  struct Scheduled {
+    size_t cycle;
+    FaultType type;
+    nanoseconds magnitude;
+  };
+  struct Random {
+    double probability;
+    FaultType type;
+    nanoseconds magnitude;
+  };
+
+  // ATTRIBUTES ----------------------------------------------------------------
+  vector<Scheduled> _scheduled;
+  vector<Random> _random;
+  mt19937_64 _gen{1};
+  uniform_real_distribution<double> _uniform{0.0, 1.0};
+  size_t _cycle = 0;
+  FaultType _last_fault = FAULT_NONE;
+  nanoseconds _step{0};
+  bool _drawn = false; // fault of the coming sleep drawn by enter_body()
+  FaultType _fault = FAULT_NONE;
+  nanoseconds _magnitude{0};
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  // Fault of the current sleep, drawn by enter_body() or now
+  FaultType take_fault(nanoseconds &magnitude) {
+    if (!_drawn)
+      return next_fault(magnitude);
+    _drawn = false;
+    magnitude = _magnitude;
+    return _fault;
+  }
+
+  FaultType next_fault(nanoseconds &magnitude) {
+    size_t cycle = _cycle++;
+    for (auto &f : _scheduled) {
+      if (f.cycle == cycle) {
+        magnitude = f.magnitude;
+        return f.type;
+      }
+    }
+    for (auto &f : _random) {
+      if (_uniform(_gen) < f.probability) {
+        magnitude = f.magnitude;
+        return f.type;
+      }
+    }
+    return FAULT_NONE;
+  }
+
+  template <typename T, typename = void>
+  struct can_advance : false_type {};
+  template <typename T>
+  struct can_advance<T, void_t<decltype(declval<T &>().advance(
+                            declval<nanoseconds>()))>> : true_type {};
+
+  // Lets time pass without being woken up by SIGALRM
+  void lose(nanoseconds d) {
+    if (d.count() <= 0) {
+      return;
+    }
+    if constexpr (can_advance<Base>::value) {
+      Base::advance(d);
+    } else {
+      sigset_t set, old;
+      sigemptyset(&set);
+      sigaddset(&set, SIGALRM);
+      pthread_sigmask(SIG_BLOCK, &set, &old);
+      struct timespec ts = {0, 0};
+      shift(ts, d);
+      while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+      }
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+  }
+
+  static void shift(struct timespec &ts, nanoseconds d) {
+    long long ns = ts.tv_sec * (long long)NSEC_PER_SEC + ts.tv_nsec + d.count();
+    ts.tv_sec = ns / (long long)NSEC_PER_SEC;
+    ts.tv_nsec = ns % (long long)NSEC_PER_SEC;
+  }
+};
+
+// FAULT CAMPAIGN ----------------------------------------------------------------
+
+struct FaultReport {
+  // Outcome of wait() by injected fault: counts indexed by -TimerErrorType,
+  // in the faulty cycle and in the one that follows it (no fault: not kept)
+  size_t outcomes[FAULT_TYPES][4] = {};
+  size_t aftermath[FAULT_TYPES][4] = {};
+  // What the overrun policy did, charged to the last fault injected: cycles
+  // shorter than half the interval (catching up), deadlines left unserved
+  // (skipped), and the phase of the deadlines against the initial schedule
+  // at the end of the run, in ns (changed by a resync)
+  size_t short_cycles[FAULT_TYPES] = {};
+  size_t skipped[FAULT_TYPES] = {};
+  int64_t phase = 0;
+  size_t cycles = 0;
+  size_t exceptions = 0;
+  map<string, double> stats;
+  string policy;
+
+  void print(ostream &os) const {
+    static const char *codes[4] = {"ok", "signal_late", "max_wait_exceeded",
+                                   "interrupted"};
+    os << "Overrun policy: " << policy << ", " << cycles << " cycles, "
+       << exceptions << " exceptions from wait_throw()" << endl;
+    for (int f = 0; f < FAULT_TYPES; f++) {
+      os << "  " << fault_name((FaultType)f) << ":";
+      for (int c = 0; c < 4; c++)
+        os << " " << codes[c] << "=" << outcomes[f][c];
+      if (f != FAULT_NONE) {
+        os << " | next cycle:";
+        for (int c = 0; c < 4; c++)
+          os << " " << codes[c] << "=" << aftermath[f][c];
+        os << " | short=" << short_cycles[f] << " skipped=" << skipped[f];
+      }
+      os << endl;
+    }
+    os << "  phase offset at the end: " << phase / 1000.0 << " us" << endl;
+    for (auto &[k, v] : stats)
+      os << "  " << k << ": " << v << endl;
+  }
+};
+
+// Runs a timed loop of the given number of cycles on an already configured
+// timer (clock type FaultyClock<...>), calling body() then clock().enter_body()
+// before each wait(). With use_throw the loop uses wait_throw() and counts the
+// exceptions instead of stopping. The timer is restarted and stopped by the
+// campaign.
+template <typename TimerType>
+FaultReport fault_campaign(TimerType &timer, size_t cycles,
+                           typename TimerType::OverrunPolicy policy,
+                           bool use_throw = false,
+                           function<void()> body = nullptr) {
+  static const char *names[3] = {"catch_up", "skip", "resync"};
+  FaultReport report;
+  report.policy = string(names[policy]) + (use_throw ? "/throw" : "/return");
+  timer.set_overrun_policy(policy);
+  // an observer makes wait() fill timer.cycle()
+  struct : CycleObserver {
+    void on_cycle(const CycleRecord &) override {}
+  } recorder;
+  timer.attach(recorder);
+  const int64_t iv = duration_cast<nanoseconds>(timer.interval()).count();
+  FaultType previous = FAULT_NONE, last = FAULT_NONE;
+  int64_t first = 0, prev_deadline = 0;
+  timer.start();
+  for (size_t i = 0; i < cycles; i++) {
+    if (body)
+      body();
+    timer.clock().enter_body();
+    int ret;
+    if (use_throw) {
+      try {
+        timer.wait_throw();
+        ret = TimerType::TIMER_OK;
+      } catch (const TimerError &e) {
+        report.exceptions++;
+        ret = -1; // the message is the only detail wait_throw() gives
+        string msg = e.what();
+        if (msg.find("exceeded") != string::npos)
+          ret = TimerType::TIMER_ERR_MAX_WAIT_EXCEEDED;
+        else if (msg.find("interrupted") != string::npos)
+          ret = TimerType::TIMER_ERR_INTERRUPTED;
+      }
+    } else {
+      ret = timer.wait();
+    }
+    FaultType fault = timer.clock().last_fault();
+    report.outcomes[fault][-ret]++;
+    if (previous != FAULT_NONE)
+      report.aftermath[previous][-ret]++;
+    previous = fault;
+    if (fault != FAULT_NONE)
+      last = fault;
+    const CycleRecord &r = timer.cycle();
+    const int64_t deadline = r.wake - r.lateness;
+    if (i == 0) {
+      first = deadline;
+    } else {
+      if (r.dt < iv / 2)
+        report.short_cycles[last]++;
+      int64_t gap = llround((double)(deadline - prev_deadline) / iv);
+      if (gap > 1)
+        report.skipped[last] += gap - 1;
+    }
+    prev_deadline = deadline;
+    report.cycles++;
+  }
+  int64_t phase = ((prev_deadline - first) % iv + iv) % iv;
+  report.phase = phase > iv / 2 ? phase - iv : phase;
+  try {
+    report.stats = timer.stats();
+  } catch (const TimerError &) {
+  }
+  timer.stop();
+  timer.detach(recorder);
+  return report;
+}
+
+#else // TIMER_FAULT_INJECTION
+
+template <typename Base> class FaultyClock : public Base {
+public:
+  using Base::Base;
+  void inject_at(size_t, FaultType, nanoseconds = nanoseconds(0)) {}
+  void inject_randomly(double, FaultType, nanoseconds = nanoseconds(0)) {}
+  void seed(unsigned) {}
+  void clear_faults() {}
+  void enter_body() {}
+  size_t cycle() const { return 0; }
+  FaultType last_fault() const { return FAULT_NONE; }
+};
+
+#endif // TIMER_FAULT_INJECTION
+
+#endif // FAULT_INJECTION_HPP
@@ -0,0 +1,224 @@
+/*
+Flight recorder for Timer
+
+Always-on, fixed-size ring of the last N CycleRecords, written lock-free by
+the RT thread as a Timer observer. When a cycle exceeds the maximum wait (or
+on trigger()), the recorder keeps recording for a post-trigger window and
+then freezes; a non-RT dumper thread writes the frozen window to a binary
+file and re-arms the recorder. The RT side never blocks nor allocates.
+
+  FlightRecorder rec(4096, 256);
+  rec.start_dumper("timer-miss");   // writes timer-miss-<seq>.bin
+  t.attach(rec);
+
+Dump file layout: a FlightRecorderHeader, header.conditions_size bytes of
+text describing the conditions of the run (set_conditions(), e.g. the
+LatencyGuard report), then header.count CycleRecords in chronological order.
+*/
+#ifndef FLIGHT_RECORDER_HPP
+#define FLIGHT_RECORDER_HPP
+
+#include "sched_probe.hpp"
+#include "timer.hpp"
+#include <atomic>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+struct FlightRecorderHeader {
+  static constexpr uint32_t VERSION = 6; // layout of the header and records
+
+  char magic[4] = {'T', 'F', 'R', '1'};
+  uint32_t version = VERSION;
+  uint32_t record_size = sizeof(CycleRecord);
+  uint32_t count = 0;
+  uint64_t trigger_seq = 0; // seq of the cycle that triggered the dump
+  uint64_t dropped = 0;     // cycles not recorded while frozen, so far
+  uint32_t conditions_size = 0; // bytes of text following the header
+  uint32_t reserved = 0;
+};
+
+class FlightRecorder : public CycleObserver {
+public:
+  enum State { RECORDING = 0, TRIGGERED = 1, FROZEN = 2 };
+
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // capacity is rounded up to a power of two; post is the number of cycles
+  // kept after the trigger, the rest of the ring holds the cycles before it.
+  // Unless a SchedProbe is attached to the timer, the recorder samples the
+  // CPU and the scheduling counters itself, as enabled here.
+  explicit FlightRecorder(size_t capacity = 4096, size_t post = 256,
+                          bool sample_cpu = true, bool sample_sched = true)
+      : _probe(sample_sched, sample_sched, sample_cpu),
+        _sample(sample_cpu || sample_sched) {
+    size_t n = 1;
+    while (n < capacity)
+      n <<= 1;
+    _records.resize(n);
+    _mask = n - 1;
+    _post = min(post, n - 1);
+  }
+
+  ~FlightRecorder() { stop_dumper(); }
+
+  FlightRecorder(const FlightRecorder &) = delete;
+  FlightRecorder &operator=(const FlightRecorder &) = delete;
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_cycle(const CycleRecord &record) override {
+    int state = _state.load(memory_order_acquire);
+    if (state == FROZEN) {
+      _dropped.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+    CycleRecord &slot = _records[_head & _mask];
+    slot = record;
+    if (_sample && !(record.probes & CycleRecord::PROBE_SCHED)) {
+      _probe.on_wake(slot);
+    }
+    _head++;
+
+    if (state == RECORDING) {
+      bool miss = _trigger_on_any_error
+                      ? record.ret != 0
+                      : record.ret == Timer<>::TIMER_ERR_MAX_WAIT_EXCEEDED;
+      if (miss || _trigger_request.exchange(false, memory_order_relaxed)) {
+        _trigger_seq = record.seq;
+        _post_left = _post;
+        state = TRIGGERED;
+      }
+    } else if (_post_left > 0) {
+      _post_left--;
+    }
+    if (state == TRIGGERED) {
+      _state.store(_post_left == 0 ? FROZEN : TRIGGERED, memory_order_release);
+    }
+  }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  // Requests a dump around the next recorded cycle
+  void trigger() { _trigger_request.store(true, memory_order_relaxed); }
+
+  // Triggers on any error returned by wait(), not only on missed deadlines
+  void set_trigger_on_any_error(bool any) { _trigger_on_any_error = any; }
+
+  State state() const { return (State)_state.load(memory_order_acquire); }
+
+  size_t capacity() const { return _records.size(); }
+
+  size_t dumps() const { return _dumps.load(memory_order_relaxed); }
+
+  // NON-RT SIDE ---------------------------------------------------------------
+
+  // Text stored in the header of the next dumps; set it before starting the
+  // dumper
+  void set_conditions(const string &text) { _conditions = text; }
+
+  // Writes the frozen window to path and re-arms the recorder. Returns false
+  // if the recorder is not frozen.
+  bool dump(const string &path) {
+    if (state() != FROZEN) {
+      return false;
+    }
+    FlightRecorderHeader header;
+    header.count = (uint32_t)min<uint64_t>(_head, _records.size());
+    header.trigger_seq = _trigger_seq;
+    header.dropped = _dropped.load(memory_order_relaxed);
+    header.conditions_size = (uint32_t)_conditions.size();
+    ofstream out(path, ios::binary);
+    if (!out) {
+      throw TimerError("FlightRecorder: cannot open " + path);
+    }
+    out.write((const char *)&header, sizeof(header));
+    out.write(_conditions.data(), _conditions.size());
+    for (uint64_t i = _head - header.count; i < _head; i++)
+      out.write((const char *)&_records[i & _mask], sizeof(CycleRecord));
+    out.close();
+    _dumps.fetch_add(1, memory_order_relaxed);
+    _state.store(RECORDING, memory_order_release);
+    return true;
+  }
+
+  // Starts a thread that polls the recorder and dumps every frozen window to
+  // <prefix>-<trigger seq>.bin
+  void start_dumper(const string &prefix,
+                    milliseconds poll = milliseconds(10)) {
+    stop_dumper();
+    _dumping = true;
+    _dumper = thread([this, prefix, poll]() {
+      while (_dumping.load()) {
+        if (state() == FROZEN) {
+          dump(prefix + "-" + to_string(_trigger_seq) + ".bin");
+        }
+        this_thread::sleep_for(poll);
+      }
+    });
+  }
+
+  void stop_dumper() {
+    _dumping = false;
+    if (_dumper.joinable()) {
+      _dumper.join();
+    }
+  }
+
+  // Reads back a dump file; throws on other versions and truncated files
+  static vector<CycleRecord> load(const string &path,
+                                  FlightRecorderHeader *header = nullptr,
+                                  string *conditions = nullptr) {
+    ifstream in(path, ios::binary | ios::ate);
+    const uint64_t size = in ? (uint64_t)in.tellg() : 0;
+    in.seekg(0);
+    FlightRecorderHeader h;
+    if (!in.read((char *)&h, sizeof(h)) || memcmp(h.magic, "TFR1", 4) != 0) {
+      throw TimerError("FlightRecorder: invalid dump " + path);
+    }
+    if (h.version != FlightRecorderHeader::VERSION ||
+        h.record_size != sizeof(CycleRecord)) {
+      throw TimerError("FlightRecorder: " + path + " has version " +
+                       to_string(h.version) + " and records of " +
+                       to_string(h.record_size) + " bytes, expected " +
+                       to_string(FlightRecorderHeader::VERSION) + " and " +
+                       to_string(sizeof(CycleRecord)));
+    }
+    if (sizeof(h) + h.conditions_size + (uint64_t)h.count * h.record_size >
+        size) {
+      throw TimerError("FlightRecorder: truncated dump " + path);
+    }
+    string text(h.conditions_size, '\0');
+    vector<CycleRecord> records(h.count);
+    if (!in.read(&text[0], h.conditions_size) ||
+        !in.read((char *)records.data(), h.count * sizeof(CycleRecord))) {
+      throw TimerError("FlightRecorder: truncated dump " + path);
+    }
+    if (conditions) {
+      *conditions = text;
+    }
+    if (header) {
+      *header = h;
+    }
+    return records;
+  }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  vector<CycleRecord> _records;
+  uint64_t _mask = 0;
+  uint64_t _head = 0; // written by the RT thread only
+  size_t _post = 0, _post_left = 0;
+  uint64_t _trigger_seq = 0;
+  SchedProbe _probe;
+  bool _sample;
+  string _conditions;
+  bool _trigger_on_any_error = false;
+  atomic<int> _state{RECORDING};
+  atomic<bool> _trigger_request{false};
+  atomic<uint64_t> _dropped{0};
+  atomic<size_t> _dumps{0};
+  atomic<bool> _dumping{false};
+  thread _dumper;
+};
+
+#endif // FLIGHT_RECORDER_HPP
@@ -0,0 +1,46 @@
+/*
+Set-up of the helper threads of a timed loop
+
+NoiseDetector, SystemSampler and the Pipeline stages run threads next to the
+RT loop. Each one sets itself up from the thread function: pinned to a CPU
+(or not), and SCHED_FIFO at a priority, or SCHED_OTHER. The policy is set
+even for SCHED_OTHER, since a thread inherits the one of its creator, often
+the RT loop (see Timer::enable_rt_scheduler()).
+
+  void run() {
+    HelperThreadSetup s = setup_helper_thread(3, 80); // CPU 3, SCHED_FIFO 80
+    if (!s.pinned) ... runs anywhere, results are not those of CPU 3 ...
+  }
+*/
+#ifndef HELPER_THREAD_HPP
+#define HELPER_THREAD_HPP
+
+#include <pthread.h>
+#include <sched.h>
+
+// Outcome of setup_helper_thread()
+struct HelperThreadSetup {
+  bool pinned = true;    // false if the thread could not be pinned
+  bool scheduled = true; // false if the policy could not be set
+  bool ok() const { return pinned && scheduled; }
+};
+
+// Pins the calling thread to cpu (-1: not pinned) and sets SCHED_FIFO at
+// priority, or SCHED_OTHER for 0
+inline HelperThreadSetup setup_helper_thread(int cpu = -1, int priority = 0) {
+  HelperThreadSetup s;
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    s.pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+  }
+  sched_param param;
+  param.sched_priority = priority;
+  s.scheduled = pthread_setschedparam(pthread_self(),
+                                      priority > 0 ? SCHED_FIFO : SCHED_OTHER,
+                                      &param) == 0;
+  return s;
+}
+
+#endif // HELPER_THREAD_HPP
@@ -0,0 +1,334 @@
+/*
+Jitter attribution
+
+attribute_jitter() takes the cycles of a Timer run (TraceWriter or
+FlightRecorder files) and the system state sampled meanwhile (SystemSampler),
+picks the latest cycles and ranks, for each of them, the likely causes of its
+lateness, with a score between 0 and 1:
+
+  run delay       the thread was runnable but another task had the CPU
+  preemption      involuntary context switches during the cycle
+  page faults     major (I/O) and minor faults during the cycle
+  migration       the thread changed CPU
+  irq, softirq    interrupts of the CPU above their mean rate of the run
+  frequency       CPU frequency below the highest seen during the run
+  throttling      frequency capped or throttled by the firmware or the kernel
+  thermal         temperature above its usual level for the run
+
+The first four come from the per-cycle scheduling counters (SchedProbe, or
+the sampling of the recorders) and are exact for the cycle; the others come
+from the sampling interval (100 ms by default) containing the wake-up, so a
+burst that is short against the interval shows as a modest rate increase.
+Frequency and throttling are taken from the records themselves when the
+sampler was attached to the timer as a probe (PROBE_SYSTEM).
+A late cycle with no cause scored points outside the OS: SMIs, firmware or
+the hypervisor (see noise_detector.hpp).
+
+  auto records = FlightRecorder::load("run.bin");
+  auto samples = SystemSampler::load("state.csv");
+  print_jitter_report(attribute_jitter(records, samples, 100), cout);
+  print_tet_by_frequency(records, cout);
+
+timer-attrib does this from the command line.
+*/
+#ifndef JITTER_REPORT_HPP
+#define JITTER_REPORT_HPP
+
+#include "system_sampler.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+struct JitterCause {
+  string what;   // cause, e.g. "run delay" or "irq 24 IO-APIC 5-edge eth0"
+  double score;  // 0 to 1
+  string detail; // the evidence
+};
+
+struct JitterAttribution {
+  CycleRecord record;
+  vector<JitterCause> causes; // most likely first
+};
+
+// Causes scoring below this are not reported
+#define JITTER_MIN_SCORE 0.1
+
+namespace jitter_detail {
+
+inline string format_us(int64_t ns) {
+  ostringstream s;
+  s << fixed << setprecision(1) << ns / 1000.0 << " us";
+  return s.str();
+}
+
+// Per-source statistics of the samples over the whole run
+struct SourceStats {
+  int64_t total = 0;  // irq, softirq: sum of the counts
+  int64_t max = 0;    // freq, temp
+  vector<int64_t> values;
+  int64_t median = 0; // freq, temp
+};
+
+} // namespace jitter_detail
+
+// Ranks the causes of the `worst` latest cycles of records (latest first).
+// samples may be empty: the causes then come from the scheduling counters
+// only.
+inline vector<JitterAttribution>
+attribute_jitter(const vector<CycleRecord> &records,
+                 const vector<SystemSample> &samples, size_t worst = 100) {
+  using namespace jitter_detail;
+  vector<const CycleRecord *> late;
+  for (const CycleRecord &r : records) {
+    if (r.lateness > 0)
+      late.push_back(&r);
+  }
+  worst = min(worst, late.size());
+  partial_sort(late.begin(), late.begin() + worst, late.end(),
+               [](const CycleRecord *a, const CycleRecord *b) {
+                 return a->lateness > b->lateness;
+               });
+  late.resize(worst);
+
+  // samples by time, and the statistics of each source over the run; the
+  // sampled time is the sum of the distinct intervals
+  vector<const SystemSample *> by_time;
+  map<pair<int, string>, SourceStats> sources;
+  int64_t sampled = 0, previous = 0;
+  for (const SystemSample &s : samples) {
+    by_time.push_back(&s);
+    SourceStats &st = sources[{s.source, s.name}];
+    st.total += s.value;
+    st.max = max(st.max, s.value);
+    if (s.source == SystemSample::FREQ || s.source == SystemSample::TEMP)
+      st.values.push_back(s.value);
+  }
+  stable_sort(by_time.begin(), by_time.end(),
+              [](const SystemSample *a, const SystemSample *b) {
+                return a->time < b->time;
+              });
+  for (const SystemSample *s : by_time) {
+    if (s->time != previous)
+      sampled += s->interval;
+    previous = s->time;
+  }
+  for (auto &it : sources) {
+    vector<int64_t> &v = it.second.values;
+    if (!v.empty()) {
+      nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+      it.second.median = v[v.size() / 2];
+    }
+  }
+
+  uint32_t freq_max = 0; // kHz, from the records
+  for (const CycleRecord &r : records) {
+    if (r.probes & CycleRecord::PROBE_SYSTEM)
+      freq_max = max(freq_max, r.freq);
+  }
+
+  vector<JitterAttribution> result;
+  for (const CycleRecord *r : late) {
+    JitterAttribution a;
+    a.record = *r;
+    vector<JitterCause> &causes = a.causes;
+    int64_t lateness = max<int64_t>(r->lateness, 1);
+
+    if (r->probes & CycleRecord::PROBE_SCHED) {
+      if (r->run_delay > 0)
+        causes.push_back({"run delay", min(1.0, (double)r->run_delay / lateness),
+                          format_us(r->run_delay) + " runnable, waiting for "
+                                                    "the CPU"});
+      if (r->nivcsw > 0)
+        causes.push_back({"preemption", min(1.0, 0.25 * r->nivcsw),
+                          to_string(r->nivcsw) + " involuntary switches"});
+      if (r->majflt > 0 || r->minflt > 0)
+        causes.push_back({"page faults",
+                          r->majflt > 0 ? 0.9 : min(0.5, 0.05 * r->minflt),
+                          to_string(r->majflt) + " major, " +
+                              to_string(r->minflt) + " minor"});
+      if (r->migrations > 0)
+        causes.push_back({"migration", 0.6,
+                          "woke up on CPU " + to_string(r->cpu)});
+    }
+
+    // the samples taken at the end of the interval holding the wake-up
+    auto it = lower_bound(by_time.begin(), by_time.end(), r->wake,
+                          [](const SystemSample *s, int64_t t) {
+                            return s->time < t;
+                          });
+    int64_t end = it != by_time.end() ? (*it)->time : 0;
+    for (auto s = it; s != by_time.end() && (*s)->time == end; ++s) {
+      const SystemSample &x = **s;
+      if (x.time - x.interval > r->wake)
+        break;
+      if (x.source != SystemSample::IRQ && x.source != SystemSample::SOFTIRQ)
+        continue;
+      const SourceStats &st = sources[{x.source, x.name}];
+      double mean = sampled > 0 ? (double)st.total * x.interval / sampled : 0;
+      double ratio = mean > 0 ? x.value / mean : 0;
+      // and above the Poisson noise of a count with that mean
+      if (ratio < 1.5 || x.value < mean + 3 * sqrt(mean))
+        continue;
+      ostringstream detail;
+      detail << x.value << " in " << x.interval / 1000000 << " ms, "
+             << setprecision(2) << ratio << "x the mean rate";
+      // a handful of extra interrupts is weak evidence, however rare they are
+      double excess = min(1.0, (x.value - mean) / 5);
+      causes.push_back({string(SystemSample::source_name(x.source)) + " " +
+                            x.name,
+                        excess * (ratio - 1) / (ratio + 1), detail.str()});
+    }
+
+    // the state the cycle ran in: from the record if the sampler was
+    // attached, else the last sample before the wake-up (or the first one
+    // after, early in the run)
+    bool merged = r->probes & CycleRecord::PROBE_SYSTEM;
+    if (merged && freq_max > 0 && r->freq < 0.95 * freq_max) {
+      causes.push_back({"frequency",
+                        min(1.0, 2.0 * (1.0 - (double)r->freq / freq_max)),
+                        to_string(r->freq / 1000) + " MHz, up to " +
+                            to_string(freq_max / 1000) + " MHz in the run"});
+    }
+    if (merged && (r->throttled & SystemSample::NOW)) {
+      causes.push_back({"throttling", 0.8,
+                        SystemSample::throttle_names(r->throttled)});
+    }
+    map<pair<int, string>, const SystemSample *> state;
+    for (const SystemSample *s : by_time) {
+      if (s->source != SystemSample::FREQ && s->source != SystemSample::TEMP &&
+          s->source != SystemSample::THROTTLE)
+        continue;
+      if (merged && s->source != SystemSample::TEMP)
+        continue;
+      auto key = make_pair((int)s->source, s->name);
+      if (s->time <= r->wake || !state.count(key))
+        state[key] = s;
+    }
+    for (auto &it : state) {
+      const SystemSample &x = *it.second;
+      const SourceStats &st = sources[it.first];
+      if (x.source == SystemSample::FREQ && st.max > 0 &&
+          x.value < 0.95 * st.max) {
+        causes.push_back({"frequency " + x.name,
+                          min(1.0, 2.0 * (1.0 - (double)x.value / st.max)),
+                          to_string(x.value / 1000) + " MHz, up to " +
+                              to_string(st.max / 1000) + " MHz in the run"});
+      } else if (x.source == SystemSample::THROTTLE &&
+                 (x.value & SystemSample::NOW)) {
+        causes.push_back({"throttling " + x.name, 0.8,
+                          SystemSample::throttle_names((uint32_t)x.value)});
+      } else if (x.source == SystemSample::TEMP && st.max > st.median + 1000 &&
+                 x.value > st.median) {
+        causes.push_back(
+            {"thermal " + x.name,
+             0.5 * (x.value - st.median) / (st.max - st.median),
+             to_string(x.value / 1000) + " C, median " +
+                 to_string(st.median / 1000) + " C"});
+      }
+    }
+
+    causes.erase(remove_if(causes.begin(), causes.end(),
+                           [](const JitterCause &c) {
+                             return c.score < JITTER_MIN_SCORE;
+                           }),
+                 causes.end());
+    stable_sort(causes.begin(), causes.end(),
+                [](const JitterCause &a, const JitterCause &b) {
+                  return a.score > b.score;
+                });
+    result.push_back(move(a));
+  }
+  return result;
+}
+
+// Lists the cycles with up to `causes` causes each, then how many cycles have
+// each cause as the most likely one. Wake-up times are shown relative to
+// start (ns, default: the earliest listed wake-up).
+inline void print_jitter_report(const vector<JitterAttribution> &report,
+                                ostream &out, size_t causes = 3,
+                                int64_t start = 0) {
+  using namespace jitter_detail;
+  map<string, size_t> top;
+  int64_t t0 = start;
+  for (const JitterAttribution &a : report) {
+    if (start == 0 && (t0 == 0 || a.record.wake < t0))
+      t0 = a.record.wake;
+  }
+  out << "Latest " << report.size() << " cycles" << endl;
+  for (const JitterAttribution &a : report) {
+    const CycleRecord &r = a.record;
+    out << "seq " << r.seq << " at +" << fixed << setprecision(3)
+        << (r.wake - t0) / 1.0E9 << " s: late " << format_us(r.lateness)
+        << ", dt " << format_us(r.dt) << ", tet " << format_us(r.tet);
+    if (r.cpu >= 0)
+      out << ", cpu " << r.cpu;
+    if (r.ret != 0)
+      out << ", ret " << r.ret;
+    out << endl;
+    for (size_t i = 0; i < min(causes, a.causes.size()); i++)
+      out << "  " << setprecision(2) << a.causes[i].score << " "
+          << a.causes[i].what << ": " << a.causes[i].detail << endl;
+    if (a.causes.empty())
+      out << "  no cause found (SMI, firmware or hypervisor?)" << endl;
+    // the kind of cause: "irq 24 IO-APIC ..." counts as "irq 24"
+    string kind = a.causes.empty() ? "none" : a.causes[0].what;
+    if (kind.compare(0, 4, "irq ") == 0)
+      kind = kind.substr(0, kind.find(' ', 4));
+    top[kind]++;
+  }
+  vector<pair<string, size_t>> ranked(top.begin(), top.end());
+  stable_sort(ranked.begin(), ranked.end(),
+              [](const pair<string, size_t> &a, const pair<string, size_t> &b) {
+                return a.second > b.second;
+              });
+  out << "Most likely cause" << endl;
+  for (auto &it : ranked)
+    out << "  " << setw(6) << it.second << " " << it.first << endl;
+  out << defaultfloat;
+}
+
+// Loop body time (tet) and lateness of the cycles by CPU frequency, and of the
+// throttled cycles, for the records filled by a SystemSampler: DVFS shows as
+// a tet growing as the frequency drops
+inline void print_tet_by_frequency(const vector<CycleRecord> &records,
+                                   ostream &out) {
+  struct Group {
+    size_t n = 0;
+    double tet = 0, lateness = 0;
+    int64_t tet_max = 0;
+    void add(const CycleRecord &r) {
+      n++;
+      tet += (r.tet - tet) / n;
+      lateness += (r.lateness - lateness) / n;
+      tet_max = max(tet_max, r.tet);
+    }
+  };
+  map<uint32_t, Group> by_freq; // MHz
+  Group throttled;
+  for (const CycleRecord &r : records) {
+    if (!(r.probes & CycleRecord::PROBE_SYSTEM))
+      continue;
+    if (r.freq > 0)
+      by_freq[r.freq / 1000].add(r);
+    if (r.throttled & SystemSample::NOW)
+      throttled.add(r);
+  }
+  if (by_freq.empty() && throttled.n == 0)
+    return;
+  out << "Cycles by CPU frequency" << endl;
+  out << setw(12) << "MHz" << setw(10) << "cycles" << setw(12) << "tet_us"
+      << setw(12) << "tet_max_us" << setw(12) << "late_us" << endl;
+  out << fixed << setprecision(1);
+  auto row = [&out](const string &label, const Group &g) {
+    out << setw(12) << label << setw(10) << g.n << setw(12) << g.tet / 1000
+        << setw(12) << g.tet_max / 1000.0 << setw(12) << g.lateness / 1000
+        << endl;
+  };
+  for (auto it = by_freq.rbegin(); it != by_freq.rend(); ++it)
+    row(to_string(it->first), it->second);
+  if (throttled.n > 0)
+    row("throttled", throttled);
+  out << defaultfloat;
+}
+
+#endif // JITTER_REPORT_HPP
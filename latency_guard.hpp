@@ -0,0 +1,365 @@
+/*
+Low-latency system configuration guard
+
+LatencyGuard holds the PM QoS request that keeps the CPUs out of deep idle
+states (0 us written to /dev/cpu_dma_latency, held as long as the file stays
+open), and checks the rest of the system configuration that a valid RT run
+depends on:
+
+  cpu_dma_latency   the PM QoS request is held, at the requested latency
+  preempt_rt        the kernel is PREEMPT_RT (/sys/kernel/realtime)
+  governor          the cpufreq governor of the timer CPU is "performance"
+  isolcpus          the timer CPU is isolated from the scheduler
+  nohz_full         the timer CPU runs without the scheduler tick
+  rt_throttling     sched_rt_runtime_us is -1, RT tasks are never throttled
+  irq_affinity      no device interrupt can be delivered to the timer CPU
+
+Each check passes, warns, fails or is unknown (no cpufreq in a VM, no timer
+CPU given). Only the QoS request and the governor fail: the others depend
+on the setup, and only lower the margins. report() gives the results as one
+line of JSON, to be stored with the results of a run: TraceWriter and
+FlightRecorder embed it in the header of their files (set_conditions()),
+timer-attrib and timer_bench print it.
+
+  auto &guard = LatencyGuard::hold_for_process(2); // the timer runs on CPU 2
+  guard.print(cerr);
+  guard.require();                                 // throws on failures
+  trace.set_conditions(guard.report());
+
+Writing /dev/cpu_dma_latency needs root. The sysfs and procfs roots can be
+moved to a fake directory tree.
+*/
+#ifndef LATENCY_GUARD_HPP
+#define LATENCY_GUARD_HPP
+
+#include "timer.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <vector>
+
+struct LatencyCheck {
+  enum Status { PASS, WARN, FAIL, UNKNOWN };
+
+  string name;
+  Status status = UNKNOWN;
+  string value;  // what was found
+  string detail; // why it matters, or what went wrong
+
+  static const char *status_name(Status s) {
+    static const char *names[] = {"pass", "warn", "fail", "unknown"};
+    return names[s];
+  }
+};
+
+class LatencyGuard {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // cpu is the CPU of the timer (-1: not pinned); latency the PM QoS request,
+  // in microseconds (-1: no request). The checks are run here.
+  explicit LatencyGuard(int cpu = -1, int32_t latency = 0,
+                        const string &sysfs = "/sys",
+                        const string &procfs = "/proc",
+                        const string &qos = "/dev/cpu_dma_latency")
+      : _cpu(cpu), _latency(latency), _sysfs(sysfs), _procfs(procfs),
+        _qos(qos) {
+    if (latency >= 0) {
+      hold();
+    }
+    check();
+  }
+
+  // Releases the PM QoS request
+  ~LatencyGuard() {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  }
+
+  LatencyGuard(const LatencyGuard &) = delete;
+  LatencyGuard &operator=(const LatencyGuard &) = delete;
+
+  // A guard living until the process exits; the arguments of the first call
+  // are used
+  static LatencyGuard &hold_for_process(int cpu = -1, int32_t latency = 0) {
+    static LatencyGuard guard(cpu, latency);
+    return guard;
+  }
+
+  // METHODS -------------------------------------------------------------------
+
+  // Runs the checks again
+  void check() {
+    _checks.clear();
+    check_qos();
+    check_preempt_rt();
+    check_governor();
+    check_isolation("isolcpus", "isolated",
+                    "the scheduler may place other tasks on the timer CPU");
+    check_isolation("nohz_full", "nohz_full",
+                    "the scheduler tick interrupts the timer CPU");
+    check_rt_throttling();
+    check_irq_affinity();
+  }
+
+  const vector<LatencyCheck> &checks() const { return _checks; }
+
+  // True if the PM QoS request is held
+  bool held() const { return _fd >= 0; }
+
+  // True if no check failed
+  bool ok() const {
+    for (auto &c : _checks) {
+      if (c.status == LatencyCheck::FAIL)
+        return false;
+    }
+    return true;
+  }
+
+  // Throws a TimerError listing the failed checks, if any
+  void require() const {
+    string failed;
+    for (auto &c : _checks) {
+      if (c.status == LatencyCheck::FAIL)
+        failed += "\n  " + c.name + ": " + c.value + " (" + c.detail + ")";
+    }
+    if (!failed.empty()) {
+      throw TimerError("LatencyGuard: system not configured for low latency:" +
+                       failed);
+    }
+  }
+
+  // The checks as one line of JSON:
+  // {"cpu":2,"ok":true,"checks":{"governor":{"status":"pass","value":...}}}
+  string report() const {
+    ostringstream s;
+    s << "{\"cpu\":" << _cpu << ",\"ok\":" << (ok() ? "true" : "false")
+      << ",\"checks\":{";
+    for (size_t i = 0; i < _checks.size(); i++) {
+      const LatencyCheck &c = _checks[i];
+      s << (i ? "," : "") << "\"" << c.name << "\":{\"status\":\""
+        << LatencyCheck::status_name(c.status) << "\",\"value\":\""
+        << escape(c.value) << "\",\"detail\":\"" << escape(c.detail)
+        << "\"}";
+    }
+    s << "}}";
+    return s.str();
+  }
+
+  // The checks, one per line
+  void print(ostream &out) const {
+    for (auto &c : _checks) {
+      out << "  " << LatencyCheck::status_name(c.status) << "\t" << c.name
+          << ": " << c.value;
+      if (!c.detail.empty())
+        out << " (" << c.detail << ")";
+      out << endl;
+    }
+  }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  int _cpu;
+  int32_t _latency;
+  string _sysfs, _procfs, _qos;
+  int _fd = -1;
+  string _error; // why the request could not be held
+  vector<LatencyCheck> _checks;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void hold() {
+    _fd = open(_qos.c_str(), O_RDWR | O_CLOEXEC);
+    if (_fd < 0) {
+      _error = strerror(errno);
+      return;
+    }
+    if (write(_fd, &_latency, sizeof(_latency)) != sizeof(_latency)) {
+      _error = strerror(errno);
+      close(_fd);
+      _fd = -1;
+    }
+  }
+
+  void add(const string &name, LatencyCheck::Status status,
+           const string &value, const string &detail = "") {
+    _checks.push_back({name, status, value, detail});
+  }
+
+  void check_qos() {
+    if (_latency < 0) {
+      add("cpu_dma_latency", LatencyCheck::UNKNOWN, "not requested");
+    } else if (_fd < 0) {
+      add("cpu_dma_latency", LatencyCheck::FAIL, "not held",
+          _qos + ": " + _error);
+    } else {
+      // reading gives the current target of all the requests
+      int32_t target = -1;
+      if (pread(_fd, &target, sizeof(target), 0) != sizeof(target))
+        target = _latency;
+      add("cpu_dma_latency",
+          target <= _latency ? LatencyCheck::PASS : LatencyCheck::FAIL,
+          to_string(target) + " us",
+          target <= _latency ? "" : "target above the request");
+    }
+  }
+
+  void check_preempt_rt() {
+    string realtime;
+    if (read_line(_sysfs + "/kernel/realtime", realtime) && realtime == "1")
+      add("preempt_rt", LatencyCheck::PASS, "1");
+    else
+      add("preempt_rt", LatencyCheck::WARN, "0", "not a PREEMPT_RT kernel");
+  }
+
+  void check_governor() {
+    // the timer CPU, or all the CPUs with cpufreq
+    vector<string> cpus;
+    if (_cpu >= 0) {
+      cpus.push_back("cpu" + to_string(_cpu));
+    } else {
+      for (auto &name : list_dir(_sysfs + "/devices/system/cpu")) {
+        if (name.size() > 3 && name.compare(0, 3, "cpu") == 0 &&
+            isdigit(name[3]))
+          cpus.push_back(name);
+      }
+    }
+    set<string> governors;
+    for (auto &cpu : cpus) {
+      string g;
+      if (read_line(_sysfs + "/devices/system/cpu/" + cpu +
+                        "/cpufreq/scaling_governor",
+                    g))
+        governors.insert(g);
+    }
+    if (governors.empty()) {
+      add("governor", LatencyCheck::UNKNOWN, "none", "no cpufreq");
+      return;
+    }
+    string value;
+    for (auto &g : governors)
+      value += (value.empty() ? "" : ",") + g;
+    bool performance = governors.size() == 1 && *governors.begin() ==
+                                                    "performance";
+    add("governor", performance ? LatencyCheck::PASS : LatencyCheck::FAIL,
+        value, performance ? "" : "frequency changes stretch the cycles");
+  }
+
+  void check_isolation(const string &name, const string &file,
+                       const string &risk) {
+    string list;
+    read_line(_sysfs + "/devices/system/cpu/" + file, list);
+    if (_cpu < 0) {
+      add(name, LatencyCheck::UNKNOWN, list.empty() ? "none" : list,
+          "no timer CPU given");
+    } else {
+      bool in = parse_cpu_list(list).count(_cpu) > 0;
+      add(name, in ? LatencyCheck::PASS : LatencyCheck::WARN,
+          list.empty() ? "none" : list, in ? "" : risk);
+    }
+  }
+
+  void check_rt_throttling() {
+    string runtime, period;
+    if (!read_line(_procfs + "/sys/kernel/sched_rt_runtime_us", runtime)) {
+      add("rt_throttling", LatencyCheck::UNKNOWN, "unknown");
+      return;
+    }
+    read_line(_procfs + "/sys/kernel/sched_rt_period_us", period);
+    if (runtime == "-1") {
+      add("rt_throttling", LatencyCheck::PASS, "-1");
+    } else {
+      add("rt_throttling", LatencyCheck::WARN,
+          runtime + "/" + (period.empty() ? "?" : period) + " us",
+          "RT tasks are stopped when they exceed the runtime");
+    }
+  }
+
+  // Device interrupts (numbered lines of /proc/interrupts) whose effective
+  // or allowed affinity includes the timer CPU
+  void check_irq_affinity() {
+    if (_cpu < 0) {
+      add("irq_affinity", LatencyCheck::UNKNOWN, "", "no timer CPU given");
+      return;
+    }
+    ifstream in(_procfs + "/interrupts");
+    string line, hits;
+    size_t n = 0, irqs = 0;
+    getline(in, line); // CPU header
+    while (getline(in, line)) {
+      istringstream row(line);
+      string id;
+      if (!(row >> id) || id.back() != ':' || !isdigit(id[0]))
+        continue;
+      id.pop_back();
+      irqs++;
+      string dir = _procfs + "/irq/" + id, list;
+      if (!read_line(dir + "/effective_affinity_list", list) &&
+          !read_line(dir + "/smp_affinity_list", list))
+        continue;
+      if (parse_cpu_list(list).count(_cpu)) {
+        n++;
+        if (n <= 8)
+          hits += (hits.empty() ? "" : ",") + id;
+      }
+    }
+    if (irqs == 0) {
+      add("irq_affinity", LatencyCheck::UNKNOWN, "", "no interrupts found");
+    } else if (n == 0) {
+      add("irq_affinity", LatencyCheck::PASS, "0 of " + to_string(irqs));
+    } else {
+      add("irq_affinity", LatencyCheck::WARN,
+          to_string(n) + " of " + to_string(irqs) + ": " + hits +
+              (n > 8 ? ",..." : ""),
+          "interrupts can preempt the timer CPU");
+    }
+  }
+
+  // "0-2,5" -> {0, 1, 2, 5}
+  static set<int> parse_cpu_list(const string &list) {
+    set<int> cpus;
+    istringstream in(list);
+    string range;
+    while (getline(in, range, ',')) {
+      if (range.empty() || !isdigit(range[0]))
+        continue;
+      size_t dash = range.find('-');
+      int first = atoi(range.c_str());
+      int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+      for (int c = first; c <= last; c++)
+        cpus.insert(c);
+    }
+    return cpus;
+  }
+
+  static bool read_line(const string &path, string &line) {
+    ifstream in(path);
+    return (bool)getline(in, line);
+  }
+
+  static vector<string> list_dir(const string &path) {
+    vector<string> names;
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+      return names;
+    while (struct dirent *e = readdir(dir))
+      names.push_back(e->d_name);
+    closedir(dir);
+    sort(names.begin(), names.end());
+    return names;
+  }
+
+  static string escape(const string &s) {
+    string out;
+    for (char c : s) {
+      if (c == '"' || c == '\\')
+        out += '\\';
+      if ((unsigned char)c >= 0x20)
+        out += c;
+    }
+    return out;
+  }
+};
+
+#endif // LATENCY_GUARD_HPP
@@ -0,0 +1,100 @@
+/*
+Mock device backend for Pipeline
+
+Stands in for the hardware, to run and test a pipeline anywhere. The inputs
+of cycle seq are a deterministic function of seq (value()), so the expected
+outputs are known; read() and write() spin for a configurable time, as a
+bus transfer would. Every write is logged, with its time on the timer clock,
+in a log allocated at construction: the order of the frames, the outputs and
+the timing of the writes can be checked after the run.
+
+  MockDevice<4> dev(microseconds(50), microseconds(20)); // read, write costs
+  ... run a Pipeline on dev ...
+  for (auto &w : dev.writes())
+    check(w.out[0] == expected(MockDevice<4>::value(w.seq, 0)));
+  dev.gaps();        // frames skipped between two writes
+*/
+#ifndef MOCK_DEVICE_HPP
+#define MOCK_DEVICE_HPP
+
+#include "cycle_clock.hpp"
+#include "timer.hpp"
+#include <array>
+#include <cmath>
+#include <vector>
+
+template <size_t N = 4> class MockDevice {
+public:
+  using Input = array<double, N>;
+  using Output = array<double, N>;
+
+  struct Write {
+    uint64_t seq;
+    int64_t time; // end of the write, ns on the clock
+    Output out;
+  };
+
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // log is the number of writes kept; later ones are only counted
+  explicit MockDevice(nanoseconds read_cost = nanoseconds(0),
+                      nanoseconds write_cost = nanoseconds(0),
+                      size_t log = 65536, clockid_t clock = CLOCK_REALTIME)
+      : _read_cost(read_cost.count()), _write_cost(write_cost.count()),
+        _log(log), _clock(clock) {
+    _writes.reserve(log);
+  }
+
+  // METHODS -------------------------------------------------------------------
+
+  // Input channel i at cycle seq
+  static double value(uint64_t seq, size_t i) {
+    return sin(seq * 0.01 + i);
+  }
+
+  // Input stage
+  void read(uint64_t seq, Input &in) {
+    for (size_t i = 0; i < N; i++)
+      in[i] = value(seq, i);
+    spin(_read_cost);
+  }
+
+  // Output stage
+  void write(uint64_t seq, const Output &out) {
+    spin(_write_cost);
+    if (_count > 0 && seq != _last + 1)
+      seq > _last ? _gaps += seq - _last - 1 : _out_of_order++;
+    _last = seq;
+    _count++;
+    if (_writes.size() < _log) {
+      struct timespec ts;
+      clock_gettime(_clock, &ts);
+      _writes.push_back({seq, ts.tv_sec * 1000000000LL + ts.tv_nsec, out});
+    }
+  }
+
+  // Read these after the pipeline stopped
+  const vector<Write> &writes() const { return _writes; }
+  uint64_t count() const { return _count; }
+  uint64_t gaps() const { return _gaps; }
+  uint64_t out_of_order() const { return _out_of_order; }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  int64_t _read_cost, _write_cost;
+  size_t _log;
+  clockid_t _clock;
+  vector<Write> _writes;
+  uint64_t _count = 0, _last = 0, _gaps = 0, _out_of_order = 0;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  static void spin(int64_t ns) {
+    if (ns <= 0)
+      return;
+    const CycleClock &clock = CycleClock::global();
+    uint64_t end = clock.stamp() + clock.to_ticks(ns);
+    while (clock.stamp() < end) {
+    }
+  }
+};
+
+#endif // MOCK_DEVICE_HPP
@@ -0,0 +1,251 @@
+/*
+OS and hardware noise detector
+
+NoiseDetector runs a thread pinned to one CPU that spins reading the CPU
+counter (CycleClock), as the kernel hwlat and osnoise tracers do: with a
+real-time priority and nothing else on that CPU, only interrupts, SMIs,
+firmware and the hypervisor can stop it, so any gap between two consecutive
+reads longer than a threshold is noise. Each gap is recorded with its start
+on CLOCK_REALTIME (the clock of CycleRecord::wake) and counted in a log2
+histogram. The thread spins for `width` out of every `window` and sleeps the
+rest, leaving some time to the kernel threads of that CPU.
+
+correlate_noise() matches the gaps with the wake-ups of a Timer run at the
+same time on another CPU: a late wake-up overlapping a gap points to
+system-wide noise (SMI, firmware, hypervisor), one with no gap to the kernel
+scheduling of the Timer CPU.
+
+  NoiseDetector det(microseconds(10), 3); // gaps above 10 us, on CPU 3
+  det.start();
+  ... timed loop on another CPU, recording its CycleRecords ...
+  det.stop();
+  correlate_noise(det.events(), records, 50000, &cout);
+
+`timer_bench noise` runs this experiment.
+*/
+#ifndef NOISE_DETECTOR_HPP
+#define NOISE_DETECTOR_HPP
+
+#include "cycle_clock.hpp"
+#include "helper_thread.hpp"
+#include "seqlock.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+// Histogram bin b counts gaps in [2^b, 2^(b+1)) ns
+#define NOISE_BINS 32
+
+// A gap in the spin loop; ns, start on CLOCK_REALTIME
+struct NoiseEvent {
+  int64_t start;
+  int64_t gap;
+};
+
+struct NoiseSummary {
+  uint64_t loops = 0;   // clock reads
+  int64_t spin_ns = 0;  // time spent spinning
+  int64_t noise_ns = 0; // sum of the gaps
+  int64_t max_gap = 0;
+  uint64_t events = 0;
+  uint64_t lost = 0;    // gaps not stored, beyond capacity
+};
+
+class NoiseDetector {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // cpu = -1 leaves the thread unpinned; priority 0 runs it as SCHED_OTHER;
+  // at most capacity gaps are stored (the histogram counts them all)
+  template <typename T>
+  explicit NoiseDetector(T threshold, int cpu = -1, int priority = 99,
+                         nanoseconds width = milliseconds(500),
+                         nanoseconds window = seconds(1),
+                         size_t capacity = 65536)
+      : _clock(CycleClock::global()),
+        _threshold(duration_cast<nanoseconds>(threshold).count()), _cpu(cpu),
+        _priority(priority), _width(width.count()),
+        _window(max(width, window).count()), _capacity(capacity) {
+    _events.reserve(capacity);
+    for (size_t b = 0; b < NOISE_BINS; b++)
+      _hist[b].store(0, memory_order_relaxed);
+  }
+
+  ~NoiseDetector() { stop(); }
+
+  NoiseDetector(const NoiseDetector &) = delete;
+  NoiseDetector &operator=(const NoiseDetector &) = delete;
+
+  // METHODS -------------------------------------------------------------------
+
+  void start() {
+    if (_thread.joinable()) {
+      return;
+    }
+    _events.clear();
+    _acc = NoiseSummary();
+    _running.store(true);
+    _thread = thread([this] { run(); });
+  }
+
+  void stop() {
+    if (_thread.joinable()) {
+      _running.store(false);
+      _thread.join();
+    }
+  }
+
+  // Gaps in chronological order; read them after stop()
+  const vector<NoiseEvent> &events() const { return _events; }
+
+  // True if the thread got its real-time priority (known after start())
+  bool realtime() const { return _realtime.load(); }
+
+  // False if the thread could not be pinned to cpu() (known after start())
+  bool pinned() const { return _pinned.load(); }
+
+  int cpu() const { return _cpu; }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  NoiseSummary summary() const { return _published.load(); }
+
+  vector<uint64_t> histogram() const {
+    vector<uint64_t> bins(NOISE_BINS);
+    for (size_t b = 0; b < NOISE_BINS; b++)
+      bins[b] = _hist[b].load(memory_order_relaxed);
+    return bins;
+  }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  const CycleClock &_clock;
+  int64_t _threshold;
+  int _cpu, _priority;
+  int64_t _width, _window;
+  size_t _capacity;
+  vector<NoiseEvent> _events;
+  NoiseSummary _acc; // written by the detector thread only
+  Seqlock<NoiseSummary> _published;
+  atomic<uint64_t> _hist[NOISE_BINS];
+  atomic<bool> _running{false}, _realtime{false}, _pinned{false};
+  thread _thread;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void run() {
+    HelperThreadSetup setup = setup_helper_thread(_cpu, _priority);
+    _pinned.store(setup.pinned);
+    _realtime.store(setup.scheduled && _priority > 0);
+    const uint64_t threshold = _clock.to_ticks(_threshold);
+    while (_running.load(memory_order_relaxed)) {
+      struct timespec window_end;
+      clock_gettime(CLOCK_MONOTONIC, &window_end);
+      timespec_add_ns(window_end, _window);
+      uint64_t t0 = _clock.stamp(), end = t0 + _clock.to_ticks(_width);
+      uint64_t prev = t0;
+      for (;;) {
+        uint64_t t = _clock.stamp();
+        _acc.loops++;
+        if (t - prev > threshold) {
+          record(_clock.to_ns(t - prev));
+          t = _clock.stamp(); // not counting the time spent recording
+        }
+        prev = t;
+        if (t >= end || !_running.load(memory_order_relaxed))
+          break;
+      }
+      _acc.spin_ns += _clock.to_ns(prev - t0);
+      _published.store(_acc);
+      while (_running.load(memory_order_relaxed) &&
+             clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &window_end,
+                             NULL) == EINTR) {
+      }
+    }
+  }
+
+  void record(int64_t gap) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (_events.size() < _capacity) {
+      _events.push_back({now - gap, gap});
+    } else {
+      _acc.lost++;
+    }
+    _acc.events++;
+    _acc.noise_ns += gap;
+    _acc.max_gap = max(_acc.max_gap, gap);
+    size_t b = min<size_t>(63 - __builtin_clzll(gap | 1), NOISE_BINS - 1);
+    _hist[b].store(_hist[b].load(memory_order_relaxed) + 1,
+                   memory_order_relaxed);
+  }
+
+  static void timespec_add_ns(struct timespec &ts, int64_t ns) {
+    ns += ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+  }
+};
+
+// Late wake-ups of a Timer run against the noise gaps of the same run
+struct NoiseCorrelation {
+  size_t cycles = 0;
+  size_t late = 0;            // cycles with lateness above the threshold
+  size_t late_with_noise = 0; // late cycles overlapping a gap
+  int64_t lateness_ns = 0;    // total lateness of the late cycles
+  int64_t noise_ns = 0;       // gaps overlapping their [deadline, wake-up]
+};
+
+// Records must come from an observer of the Timer run (wake on
+// CLOCK_REALTIME, i.e. SystemClock); events from NoiseDetector::events().
+// With out, also lists the top latest cycles with their overlapping noise.
+inline NoiseCorrelation correlate_noise(const vector<NoiseEvent> &events,
+                                        const vector<CycleRecord> &records,
+                                        int64_t late_ns,
+                                        ostream *out = nullptr,
+                                        size_t top = 10) {
+  NoiseCorrelation c;
+  struct Late {
+    const CycleRecord *r;
+    int64_t noise;
+  };
+  vector<Late> late;
+  for (const CycleRecord &r : records) {
+    c.cycles++;
+    if (r.lateness <= late_ns) {
+      continue;
+    }
+    int64_t deadline = r.wake - r.lateness, noise = 0;
+    // first gap ending after the deadline (gaps do not overlap)
+    auto it = lower_bound(events.begin(), events.end(), deadline,
+                          [](const NoiseEvent &e, int64_t t) {
+                            return e.start + e.gap <= t;
+                          });
+    for (; it != events.end() && it->start < r.wake; ++it)
+      noise += min(it->start + it->gap, r.wake) - max(it->start, deadline);
+    c.late++;
+    c.lateness_ns += r.lateness;
+    c.noise_ns += noise;
+    if (noise > 0)
+      c.late_with_noise++;
+    late.push_back({&r, noise});
+  }
+  if (out) {
+    *out << "Late cycles (lateness > " << late_ns / 1000.0 << " us): "
+         << c.late << " of " << c.cycles << ", " << c.late_with_noise
+         << " overlapping noise; noise covers "
+         << (c.lateness_ns > 0 ? 100.0 * c.noise_ns / c.lateness_ns : 0)
+         << "% of their lateness" << endl;
+    sort(late.begin(), late.end(), [](const Late &a, const Late &b) {
+      return a.r->lateness > b.r->lateness;
+    });
+    for (size_t i = 0; i < min(top, late.size()); i++)
+      *out << "  seq " << late[i].r->seq << ": late "
+           << late[i].r->lateness / 1000.0 << " us, noise "
+           << late[i].noise / 1000.0 << " us" << endl;
+  }
+  return c;
+}
+
+#endif // NOISE_DETECTOR_HPP
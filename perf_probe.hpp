@@ -0,0 +1,297 @@
+/*
+Per-cycle hardware and software counters for Timer
+
+PerfProbe opens a group of perf_event counters on the thread running the
+loop:
+
+  - instructions, cycles, cache misses, branch misses (hardware, user space
+    only, so that perf_event_paranoid <= 2 is enough);
+  - page faults and context switches (software; context switches need
+    perf_event_paranoid <= 1 or CAP_PERFMON).
+
+The whole group is read with a single read() at the wake-up (on_wake) and
+at the end of the loop body (on_sleep): the differences are the counts of the
+loop body, stored in CycleRecord::perf of the next record, next to the tet
+they belong to. Counts are scaled if the kernel multiplexed the group. On
+x86-64, a group of hardware events only is read with rdpmc from user space
+when the kernel allows it (cap_user_rdpmc), with no syscalls at all.
+
+Events that cannot be opened (e.g. no PMU in a VM) are skipped: events()
+tells which ones are counted. Per-event means and maxima are published
+through a seqlock for any thread:
+
+  PerfProbe perf;
+  t.attach_probe(perf);
+  ...
+  map<string, double> m;
+  perf.stats(m); // perf_instructions, perf_instructions_max, perf_ipc, ...
+*/
+#ifndef PERF_PROBE_HPP
+#define PERF_PROBE_HPP
+
+#include "seqlock.hpp"
+#include "timer.hpp"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static constexpr uint32_t PERF_ALL = (1u << PERF_EVENTS) - 1;
+static constexpr uint32_t PERF_HARDWARE =
+    1u << PERF_INSTRUCTIONS | 1u << PERF_CYCLES | 1u << PERF_CACHE_MISSES |
+    1u << PERF_BRANCH_MISSES;
+
+static const char *const PERF_EVENT_NAMES[PERF_EVENTS] = {
+    "instructions",  "cycles",      "cache_misses",
+    "branch_misses", "page_faults", "context_switches"};
+
+// Loop body counters over all the cycles sampled so far
+struct PerfSnapshot {
+  uint64_t n = 0;
+  uint32_t events = 0; // PerfEvent bits actually counted
+  double mean[PERF_EVENTS] = {0};
+  uint64_t max[PERF_EVENTS] = {0};
+};
+
+class PerfProbe : public CycleProbe {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // events is a mask of PerfEvent bits
+  explicit PerfProbe(uint32_t events = PERF_ALL, bool rdpmc = true)
+      : _requested(events), _use_rdpmc(rdpmc) {}
+
+  ~PerfProbe() { close_all(); }
+
+  PerfProbe(const PerfProbe &) = delete;
+  PerfProbe &operator=(const PerfProbe &) = delete;
+
+  // Opens the counters on the calling thread; called by the first on_wake()
+  // otherwise. Returns the mask of the events that could be opened.
+  uint32_t bind() {
+    close_all();
+    _bound = true;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+      if (!(_requested & 1u << e)) {
+        continue;
+      }
+      int fd = open_event(e, _n > 0 ? _fd[0] : -1);
+      if (fd < 0) {
+        continue;
+      }
+      _fd[_n] = fd;
+      _event[_n++] = e;
+      _events |= 1u << e;
+    }
+    _rdpmc = _use_rdpmc && _n > 0 && map_pages();
+    if (_n > 0) {
+      ioctl(_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    PerfSnapshot s;
+    s.events = _events;
+    _published.store(s);
+    return _events;
+  }
+
+  uint32_t events() const { return _events; }
+
+  // True if the counters are read with rdpmc rather than read()
+  bool rdpmc() const { return _rdpmc; }
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_sleep(CycleRecord &record) override {
+    Sample end;
+    _valid = _started && sample(end);
+    if (!_valid) {
+      return;
+    }
+    double scale = 1;
+    uint64_t enabled = end.enabled - _start.enabled;
+    uint64_t running = end.running - _start.running;
+    if (running == 0 && enabled > 0) {
+      _valid = false; // the group never got on the PMU
+      return;
+    } else if (running < enabled) {
+      scale = (double)enabled / running;
+    }
+    _acc.n++;
+    for (size_t i = 0; i < _n; i++) {
+      int e = _event[i];
+      uint64_t d = end.value[i] - _start.value[i];
+      if (scale != 1)
+        d = (uint64_t)(d * scale + 0.5);
+      record.perf[e] = d;
+      _acc.mean[e] += (d - _acc.mean[e]) / _acc.n;
+      _acc.max[e] = max(_acc.max[e], d);
+    }
+    _acc.events = _events;
+    _published.store(_acc);
+  }
+
+  void on_wake(CycleRecord &record) override {
+    if (!_bound) {
+      bind();
+    }
+    if (_valid) {
+      record.probes |= CycleRecord::PROBE_PERF;
+    }
+    _started = sample(_start);
+  }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  PerfSnapshot snapshot() const { return _published.load(); }
+
+  // Adds perf_<event> (mean per cycle) and perf_<event>_max for the counted
+  // events, and perf_ipc if both instructions and cycles are counted
+  void stats(map<string, double> &out) const {
+    PerfSnapshot s = _published.load();
+    for (int e = 0; e < PERF_EVENTS; e++) {
+      if (!(s.events & 1u << e))
+        continue;
+      string name = string("perf_") + PERF_EVENT_NAMES[e];
+      out[name] = s.mean[e];
+      out[name + "_max"] = s.max[e];
+    }
+    uint32_t ipc = 1u << PERF_INSTRUCTIONS | 1u << PERF_CYCLES;
+    if ((s.events & ipc) == ipc && s.mean[PERF_CYCLES] > 0) {
+      out["perf_ipc"] = s.mean[PERF_INSTRUCTIONS] / s.mean[PERF_CYCLES];
+    }
+  }
+
+private:
+  struct Sample {
+    uint64_t enabled = 0, running = 0;
+    uint64_t value[PERF_EVENTS] = {0};
+  };
+
+  // ATTRIBUTES ----------------------------------------------------------------
+  uint32_t _requested, _events = 0;
+  bool _use_rdpmc, _rdpmc = false;
+  bool _bound = false, _started = false, _valid = false;
+  int _fd[PERF_EVENTS];
+  int _event[PERF_EVENTS];         // PerfEvent of each open counter
+  perf_event_mmap_page *_page[PERF_EVENTS];
+  size_t _n = 0;                   // open counters; _fd[0] is the leader
+  Sample _start;
+  PerfSnapshot _acc;
+  Seqlock<PerfSnapshot> _published;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  static int open_event(int event, int group) {
+    static const struct {
+      uint32_t type;
+      uint64_t config;
+    } events[PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}};
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[event].type;
+    attr.config = events[event].config;
+    attr.disabled = group < 0; // the leader enables the whole group
+    attr.exclude_hv = 1;
+    // context switches happen in the kernel; the rest is counted in user space
+    attr.exclude_kernel = event != PERF_CONTEXT_SWITCHES;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                        PERF_FLAG_FD_CLOEXEC);
+  }
+
+  // Maps the user pages of the counters for rdpmc: hardware events only
+  bool map_pages() {
+#if defined(__x86_64__)
+    if ((_events & ~PERF_HARDWARE) != 0) {
+      return false;
+    }
+    size_t page = sysconf(_SC_PAGESIZE), mapped = 0;
+    bool ok = true;
+    for (; ok && mapped < _n; mapped++) {
+      void *p = mmap(NULL, page, PROT_READ, MAP_SHARED, _fd[mapped], 0);
+      if (p == MAP_FAILED)
+        break;
+      _page[mapped] = (perf_event_mmap_page *)p;
+      ok = _page[mapped]->cap_user_rdpmc;
+    }
+    if (ok && mapped == _n) {
+      return true;
+    }
+    for (size_t i = 0; i < mapped; i++)
+      munmap(_page[i], page);
+#endif
+    return false;
+  }
+
+  void close_all() {
+    if (_rdpmc) {
+      for (size_t i = 0; i < _n; i++)
+        munmap(_page[i], sysconf(_SC_PAGESIZE));
+    }
+    for (size_t i = 0; i < _n; i++)
+      close(_fd[i]);
+    _n = 0;
+    _events = 0;
+    _rdpmc = _started = _valid = false;
+  }
+
+  bool sample(Sample &s) {
+    if (_n == 0) {
+      return false;
+    }
+#if defined(__x86_64__)
+    if (_rdpmc) {
+      return read_rdpmc(s);
+    }
+#endif
+    // { nr, time_enabled, time_running, value[nr] }
+    uint64_t buf[3 + PERF_EVENTS];
+    ssize_t len = (3 + _n) * sizeof(uint64_t);
+    if (read(_fd[0], buf, len) != len || buf[0] != _n) {
+      return false;
+    }
+    s.enabled = buf[1];
+    s.running = buf[2];
+    for (size_t i = 0; i < _n; i++)
+      s.value[i] = buf[3 + i];
+    return true;
+  }
+
+#if defined(__x86_64__)
+  // Self-monitoring read of the mmap page protocol (see perf_event_open(2));
+  // fails if a counter is not on the PMU right now
+  bool read_rdpmc(Sample &s) {
+    for (size_t i = 0; i < _n; i++) {
+      volatile perf_event_mmap_page *pc = _page[i];
+      uint32_t seq, idx;
+      uint64_t count;
+      do {
+        seq = pc->lock;
+        atomic_signal_fence(memory_order_seq_cst);
+        idx = pc->index;
+        count = pc->offset;
+        if (idx == 0) {
+          return false;
+        }
+        uint32_t lo, hi;
+        __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+        int shift = 64 - pc->pmc_width;
+        uint64_t pmc = (uint64_t)hi << 32 | lo;
+        count += (int64_t)(pmc << shift) >> shift; // sign-extend
+        atomic_signal_fence(memory_order_seq_cst);
+      } while (pc->lock != seq);
+      s.value[i] = count;
+    }
+    s.enabled = s.running = 0; // not multiplexed while on the PMU
+    return true;
+  }
+#endif
+};
+
+#endif // PERF_PROBE_HPP
@@ -0,0 +1,315 @@
+/*
+Cycle-synchronous I/O pipeline on top of Timer
+
+A loop body usually reads inputs, computes and writes outputs, all on the
+timer thread within one period. Pipeline splits it into three stages:
+
+  input    on the timer thread, right after the wake-up: Device::read()
+  compute  on its own thread: the compute function, inputs to outputs
+  output   on its own thread: Device::write()
+
+Frames (cycle number, deadline, inputs, outputs) go from stage to stage
+through lock-free single-producer queues (SpscQueue), allocated at
+construction: no stage ever blocks another. With the stage threads pinned to
+their own cores, each stage has a whole period for every frame, so the loop
+keeps up as long as the slowest stage (not their sum) fits in a period, at
+the price of a longer latency from the inputs to the outputs.
+
+That latency can be made fixed: with output_delay = D cycles, the outputs of
+the frame read at deadline k are released at deadline k + D, whatever the
+compute time, and the I/O timing is as deterministic as the timer. Outputs
+ready after their release time are written at once and counted as late.
+With threaded = false all the stages run in order on the timer thread, as a
+serial loop body would, for comparison; output_delay is then ignored, since
+waiting for the release would hold the timer thread for D periods.
+
+Pipeline is a CycleObserver: attach it to the timer, and every wait() feeds
+one frame to it.
+
+  MockDevice<4> dev;                           // see mock_device.hpp
+  auto law = [](const auto &in, auto &out) { out = in; };
+  PipelineConfig cfg;
+  cfg.compute_cpu = 2;
+  cfg.output_cpu = 3;
+  cfg.output_delay = 2;                        // outputs 2 periods after
+  Pipeline<MockDevice<4>, decltype(law)> p(dev, law, milliseconds(1), cfg);
+  p.start();
+  t.attach(p);
+  ... t.wait() loop on CPU 1 ...
+  p.stop();
+
+The time spent in each stage and between them, and the end-to-end latency
+(from the deadline to the end of the write), are measured, with min, max and
+mean readable from any thread.
+
+A Device has Input and Output types and two methods, called by one thread
+each: read(uint64_t seq, Input &) and write(uint64_t seq, const Output &).
+*/
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include "cycle_clock.hpp"
+#include "helper_thread.hpp"
+#include "seqlock.hpp"
+#include "spsc_queue.hpp"
+#include "timer.hpp"
+#include <thread>
+
+enum PipelineStage {
+  STAGE_INPUT,      // Device::read()
+  STAGE_TO_COMPUTE, // end of the read to the start of the compute
+  STAGE_COMPUTE,    // compute function
+  STAGE_TO_OUTPUT,  // end of the compute to the write, release wait included
+  STAGE_OUTPUT,     // Device::write()
+  STAGE_END_TO_END, // deadline to the end of the write
+  PIPELINE_STAGES
+};
+
+static const char *PIPELINE_STAGE_NAMES[PIPELINE_STAGES] = {
+    "input", "to_compute", "compute", "to_output", "output", "end_to_end"};
+
+// Statistics of a stage, in nanoseconds
+struct StageStats {
+  uint64_t n = 0;
+  int64_t min = 0;
+  int64_t max = 0;
+  double mean = 0;
+};
+
+struct PipelineConfig {
+  bool threaded = true;      // false: all the stages on the timer thread
+  int compute_cpu = -1;      // CPU of the compute thread, -1: not pinned
+  int output_cpu = -1;       // CPU of the output thread, -1: not pinned
+  int priority = 0;          // SCHED_FIFO priority of both, 0: SCHED_OTHER
+  size_t depth = 8;          // frames queued between two stages
+  unsigned output_delay = 0; // cycles from deadline to write, threaded only
+  nanoseconds idle = microseconds(10); // sleep on an empty queue, 0: spin
+  clockid_t clock = CLOCK_REALTIME;    // clock of the timer
+};
+
+template <typename Input, typename Output> struct PipelineFrame {
+  uint64_t seq = 0;
+  int64_t deadline = 0; // ns on the timer clock
+  uint64_t done = 0;    // end of the previous stage, CycleClock stamp
+  Input input{};
+  Output output{};
+};
+
+template <typename Device, typename Compute>
+class Pipeline : public CycleObserver {
+public:
+  using Input = typename Device::Input;
+  using Output = typename Device::Output;
+  using Frame = PipelineFrame<Input, Output>;
+
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // interval is the period of the timer the pipeline is attached to
+  template <typename T>
+  Pipeline(Device &device, Compute compute, T interval,
+           const PipelineConfig &config = PipelineConfig())
+      : _device(device), _compute(compute), _config(config),
+        _interval(duration_cast<nanoseconds>(interval).count()),
+        _clock(CycleClock::global()), _to_compute(config.depth),
+        _to_output(config.depth) {}
+
+  ~Pipeline() { stop(); }
+
+  Pipeline(const Pipeline &) = delete;
+  Pipeline &operator=(const Pipeline &) = delete;
+
+  // METHODS -------------------------------------------------------------------
+
+  // Starts the compute and output threads (none if not threaded)
+  void start() {
+    if (!_config.threaded || _compute_thread.joinable()) {
+      return;
+    }
+    _computing = _outputting = true;
+    _compute_thread = thread([this] { compute_loop(); });
+    _output_thread = thread([this] { output_loop(); });
+  }
+
+  // Stops the threads once the frames already read went through
+  void stop() {
+    if (!_compute_thread.joinable()) {
+      return;
+    }
+    _computing = false;
+    _compute_thread.join();
+    _outputting = false;
+    _output_thread.join();
+  }
+
+  // Nominal latency from the deadline to the outputs, if output_delay is set
+  // (0 if not threaded)
+  nanoseconds latency() const {
+    return nanoseconds(_config.threaded ? _config.output_delay * _interval : 0);
+  }
+
+  const PipelineConfig &config() const { return _config; }
+
+  // RT SIDE -------------------------------------------------------------------
+
+  // Input stage
+  void on_cycle(const CycleRecord &record) override {
+    Frame &f = _frame;
+    f.seq = record.seq;
+    f.deadline = record.wake - record.lateness;
+    uint64_t t0 = _clock.stamp();
+    _device.read(f.seq, f.input);
+    f.done = _clock.stamp();
+    update(STAGE_INPUT, _clock.to_ns(f.done - t0));
+    if (!_config.threaded) {
+      compute(f);
+      output(f);
+    } else if (!_to_compute.push(f)) {
+      _overruns.fetch_add(1, memory_order_relaxed);
+    }
+  }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  StageStats stats(PipelineStage stage) const {
+    return _published[stage].load();
+  }
+
+  // Frames written
+  uint64_t frames() const { return _frames.load(memory_order_relaxed); }
+
+  // Frames dropped because the next stage had a full queue
+  uint64_t overruns() const { return _overruns.load(memory_order_relaxed); }
+
+  // Outputs written after their release time
+  uint64_t late() const { return _late.load(memory_order_relaxed); }
+
+  // Stage threads that could not be pinned or get their priority
+  unsigned setup_failures() const { return _setup_failures.load(); }
+
+  // Adds pipeline_<stage> (mean) and pipeline_<stage>_max, in nanoseconds,
+  // and pipeline_frames, pipeline_overruns and pipeline_late
+  void stats(map<string, double> &out) const {
+    for (size_t i = 0; i < PIPELINE_STAGES; i++) {
+      StageStats s = _published[i].load();
+      if (s.n == 0)
+        continue;
+      string key = string("pipeline_") + PIPELINE_STAGE_NAMES[i];
+      out[key] = s.mean;
+      out[key + "_max"] = s.max;
+    }
+    out["pipeline_frames"] = frames();
+    out["pipeline_overruns"] = overruns();
+    out["pipeline_late"] = late();
+  }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  Device &_device;
+  Compute _compute;
+  PipelineConfig _config;
+  int64_t _interval;
+  const CycleClock &_clock;
+  Frame _frame;  // written by the timer thread only
+  SpscQueue<Frame> _to_compute, _to_output;
+  StageStats _acc[PIPELINE_STAGES]; // each written by a single stage
+  Seqlock<StageStats> _published[PIPELINE_STAGES];
+  atomic<uint64_t> _frames{0}, _overruns{0}, _late{0};
+  atomic<unsigned> _setup_failures{0};
+  atomic<bool> _computing{false}, _outputting{false};
+  thread _compute_thread, _output_thread;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void compute(Frame &f) {
+    uint64_t t0 = _clock.stamp();
+    if (_config.threaded)
+      update(STAGE_TO_COMPUTE, _clock.to_ns(t0 - f.done));
+    _compute(f.input, f.output);
+    f.done = _clock.stamp();
+    update(STAGE_COMPUTE, _clock.to_ns(f.done - t0));
+  }
+
+  void output(Frame &f) {
+    if (_config.output_delay > 0 && _config.threaded) {
+      int64_t release = f.deadline + _config.output_delay * _interval;
+      if (clock_ns() > release) {
+        _late.store(_late.load(memory_order_relaxed) + 1,
+                    memory_order_relaxed);
+      } else {
+        struct timespec ts = {(time_t)(release / 1000000000),
+                              (long)(release % 1000000000)};
+        while (clock_nanosleep(_config.clock, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR) {
+        }
+      }
+    }
+    uint64_t t0 = _clock.stamp();
+    if (_config.threaded)
+      update(STAGE_TO_OUTPUT, _clock.to_ns(t0 - f.done));
+    _device.write(f.seq, f.output);
+    update(STAGE_OUTPUT, _clock.to_ns(_clock.stamp() - t0));
+    update(STAGE_END_TO_END, clock_ns() - f.deadline);
+    _frames.store(_frames.load(memory_order_relaxed) + 1,
+                  memory_order_relaxed);
+  }
+
+  void compute_loop() {
+    if (!setup_helper_thread(_config.compute_cpu, _config.priority).ok())
+      _setup_failures.fetch_add(1);
+    Frame f;
+    for (;;) {
+      if (_to_compute.pop(f)) {
+        compute(f);
+        if (!_to_output.push(f))
+          _overruns.fetch_add(1, memory_order_relaxed);
+      } else if (!_computing.load(memory_order_acquire)) {
+        break;
+      } else {
+        idle();
+      }
+    }
+  }
+
+  void output_loop() {
+    if (!setup_helper_thread(_config.output_cpu, _config.priority).ok())
+      _setup_failures.fetch_add(1);
+    Frame f;
+    for (;;) {
+      if (_to_output.pop(f)) {
+        output(f);
+      } else if (!_outputting.load(memory_order_acquire)) {
+        break;
+      } else {
+        idle();
+      }
+    }
+  }
+
+  void idle() const {
+    if (_config.idle.count() > 0) {
+      this_thread::sleep_for(_config.idle);
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__)
+      __asm__ volatile("yield");
+#endif
+    }
+  }
+
+  // single writer per stage: plain updates, then a seqlock store
+  void update(PipelineStage stage, int64_t ns) {
+    StageStats &s = _acc[stage];
+    s.n++;
+    s.min = s.n == 1 ? ns : min(s.min, ns);
+    s.max = max(s.max, ns);
+    s.mean += (ns - s.mean) / s.n;
+    _published[stage].store(s);
+  }
+
+  int64_t clock_ns() const {
+    struct timespec ts;
+    clock_gettime(_config.clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+};
+
+#endif // PIPELINE_HPP
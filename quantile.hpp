@@ -0,0 +1,370 @@
+/*
+Streaming quantile estimation
+
+P2Quantile estimates a single quantile of a stream in constant memory and
+O(1) time per sample, with the P-square algorithm (Jain & Chlamtac, 1985):
+five markers track the minimum, the p/2, p, (1+p)/2 quantiles and the
+maximum, and are moved by piecewise-parabolic interpolation.
+
+TDigest (Dunning, merging variant) summarizes the whole distribution in a
+bounded number of centroids, denser at the tails, so that any quantile can
+be queried; samples are buffered and merged in batches. All memory is
+reserved at construction.
+
+P2Quantiles and TDigestQuantiles estimate the quantiles of period (dt), TET
+and wake latency listed in QUANTILE_PS and publish them through a seqlock;
+they are used by Timer through QuantileStats (see stats_collectors.hpp).
+*/
+#ifndef QUANTILE_HPP
+#define QUANTILE_HPP
+
+#include "seqlock.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+// Quantiles reported by the quantile policies
+static constexpr double QUANTILE_PS[] = {0.5, 0.9, 0.99, 0.999};
+static constexpr size_t QUANTILE_N = sizeof(QUANTILE_PS) / sizeof(double);
+
+class P2Quantile {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  explicit P2Quantile(double p = 0.99) : _p(p) { reset(); }
+
+  void reset() {
+    _count = 0;
+    for (int i = 0; i < 5; i++)
+      _n[i] = i;
+    _np[0] = 0;
+    _np[1] = 2 * _p;
+    _np[2] = 4 * _p;
+    _np[3] = 2 + 2 * _p;
+    _np[4] = 4;
+    _dn[0] = 0;
+    _dn[1] = _p / 2;
+    _dn[2] = _p;
+    _dn[3] = (1 + _p) / 2;
+    _dn[4] = 1;
+  }
+
+  // METHODS -------------------------------------------------------------------
+
+  void add(double x) {
+    if (_count < 5) {
+      _q[_count++] = x;
+      if (_count == 5)
+        std::sort(_q, _q + 5);
+      return;
+    }
+    _count++;
+    int k;
+    if (x < _q[0]) {
+      _q[0] = x;
+      k = 0;
+    } else if (x < _q[1]) {
+      k = 0;
+    } else if (x < _q[2]) {
+      k = 1;
+    } else if (x < _q[3]) {
+      k = 2;
+    } else if (x <= _q[4]) {
+      k = 3;
+    } else {
+      _q[4] = x;
+      k = 3;
+    }
+    for (int i = k + 1; i < 5; i++)
+      _n[i]++;
+    for (int i = 0; i < 5; i++)
+      _np[i] += _dn[i];
+    for (int i = 1; i < 4; i++) {
+      double d = _np[i] - _n[i];
+      if ((d >= 1 && _n[i + 1] - _n[i] > 1) ||
+          (d <= -1 && _n[i - 1] - _n[i] < -1)) {
+        int s = d > 0 ? 1 : -1;
+        double q = parabolic(i, s);
+        if (_q[i - 1] < q && q < _q[i + 1])
+          _q[i] = q;
+        else
+          _q[i] = _q[i] + s * (_q[i + s] - _q[i]) / (_n[i + s] - _n[i]);
+        _n[i] += s;
+      }
+    }
+  }
+
+  // Current estimate; exact while fewer than five samples have been seen
+  double value() const {
+    if (_count >= 5) {
+      return _q[2];
+    }
+    if (_count == 0) {
+      return NAN;
+    }
+    double q[5];
+    std::copy(_q, _q + _count, q);
+    std::sort(q, q + _count);
+    return q[std::min<size_t>(_count - 1, (size_t)(_p * _count))];
+  }
+
+  double p() const { return _p; }
+
+  size_t count() const { return _count; }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  double _p;
+  size_t _count = 0;
+  double _q[5] = {0};  // marker heights
+  double _n[5];        // marker positions
+  double _np[5];       // desired marker positions
+  double _dn[5];       // increments of the desired positions
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  double parabolic(int i, int s) const {
+    return _q[i] + s / (_n[i + 1] - _n[i - 1]) *
+                       ((_n[i] - _n[i - 1] + s) * (_q[i + 1] - _q[i]) /
+                            (_n[i + 1] - _n[i]) +
+                        (_n[i + 1] - _n[i] - s) * (_q[i] - _q[i - 1]) /
+                            (_n[i] - _n[i - 1]));
+  }
+};
+
+class TDigest {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // Higher compression gives more centroids (about 1.6 x compression at most)
+  // and better accuracy
+  explicit TDigest(double compression = 100, size_t buffer = 256)
+      : _compression(compression), _buffer_size(buffer) {
+    size_t max_centroids = (size_t)(2 * compression) + 10;
+    _centroids.reserve(max_centroids);
+    _temp.reserve(max_centroids + buffer);
+    _buffer.reserve(buffer);
+  }
+
+  void reset() {
+    _centroids.clear();
+    _buffer.clear();
+    _total = 0;
+    _min = INFINITY;
+    _max = -INFINITY;
+  }
+
+  // METHODS -------------------------------------------------------------------
+
+  void add(double x) {
+    _buffer.push_back(x);
+    _min = std::min(_min, x);
+    _max = std::max(_max, x);
+    if (_buffer.size() == _buffer_size)
+      merge();
+  }
+
+  // Merges the buffered samples into the centroids
+  void merge() {
+    if (_buffer.empty()) {
+      return;
+    }
+    std::sort(_buffer.begin(), _buffer.end());
+    _temp.clear();
+    size_t i = 0, j = 0;
+    while (i < _centroids.size() || j < _buffer.size()) {
+      if (j == _buffer.size() ||
+          (i < _centroids.size() && _centroids[i].mean <= _buffer[j]))
+        _temp.push_back(_centroids[i++]);
+      else
+        _temp.push_back({_buffer[j++], 1});
+    }
+    _total += _buffer.size();
+    _buffer.clear();
+
+    _centroids.clear();
+    Centroid current = _temp[0];
+    double before = 0; // weight of the centroids already emitted
+    double k_lo = k(0);
+    for (size_t n = 1; n < _temp.size(); n++) {
+      double q_hi = (before + current.weight + _temp[n].weight) / _total;
+      if (k(q_hi) - k_lo <= 1) {
+        current.weight += _temp[n].weight;
+        current.mean +=
+            (_temp[n].mean - current.mean) * _temp[n].weight / current.weight;
+      } else {
+        _centroids.push_back(current);
+        before += current.weight;
+        k_lo = k(before / _total);
+        current = _temp[n];
+      }
+    }
+    _centroids.push_back(current);
+  }
+
+  // Estimate of the p-quantile; merges the buffer first
+  double quantile(double p) {
+    merge();
+    if (_centroids.empty()) {
+      return NAN;
+    }
+    if (_centroids.size() == 1) {
+      return _centroids[0].mean;
+    }
+    double target = p * _total;
+    double cum = 0; // weight before the current centroid
+    double prev_center = 0, prev_mean = _min;
+    for (const Centroid &c : _centroids) {
+      double center = cum + c.weight / 2;
+      if (target < center) {
+        if (center == prev_center)
+          return c.mean;
+        return prev_mean + (c.mean - prev_mean) * (target - prev_center) /
+                               (center - prev_center);
+      }
+      prev_center = center;
+      prev_mean = c.mean;
+      cum += c.weight;
+    }
+    if (_total == prev_center)
+      return _max;
+    return prev_mean +
+           (_max - prev_mean) * (target - prev_center) / (_total - prev_center);
+  }
+
+  size_t centroids() const { return _centroids.size(); }
+
+  double count() const { return _total + _buffer.size(); }
+
+private:
+  struct Centroid {
+    double mean, weight;
+  };
+
+  // ATTRIBUTES ----------------------------------------------------------------
+  double _compression;
+  size_t _buffer_size;
+  std::vector<Centroid> _centroids, _temp;
+  std::vector<double> _buffer;
+  double _total = 0;
+  double _min = INFINITY, _max = -INFINITY;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  // Scale function k1: centroids are smaller near q = 0 and q = 1
+  double k(double q) const {
+    return _compression / (2 * M_PI) * asin(2 * std::min(1.0, q) - 1);
+  }
+};
+
+// QUANTILE POLICIES -----------------------------------------------------------
+
+// Published quantiles of period, TET and wake latency, in the order of
+// QUANTILE_PS
+struct QuantileSnapshot {
+  double dt[QUANTILE_N] = {0};
+  double tet[QUANTILE_N] = {0};
+  double latency[QUANTILE_N] = {0};
+};
+
+// Adds the published quantiles to a stats map, as dt_p50, tet_p99.9,
+// latency_p99, ...
+inline void quantile_stats(const QuantileSnapshot &s,
+                           std::map<std::string, double> &out) {
+  for (size_t i = 0; i < QUANTILE_N; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "p%g", QUANTILE_PS[i] * 100);
+    out[std::string("dt_") + name] = s.dt[i];
+    out[std::string("tet_") + name] = s.tet[i];
+    out[std::string("latency_") + name] = s.latency[i];
+  }
+}
+
+// One P2Quantile per quantile and quantity: O(1) per sample, published at
+// every sample
+class P2Quantiles {
+public:
+  P2Quantiles() { reset(); }
+
+  void add(double dt, double tet, double latency) {
+    QuantileSnapshot s;
+    for (size_t i = 0; i < QUANTILE_N; i++) {
+      _dt[i].add(dt);
+      _tet[i].add(tet);
+      _latency[i].add(latency);
+      s.dt[i] = _dt[i].value();
+      s.tet[i] = _tet[i].value();
+      s.latency[i] = _latency[i].value();
+    }
+    _published.store(s);
+  }
+
+  void reset() {
+    for (size_t i = 0; i < QUANTILE_N; i++) {
+      _dt[i] = P2Quantile(QUANTILE_PS[i]);
+      _tet[i] = P2Quantile(QUANTILE_PS[i]);
+      _latency[i] = P2Quantile(QUANTILE_PS[i]);
+    }
+    _published.store(QuantileSnapshot());
+  }
+
+  void stats(std::map<std::string, double> &out) const {
+    quantile_stats(_published.load(), out);
+  }
+
+private:
+  P2Quantile _dt[QUANTILE_N], _tet[QUANTILE_N], _latency[QUANTILE_N];
+  Seqlock<QuantileSnapshot> _published;
+};
+
+// One t-digest per quantity: amortized O(log buffer) per sample, published
+// at every merge of the buffer (every 256 samples by default)
+class TDigestQuantiles {
+public:
+  explicit TDigestQuantiles(double compression = 100, size_t buffer = 256)
+      : _dt(compression, buffer), _tet(compression, buffer),
+        _latency(compression, buffer), _every(buffer) {}
+
+  void add(double dt, double tet, double latency) {
+    _dt.add(dt);
+    _tet.add(tet);
+    _latency.add(latency);
+    if (++_n % _every == 0) {
+      publish();
+    }
+  }
+
+  void reset() {
+    _dt.reset();
+    _tet.reset();
+    _latency.reset();
+    _n = 0;
+    _published.store(QuantileSnapshot());
+  }
+
+  void stats(std::map<std::string, double> &out) const {
+    quantile_stats(_published.load(), out);
+  }
+
+  // Direct access, from the thread running the loop only
+  TDigest &dt() { return _dt; }
+  TDigest &tet() { return _tet; }
+  TDigest &latency() { return _latency; }
+
+private:
+  TDigest _dt, _tet, _latency;
+  size_t _every, _n = 0;
+  Seqlock<QuantileSnapshot> _published;
+
+  void publish() {
+    QuantileSnapshot s;
+    for (size_t i = 0; i < QUANTILE_N; i++) {
+      s.dt[i] = _dt.quantile(QUANTILE_PS[i]);
+      s.tet[i] = _tet.quantile(QUANTILE_PS[i]);
+      s.latency[i] = _latency.quantile(QUANTILE_PS[i]);
+    }
+    _published.store(s);
+  }
+};
+
+#endif // QUANTILE_HPP
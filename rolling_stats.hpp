@@ -0,0 +1,239 @@
+/*
+Windowed rolling statistics for Timer
+
+RollingWindow keeps the samples of the last N cycles, or of the last T
+seconds (bounded by N), and gives mean, variance, min and max in O(1) per
+sample: sums are exact integer sums of nanoseconds (so removing old samples
+never drifts), and min/max come from monotonic deques.
+
+RollingStats is a Timer observer holding windows for dt and TET, published
+through a seqlock for other threads, and producing per-period rollups (e.g.
+one per second) that go to a lock-free queue and, optionally, to the
+shared-memory telemetry.
+
+  RollingStats roll(1000, seconds(0), seconds(1), &telemetry);
+  t.attach(roll);
+  ...
+  WindowStats w = roll.dt();      // from any thread
+*/
+#ifndef ROLLING_STATS_HPP
+#define ROLLING_STATS_HPP
+
+#include "seqlock.hpp"
+#include "spsc_queue.hpp"
+#include "telemetry.hpp"
+#include "timer.hpp"
+#include <vector>
+
+// Statistics of a window, in nanoseconds
+struct WindowStats {
+  uint64_t n = 0;
+  double mean = 0;
+  double variance = 0;
+  int64_t min = 0;
+  int64_t max = 0;
+
+  double sd() const { return sqrt(variance); }
+};
+
+class RollingWindow {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // span = 0 gives a window of the last capacity samples; otherwise the
+  // window holds the samples of the last span, at most capacity of them
+  explicit RollingWindow(size_t capacity = 1000,
+                         nanoseconds span = nanoseconds(0))
+      : _samples(max<size_t>(1, capacity)), _min(_samples.size()),
+        _max(_samples.size()), _span(span.count()) {}
+
+  // METHODS -------------------------------------------------------------------
+
+  void add(int64_t t, int64_t x) {
+    if (_n == _samples.size()) {
+      evict();
+    }
+    if (_span > 0) {
+      while (_n > 0 && _samples[_first % _samples.size()].t <= t - _span)
+        evict();
+    }
+    _samples[(_first + _n) % _samples.size()] = {t, x};
+    uint64_t seq = _first + _n++;
+    _sum += x;
+    _sumsq += (__int128)x * x;
+    _min.push(seq, x, [](int64_t a, int64_t b) { return a >= b; });
+    _max.push(seq, x, [](int64_t a, int64_t b) { return a <= b; });
+  }
+
+  void clear() {
+    _first = _n = 0;
+    _sum = 0;
+    _sumsq = 0;
+    _min.clear();
+    _max.clear();
+  }
+
+  size_t size() const { return _n; }
+
+  WindowStats stats() const {
+    WindowStats s;
+    s.n = _n;
+    if (_n == 0) {
+      return s;
+    }
+    s.mean = (double)_sum / _n;
+    if (_n > 1) {
+      // exact up to the final conversion
+      __int128 num = (__int128)_n * _sumsq - (__int128)_sum * _sum;
+      s.variance = (double)num / ((double)_n * (_n - 1));
+    }
+    s.min = _min.front();
+    s.max = _max.front();
+    return s;
+  }
+
+private:
+  struct Sample {
+    int64_t t, x;
+  };
+
+  // Fixed-capacity monotonic deque of (seq, x)
+  class MonoDeque {
+  public:
+    explicit MonoDeque(size_t capacity) : _items(capacity) {}
+
+    template <typename Dominates>
+    void push(uint64_t seq, int64_t x, Dominates dominates) {
+      while (_n > 0 && dominates(back().x, x))
+        _n--;
+      _items[(_head + _n++) % _items.size()] = {seq, x};
+    }
+
+    void expire(uint64_t seq) {
+      if (_n > 0 && _items[_head].seq == seq) {
+        _head = (_head + 1) % _items.size();
+        _n--;
+      }
+    }
+
+    int64_t front() const { return _items[_head].x; }
+
+    void clear() { _head = _n = 0; }
+
+  private:
+    struct Item {
+      uint64_t seq;
+      int64_t x;
+    };
+    vector<Item> _items;
+    size_t _head = 0, _n = 0;
+
+    Item &back() { return _items[(_head + _n - 1) % _items.size()]; }
+  };
+
+  // ATTRIBUTES ----------------------------------------------------------------
+  vector<Sample> _samples;
+  MonoDeque _min, _max;
+  int64_t _span;
+  uint64_t _first = 0; // seq of the oldest sample
+  size_t _n = 0;
+  int64_t _sum = 0;
+  __int128 _sumsq = 0;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void evict() {
+    int64_t x = _samples[_first % _samples.size()].x;
+    _sum -= x;
+    _sumsq -= (__int128)x * x;
+    _min.expire(_first);
+    _max.expire(_first);
+    _first++;
+    _n--;
+  }
+};
+
+class RollingStats : public CycleObserver {
+public:
+  struct Snapshot {
+    WindowStats dt, tet;
+  };
+
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // Windows as in RollingWindow; a rollup is produced every rollup period of
+  // wake-up time (0 to disable), and also pushed to telemetry if given
+  RollingStats(size_t capacity = 1000, nanoseconds span = nanoseconds(0),
+               nanoseconds rollup = seconds(1),
+               TelemetryExport *telemetry = nullptr, size_t queue = 256)
+      : _dt(capacity, span), _tet(capacity, span), _period(rollup.count()),
+        _telemetry(telemetry), _rollups(queue) {}
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_cycle(const CycleRecord &r) override {
+    _dt.add(r.wake, r.dt);
+    _tet.add(r.wake, r.tet);
+    _published.store({_dt.stats(), _tet.stats()});
+    if (_period > 0) {
+      rollup(r);
+    }
+  }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  WindowStats dt() const { return _published.load().dt; }
+  WindowStats tet() const { return _published.load().tet; }
+  Snapshot snapshot() const { return _published.load(); }
+
+  // Next completed rollup, for a single non-RT consumer
+  bool pop_rollup(Rollup &rollup) { return _rollups.pop(rollup); }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  RollingWindow _dt, _tet;
+  Seqlock<Snapshot> _published;
+  int64_t _period;
+  TelemetryExport *_telemetry;
+  SpscQueue<Rollup> _rollups;
+  Rollup _current;
+  int64_t _sum = 0;
+  __int128 _sumsq = 0;
+  double _tet_sum = 0;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void rollup(const CycleRecord &r) {
+    if (_current.n > 0 && r.wake >= _current.end) {
+      if (_current.n > 1) {
+        __int128 num =
+            (__int128)_current.n * _sumsq - (__int128)_sum * _sum;
+        _current.dt_sd =
+            sqrt((double)num / ((double)_current.n * (_current.n - 1)));
+      }
+      _current.dt_mean = (double)_sum / _current.n;
+      _current.tet_mean = _tet_sum / _current.n;
+      _rollups.push(_current);
+      if (_telemetry) {
+        _telemetry->push_rollup(_current);
+      }
+      _current.n = 0;
+    }
+    if (_current.n == 0) {
+      _current = Rollup();
+      _current.start = r.wake - r.wake % _period; // aligned periods
+      _current.end = _current.start + _period;
+      _sum = 0;
+      _sumsq = 0;
+      _tet_sum = 0;
+    }
+    _current.n++;
+    if (r.ret != 0)
+      _current.errors++;
+    _sum += r.dt;
+    _sumsq += (__int128)r.dt * r.dt;
+    _tet_sum += r.tet;
+    _current.dt_min = min(_current.dt_min, r.dt);
+    _current.dt_max = max(_current.dt_max, r.dt);
+    _current.tet_max = max(_current.tet_max, r.tet);
+    _current.lateness_max = max(_current.lateness_max, r.lateness);
+  }
+};
+
+#endif // ROLLING_STATS_HPP
@@ -0,0 +1,122 @@
+/*
+Per-cycle scheduling probe for Timer
+
+SchedProbe samples, at every wake-up of the timed loop, the kernel counters
+that explain a late cycle, and stores their deltas since the previous
+wake-up in the CycleRecord seen by observers (flight recorder, telemetry):
+
+  - run delay: time spent runnable but waiting for a CPU, from
+    /proc/thread-self/schedstat (needs CONFIG_SCHEDSTATS);
+  - voluntary and involuntary context switches, minor and major page faults,
+    from getrusage(RUSAGE_THREAD);
+  - CPU and migrations, from sched_getcpu().
+
+The schedstat file is opened once, by the thread running the loop, and then
+re-read with pread(): about 2 us per cycle in total, fine at 1 kHz.
+
+  SchedProbe probe;
+  t.attach_probe(probe);
+  t.attach(recorder);
+*/
+#ifndef SCHED_PROBE_HPP
+#define SCHED_PROBE_HPP
+
+#include "timer.hpp"
+#include <cstdlib>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+class SchedProbe : public CycleProbe {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  explicit SchedProbe(bool schedstat = true, bool rusage = true,
+                      bool cpu = true)
+      : _schedstat(schedstat), _rusage(rusage), _cpu(cpu) {}
+
+  ~SchedProbe() {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  }
+
+  SchedProbe(const SchedProbe &) = delete;
+  SchedProbe &operator=(const SchedProbe &) = delete;
+
+  // Opens the schedstat file of the calling thread; called by the first
+  // on_wake() otherwise. Returns false if schedstats are not available.
+  bool bind() {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+    _fd = open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC);
+    _bound = true;
+    _first = true;
+    return _fd >= 0;
+  }
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_wake(CycleRecord &record) override {
+    if (_schedstat && !_bound) {
+      bind();
+    }
+    Sample s;
+    sample(s);
+    if (_first) {
+      _last = s;
+      _first = false;
+    }
+    record.cpu = s.cpu;
+    record.migrations = s.cpu != _last.cpu;
+    record.run_delay = s.run_delay - _last.run_delay;
+    record.nvcsw = s.nvcsw - _last.nvcsw;
+    record.nivcsw = s.nivcsw - _last.nivcsw;
+    record.minflt = s.minflt - _last.minflt;
+    record.majflt = s.majflt - _last.majflt;
+    record.probes |= CycleRecord::PROBE_SCHED;
+    _last = s;
+  }
+
+private:
+  struct Sample {
+    int32_t cpu = -1;
+    int64_t run_delay = 0;
+    uint64_t nvcsw = 0, nivcsw = 0, minflt = 0, majflt = 0;
+  };
+
+  // ATTRIBUTES ----------------------------------------------------------------
+  bool _schedstat, _rusage, _cpu;
+  bool _bound = false, _first = true;
+  int _fd = -1;
+  Sample _last;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void sample(Sample &s) {
+    if (_cpu) {
+      s.cpu = sched_getcpu();
+    }
+    if (_rusage) {
+      struct rusage ru;
+      if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+        s.nvcsw = ru.ru_nvcsw;
+        s.nivcsw = ru.ru_nivcsw;
+        s.minflt = ru.ru_minflt;
+        s.majflt = ru.ru_majflt;
+      }
+    }
+    if (_fd >= 0) {
+      // "<on-cpu ns> <run delay ns> <timeslices>"
+      char buf[96];
+      ssize_t n = pread(_fd, buf, sizeof(buf) - 1, 0);
+      if (n > 0) {
+        buf[n] = '\0';
+        char *p = buf;
+        strtoull(p, &p, 10);
+        s.run_delay = strtoll(p, nullptr, 10);
+      }
+    }
+  }
+};
+
+#endif // SCHED_PROBE_HPP
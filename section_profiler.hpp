@@ -0,0 +1,218 @@
+/*
+Scoped section profiler for Timer
+
+SectionProfiler<N> splits the loop body into N named sections, identified by
+compile-time constants, and times them with RAII guards stamped with the CPU
+counter clock (CycleClock::global(), see cycle_clock.hpp):
+
+  enum { SEC_READ, SEC_FILTER, SEC_CONTROL, SEC_WRITE, SECTIONS };
+  SectionProfiler<SECTIONS> prof({"read", "filter", "control", "write"});
+  prof.attach_to(t);
+  while (...) {
+    { TIMER_SECTION(prof, SEC_READ); read_sensors(); }
+    { TIMER_SECTION(prof, SEC_CONTROL); control_law(); }
+    t.wait();
+  }
+
+The time spent in each section during a cycle (summed if the section is
+entered more than once; nested sections are timed inclusively) goes to
+CycleRecord::sections of the next record, next to the tet it belongs to, and
+to per-section min, max, mean and log2 histogram, which other threads can
+read. Sections not entered in a cycle are left out of the statistics. Guards
+must be used by the thread running the loop; nothing is allocated after
+construction.
+
+The profiler is compiled only when TIMER_PROFILE is defined: otherwise
+SectionProfiler<N> keeps its interface but attach_to() attaches nothing and
+TIMER_SECTION expands to nothing, so that an instrumented loop costs nothing.
+*/
+#ifndef SECTION_PROFILER_HPP
+#define SECTION_PROFILER_HPP
+
+#include "cycle_clock.hpp"
+#include "seqlock.hpp"
+#include "timer.hpp"
+#include <array>
+#include <vector>
+
+// Histogram bin b counts section times in [2^b, 2^(b+1)) ns (bin 0 also
+// holds 0, the last bin everything above)
+#define SECTION_BINS 32
+
+// Statistics of a section, in nanoseconds
+struct SectionStats {
+  uint64_t n = 0; // cycles in which the section was entered
+  int64_t min = 0;
+  int64_t max = 0;
+  double mean = 0;
+};
+
+#define TIMER_SECTION_CONCAT_(a, b) a##b
+#define TIMER_SECTION_CONCAT(a, b) TIMER_SECTION_CONCAT_(a, b)
+
+#ifdef TIMER_PROFILE
+
+#define TIMER_SECTION(profiler, id)                                            \
+  auto TIMER_SECTION_CONCAT(_timer_section_, __LINE__) =                       \
+      (profiler).template scope<id>()
+
+template <size_t N> class SectionProfiler : public CycleProbe {
+  static_assert(N > 0 && N <= TIMER_MAX_SECTIONS,
+                "SectionProfiler: too many sections (see TIMER_MAX_SECTIONS)");
+
+public:
+  // Guard timing a section from its construction to its destruction
+  class Scope {
+  public:
+    Scope(SectionProfiler &p, size_t id)
+        : _p(p), _id(id), _t0(p._clock.stamp()) {}
+    ~Scope() {
+      _p._ticks[_id] += _p._clock.stamp() - _t0;
+      _p._entered |= 1u << _id;
+    }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    SectionProfiler &_p;
+    size_t _id;
+    uint64_t _t0;
+  };
+
+  // LIFE-CYCLE ----------------------------------------------------------------
+  explicit SectionProfiler(const array<const char *, N> &names)
+      : _names(names), _clock(CycleClock::global()) {
+    for (size_t i = 0; i < N; i++) {
+      for (size_t b = 0; b < SECTION_BINS; b++)
+        _hist[i][b].store(0, memory_order_relaxed);
+    }
+  }
+
+  SectionProfiler(const SectionProfiler &) = delete;
+  SectionProfiler &operator=(const SectionProfiler &) = delete;
+
+  template <typename T> void attach_to(T &timer) { timer.attach_probe(*this); }
+  template <typename T> void detach_from(T &timer) {
+    timer.detach_probe(*this);
+  }
+
+  // RT SIDE -------------------------------------------------------------------
+
+  template <size_t Id> Scope scope() {
+    static_assert(Id < N, "SectionProfiler: no such section");
+    return Scope(*this, Id);
+  }
+
+  // End of the loop body: closes the sections of this cycle
+  void on_sleep(CycleRecord &record) override {
+    for (size_t i = 0; i < N; i++) {
+      if (!(_entered & 1u << i)) {
+        record.sections[i] = 0;
+        continue;
+      }
+      int64_t ns = _clock.to_ns(_ticks[i]);
+      _ticks[i] = 0;
+      record.sections[i] = (uint32_t)min<int64_t>(ns, UINT32_MAX);
+      SectionStats &s = _acc.sections[i];
+      s.n++;
+      s.min = s.n == 1 ? ns : min(s.min, ns);
+      s.max = max(s.max, ns);
+      s.mean += (ns - s.mean) / s.n;
+      size_t b = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+      b = min<size_t>(b, SECTION_BINS - 1);
+      // single writer: a plain load/store pair, no locked instruction
+      _hist[i][b].store(_hist[i][b].load(memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+    }
+    _published.store(_acc);
+    _entered = 0;
+    _valid = true;
+  }
+
+  void on_wake(CycleRecord &record) override {
+    if (_valid) {
+      record.probes |= CycleRecord::PROBE_SECTIONS;
+    }
+  }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  const char *name(size_t id) const { return _names[id]; }
+
+  SectionStats stats(size_t id) const {
+    return _published.load().sections[id];
+  }
+
+  // Adds section_<name> (mean), section_<name>_min and section_<name>_max, in
+  // nanoseconds, for the sections entered at least once
+  void stats(map<string, double> &out) const {
+    Snapshot s = _published.load();
+    for (size_t i = 0; i < N; i++) {
+      if (s.sections[i].n == 0)
+        continue;
+      string key = string("section_") + _names[i];
+      out[key] = s.sections[i].mean;
+      out[key + "_min"] = s.sections[i].min;
+      out[key + "_max"] = s.sections[i].max;
+    }
+  }
+
+  vector<uint64_t> histogram(size_t id) const {
+    vector<uint64_t> bins(SECTION_BINS);
+    for (size_t b = 0; b < SECTION_BINS; b++)
+      bins[b] = _hist[id][b].load(memory_order_relaxed);
+    return bins;
+  }
+
+private:
+  struct Snapshot {
+    SectionStats sections[N];
+  };
+
+  // ATTRIBUTES ----------------------------------------------------------------
+  array<const char *, N> _names;
+  const CycleClock &_clock;
+  uint64_t _ticks[N] = {0}; // time in each section during this cycle
+  uint32_t _entered = 0;    // sections entered during this cycle
+  bool _valid = false;
+  Snapshot _acc;
+  Seqlock<Snapshot> _published;
+  atomic<uint64_t> _hist[N][SECTION_BINS];
+};
+
+#else
+
+#define TIMER_SECTION(profiler, id)                                            \
+  do {                                                                         \
+  } while (0)
+
+// Disabled profiler: same interface, no code
+template <size_t N> class SectionProfiler {
+public:
+  struct Scope {};
+
+  explicit SectionProfiler(const array<const char *, N> &names)
+      : _names(names) {}
+
+  template <typename T> void attach_to(T &) {}
+  template <typename T> void detach_from(T &) {}
+
+  template <size_t Id> Scope scope() {
+    static_assert(Id < N, "SectionProfiler: no such section");
+    return Scope();
+  }
+
+  const char *name(size_t id) const { return _names[id]; }
+  SectionStats stats(size_t) const { return SectionStats(); }
+  void stats(map<string, double> &) const {}
+  vector<uint64_t> histogram(size_t) const {
+    return vector<uint64_t>(SECTION_BINS);
+  }
+
+private:
+  array<const char *, N> _names;
+};
+
+#endif // TIMER_PROFILE
+
+#endif // SECTION_PROFILER_HPP
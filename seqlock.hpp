@@ -0,0 +1,82 @@
+/*
+Sequence lock for publishing a small trivially-copyable value
+
+One writer, any number of readers. The writer never waits: store() bumps the
+sequence to odd, writes the words, and bumps it back to even. Readers copy
+the words and retry if the sequence changed meanwhile, so they always get a
+consistent (never torn) value. Words are relaxed atomics, so that the
+protocol is free of data races.
+*/
+#ifndef SEQLOCK_HPP
+#define SEQLOCK_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+template <typename T> class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Seqlock needs a trivially copyable type");
+
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  Seqlock() { store(T()); }
+  explicit Seqlock(const T &value) { store(value); }
+
+  Seqlock(const Seqlock &) = delete;
+  Seqlock &operator=(const Seqlock &) = delete;
+
+  // METHODS -------------------------------------------------------------------
+
+  // Writer side: wait-free, single writer only
+  void store(const T &value) {
+    uint64_t words[WORDS] = {};
+    std::memcpy(words, &value, sizeof(T));
+    uint64_t seq = _seq.load(std::memory_order_relaxed);
+    _seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < WORDS; i++)
+      _data[i].store(words[i], std::memory_order_relaxed);
+    _seq.store(seq + 2, std::memory_order_release);
+  }
+
+  // Reader side: a single attempt, false if a write was in progress
+  bool try_load(T &value) const {
+    uint64_t seq = _seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      return false;
+    }
+    uint64_t words[WORDS];
+    for (size_t i = 0; i < WORDS; i++)
+      words[i] = _data[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_seq.load(std::memory_order_relaxed) != seq) {
+      return false;
+    }
+    std::memcpy(&value, words, sizeof(T));
+    return true;
+  }
+
+  // Reader side: retries until a consistent copy is obtained
+  T load() const {
+    T value;
+    while (!try_load(value)) {
+    }
+    return value;
+  }
+
+  // Number of stores so far
+  uint64_t version() const {
+    return _seq.load(std::memory_order_acquire) / 2;
+  }
+
+private:
+  static constexpr size_t WORDS = (sizeof(T) + 7) / 8;
+
+  // ATTRIBUTES ----------------------------------------------------------------
+  alignas(64) std::atomic<uint64_t> _seq{0};
+  std::atomic<uint64_t> _data[WORDS];
+};
+
+#endif // SEQLOCK_HPP
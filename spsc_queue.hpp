@@ -0,0 +1,71 @@
+/*
+Single-producer, single-consumer lock-free queue
+
+Fixed capacity, allocated at construction: push() and pop() never block nor
+allocate, so either side can be an RT thread. push() fails when the queue is
+full, pop() when it is empty.
+*/
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+template <typename T> class SpscQueue {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // capacity is rounded up to a power of two
+  explicit SpscQueue(size_t capacity = 1024) {
+    size_t n = 1;
+    while (n < capacity)
+      n <<= 1;
+    _items.resize(n);
+    _mask = n - 1;
+  }
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  // METHODS -------------------------------------------------------------------
+
+  // Producer side
+  bool push(const T &item) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) > _mask) {
+      return false;
+    }
+    _items[tail & _mask] = item;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side
+  bool pop(T &item) {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = _items[head & _mask];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    return _tail.load(std::memory_order_acquire) -
+           _head.load(std::memory_order_acquire);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  size_t capacity() const { return _items.size(); }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  std::vector<T> _items;
+  size_t _mask = 0;
+  alignas(64) std::atomic<size_t> _head{0};
+  alignas(64) std::atomic<size_t> _tail{0};
+};
+
+#endif // SPSC_QUEUE_HPP
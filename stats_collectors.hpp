@@ -0,0 +1,412 @@
+/*
+Statistics collectors for Timer
+
+The second template parameter of Timer is a list of collectors, each paying
+only for what it computes:
+
+  CounterStats        cycles and errors by type
+  MinMaxStats         min and max of period, TET and wake latency
+  WelfordStats        mean and standard deviation of the same
+  WelfordStats128     the same, with exact 128-bit integer accumulators
+  HistogramStats<N>   histogram of the period over [0, 2 * interval) in N bins
+  QuantileStats<Q>    quantiles of the same (Q from quantile.hpp)
+  TraceStats<N>       ring of the last N samples
+
+Each cycle gives three separate quantities: the period dt (time between
+successive wake-ups), the task execution time TET (from the wake-up to the
+next call of wait()) and the wake latency (wake-up time minus scheduled
+deadline). Only the latter depends on the kernel alone.
+
+  Timer<milliseconds, Collectors<MinMaxStats, WelfordStats>> t(d, max_d);
+
+NoStats (the default) collects nothing and compiles away; FullStats is the
+set of statistics of the former EnableStats = true. Collectors are updated
+by wait() in the timed loop and publish their results for readers in any
+thread (seqlocks or relaxed atomics, single writer).
+
+A collector provides: enabled, add(sample), reset(), snapshot(TimerStats &)
+and stats(map &); the last two are safe from any thread.
+*/
+#ifndef STATS_COLLECTORS_HPP
+#define STATS_COLLECTORS_HPP
+
+#include "quantile.hpp"
+#include "seqlock.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Snapshot of the running statistics, in DurationType units, readable from
+// any thread (see Timer::stats_snapshot()); fields of missing collectors keep
+// their default values
+struct TimerStats {
+  double n = 0;
+  double min = INFINITY;    // period
+  double max = 0;
+  double mean = 0;
+  double sd = 0;
+  double tet = 0;           // mean TET
+  double tet_sd = 0;
+  double tet_max = 0;
+  double latency = 0;       // mean wake latency
+  double latency_sd = 0;
+  double latency_max = 0;
+};
+
+// What wait() passes to the collectors at every cycle but the first
+struct StatsSample {
+  double dt;          // period, in DurationType units
+  double tet;         // task execution time, in DurationType units
+  double latency;     // wake latency, in DurationType units
+  double interval;    // nominal period, in DurationType units
+  int64_t dt_ns;      // period, in nanoseconds
+  int64_t tet_ns;     // task execution time, in nanoseconds
+  int64_t latency_ns; // wake latency, in nanoseconds
+  double unit;        // nanoseconds per DurationType unit
+  int ret;         // value returned by wait()
+  bool valid;      // false if woken up by a signal: no timing statistics
+};
+
+// Single writer increment, without a locked instruction
+static inline void stats_increment(std::atomic<uint64_t> &counter) {
+  counter.store(counter.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+}
+
+template <typename... Cs> struct Collectors : Cs... {
+  static constexpr bool enabled = sizeof...(Cs) > 0;
+
+  void add(const StatsSample &s) { (Cs::add(s), ...); }
+  void reset() { (Cs::reset(), ...); }
+  void snapshot(TimerStats &s) const { (Cs::snapshot(s), ...); }
+  void stats(std::map<std::string, double> &out) const {
+    (Cs::stats(out), ...);
+  }
+};
+
+class CounterStats {
+public:
+  static constexpr bool enabled = true;
+
+  void add(const StatsSample &s) {
+    stats_increment(_cycles);
+    if (s.valid)
+      stats_increment(_valid);
+    switch (s.ret) {
+    case 0:
+      break;
+    case -1:
+      stats_increment(_late);
+      break;
+    case -2:
+      stats_increment(_max_wait);
+      break;
+    default:
+      stats_increment(_interrupted);
+    }
+  }
+
+  void reset() {
+    for (auto *c : {&_cycles, &_valid, &_late, &_max_wait, &_interrupted})
+      c->store(0, std::memory_order_relaxed);
+  }
+
+  void snapshot(TimerStats &s) const {
+    s.n = _valid.load(std::memory_order_relaxed);
+  }
+
+  void stats(std::map<std::string, double> &out) const {
+    out["n"] = _valid.load(std::memory_order_relaxed);
+    out["cycles"] = _cycles.load(std::memory_order_relaxed);
+    out["signal_late"] = _late.load(std::memory_order_relaxed);
+    out["max_wait_exceeded"] = _max_wait.load(std::memory_order_relaxed);
+    out["interrupted"] = _interrupted.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> _cycles{0}, _valid{0}, _late{0}, _max_wait{0},
+      _interrupted{0};
+};
+
+class MinMaxStats {
+public:
+  static constexpr bool enabled = true;
+
+  void add(const StatsSample &s) {
+    if (s.dt < _v.min || s.dt > _v.max || s.tet < _v.tet_min ||
+        s.tet > _v.tet_max || s.latency < _v.latency_min ||
+        s.latency > _v.latency_max) {
+      _v.min = std::min(_v.min, s.dt);
+      _v.max = std::max(_v.max, s.dt);
+      _v.tet_min = std::min(_v.tet_min, s.tet);
+      _v.tet_max = std::max(_v.tet_max, s.tet);
+      _v.latency_min = std::min(_v.latency_min, s.latency);
+      _v.latency_max = std::max(_v.latency_max, s.latency);
+      _published.store(_v); // only when something changed
+    }
+  }
+
+  void reset() {
+    _v = Values();
+    _published.store(_v);
+  }
+
+  void snapshot(TimerStats &s) const {
+    Values v = _published.load();
+    s.min = v.min;
+    s.max = v.max;
+    s.tet_max = v.tet_max;
+    s.latency_max = v.latency_max;
+  }
+
+  void stats(std::map<std::string, double> &out) const {
+    Values v = _published.load();
+    out["min"] = v.min;
+    out["max"] = v.max;
+    out["tet_min"] = v.tet_min;
+    out["tet_max"] = v.tet_max;
+    out["latency_min"] = v.latency_min;
+    out["latency_max"] = v.latency_max;
+  }
+
+private:
+  struct Values {
+    double min = INFINITY, max = 0;
+    double tet_min = INFINITY, tet_max = 0;
+    double latency_min = INFINITY, latency_max = -INFINITY; // may be < 0
+  };
+  Values _v;
+  Seqlock<Values> _published;
+};
+
+// Mean and standard deviation of period, TET and wake latency. Samples are
+// integer nanoseconds taken relative to the first one, so that what is
+// accumulated stays small. With Int128 = false: Welford's recursion with
+// Kahan-compensated accumulators. With Int128 = true: exact integer sums (of
+// squares in 128 bits), exact up to the final division as long as the sum of
+// squares fits in 127 bits (deviations up to 1 s over 10^20 samples). Either
+// way, divisions and sqrt are left to the readers.
+template <bool Int128 = false> class BasicWelfordStats {
+public:
+  static constexpr bool enabled = true;
+
+  void add(const StatsSample &s) {
+    if (!s.valid) {
+      return; // don't update on signals
+    }
+    if (_v.n == 0) {
+      _v.dt.ref = s.dt_ns;
+      _v.tet.ref = s.tet_ns;
+      _v.latency.ref = s.latency_ns;
+      _v.unit = s.unit;
+    }
+    _v.n++;
+    _dt.add(_v.dt, s.dt_ns, _v.n);
+    _tet.add(_v.tet, s.tet_ns, _v.n);
+    _latency.add(_v.latency, s.latency_ns, _v.n);
+    _published.store(_v);
+  }
+
+  void reset() {
+    _v = Values();
+    _dt = _tet = _latency = Compensation();
+    _published.store(_v);
+  }
+
+  void snapshot(TimerStats &s) const {
+    Values v = _published.load();
+    s.n = v.n;
+    v.dt.read(v.n, v.unit, s.mean, s.sd);
+    v.tet.read(v.n, v.unit, s.tet, s.tet_sd);
+    v.latency.read(v.n, v.unit, s.latency, s.latency_sd);
+  }
+
+  void stats(std::map<std::string, double> &out) const {
+    Values v = _published.load();
+    out["n"] = v.n;
+    v.dt.read(v.n, v.unit, out["mean"], out["sd"]);
+    v.tet.read(v.n, v.unit, out["tet"], out["tet_sd"]);
+    v.latency.read(v.n, v.unit, out["latency"], out["latency_sd"]);
+  }
+
+private:
+  using Accumulator = typename std::conditional<Int128, __int128, double>::type;
+
+  // Int128: sums of x and x^2; otherwise mean of x and sum of squared
+  // deviations of x (x: sample - ref, in ns)
+  struct Moments {
+    int64_t ref = 0;
+    Accumulator m1 = 0, m2 = 0;
+
+    // Mean and standard deviation, in DurationType units
+    void read(uint64_t n, double unit, double &mean, double &sd) const {
+      mean = sd = 0;
+      if (n == 0) {
+        return;
+      }
+      double var = 0;
+      if constexpr (Int128) {
+        mean = ref + (double)m1 / n;
+        if (n > 1) {
+          // m2 - m1^2 / n with m1 = q n + r: no term grows beyond m2, where
+          // n m2 or m1^2 would overflow at n^2 D^2
+          const __int128 q = m1 / (__int128)n, r = m1 % (__int128)n;
+          var = ((double)(m2 - q * q * n - 2 * q * r) - (double)(r * r) / n) /
+                (n - 1);
+        }
+      } else {
+        mean = ref + m1;
+        if (n > 1)
+          var = m2 / (n - 1);
+      }
+      mean /= unit;
+      sd = sqrt(var) / unit;
+    }
+  };
+
+  // Kahan compensations of m1 and m2
+  struct Compensation {
+    double c1 = 0, c2 = 0;
+
+    void add(Moments &m, int64_t sample, uint64_t n) {
+      const int64_t x = sample - m.ref;
+      if constexpr (Int128) {
+        m.m1 += x;
+        m.m2 += (__int128)x * x;
+      } else {
+        const double d = x - m.m1;
+        kahan_add(m.m1, c1, d / n);
+        kahan_add(m.m2, c2, d * (x - m.m1));
+      }
+    }
+  };
+
+  struct Values {
+    uint64_t n = 0;
+    double unit = 1; // ns per DurationType unit
+    Moments dt, tet, latency;
+  };
+  Values _v;
+  Compensation _dt, _tet, _latency;
+  Seqlock<Values> _published;
+
+  static void kahan_add(double &sum, double &c, double x) {
+    const double y = x - c;
+    const double t = sum + y;
+    c = (t - sum) - y;
+    sum = t;
+  }
+};
+
+using WelfordStats = BasicWelfordStats<false>;
+using WelfordStats128 = BasicWelfordStats<true>;
+
+// The range is taken from the interval of the first sample after a reset;
+// the first and last bins are open
+template <size_t Bins = 64> class HistogramStats {
+public:
+  static constexpr bool enabled = true;
+
+  void add(const StatsSample &s) {
+    if (_width == 0) {
+      _width = 2 * s.interval / Bins;
+      _published_width.store(_width, std::memory_order_relaxed);
+    }
+    double i = s.dt / _width;
+    stats_increment(_bins[i < 0 ? 0 : std::min<size_t>((size_t)i, Bins - 1)]);
+  }
+
+  void reset() {
+    for (auto &b : _bins)
+      b.store(0, std::memory_order_relaxed);
+    _width = 0;
+    _published_width.store(0, std::memory_order_relaxed);
+  }
+
+  void snapshot(TimerStats &) const {}
+
+  void stats(std::map<std::string, double> &out) const {
+    out["hist_width"] = bin_width();
+  }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  // Width of a bin, in DurationType units (0 before the first sample)
+  double bin_width() const {
+    return _published_width.load(std::memory_order_relaxed);
+  }
+
+  std::vector<uint64_t> histogram() const {
+    std::vector<uint64_t> bins(Bins);
+    for (size_t i = 0; i < Bins; i++)
+      bins[i] = _bins[i].load(std::memory_order_relaxed);
+    return bins;
+  }
+
+private:
+  std::atomic<uint64_t> _bins[Bins] = {};
+  double _width = 0;
+  std::atomic<double> _published_width{0};
+};
+
+// Adapts a quantile policy of quantile.hpp; only valid samples are used
+template <typename Q> class QuantileStats : public Q {
+public:
+  static constexpr bool enabled = true;
+
+  void add(const StatsSample &s) {
+    if (s.valid)
+      Q::add(s.dt, s.tet, s.latency);
+  }
+
+  void reset() { Q::reset(); }
+
+  void snapshot(TimerStats &) const {}
+
+  void stats(std::map<std::string, double> &out) const { Q::stats(out); }
+};
+
+template <size_t N = 1024> class TraceStats {
+public:
+  static constexpr bool enabled = true;
+
+  void add(const StatsSample &s) {
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    _ring[head % N].store(s);
+    _head.store(head + 1, std::memory_order_release);
+  }
+
+  void reset() { _head.store(0, std::memory_order_release); }
+
+  void snapshot(TimerStats &) const {}
+
+  void stats(std::map<std::string, double> &) const {}
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  // Copies up to n most recent samples, oldest first
+  std::vector<StatsSample> recent(size_t n) const {
+    uint64_t head = _head.load(std::memory_order_acquire);
+    n = std::min<uint64_t>({n, head, N});
+    std::vector<StatsSample> out;
+    for (uint64_t i = head - n; i < head; i++) {
+      StatsSample s;
+      if (_ring[i % N].try_load(s))
+        out.push_back(s);
+    }
+    return out;
+  }
+
+private:
+  Seqlock<StatsSample> _ring[N];
+  std::atomic<uint64_t> _head{0};
+};
+
+using NoStats = Collectors<>;
+using FullStats = Collectors<CounterStats, MinMaxStats, WelfordStats>;
+
+#endif // STATS_COLLECTORS_HPP
@@ -0,0 +1,407 @@
+/*
+Low-rate system state sampler
+
+SystemSampler runs a non-RT thread that, every period (100 ms by default),
+samples the system state that may explain a late or slow cycle and appends
+it to a CSV file, one row per value:
+
+  time,interval,source,name,value
+  1718000000100000000,100000000,irq,24 IO-APIC 5-edge ACPI:Ged,3
+  1718000000100000000,100000000,softirq,TIMER,100
+  1718000000100000000,100000000,freq,cpu2,2400000
+  1718000000100000000,100000000,throttle,cpu2,0
+  1718000000100000000,100000000,temp,cpu-thermal,51000
+
+  - irq, softirq: interrupts and softirqs of the watched CPU (of all CPUs if
+    cpu is -1) during the interval ending at time, from /proc/interrupts and
+    /proc/softirqs; only the non-zero counts are written;
+  - freq: current frequency of the watched CPU (cpu0 if -1), in kHz, from
+    cpufreq's scaling_cur_freq;
+  - throttle: throttling flags (SystemSample::UNDER_VOLTAGE, ...), see below;
+  - temp: temperature of each thermal zone, in millidegrees Celsius.
+
+The throttling flags are those of the Raspberry Pi firmware (get_throttled,
+as vcgencmd prints them): the low bits tell the current state and bits 16 to
+19 what happened since boot. Elsewhere FREQ_CAPPED is set while
+scaling_max_freq is below cpuinfo_max_freq, and THROTTLED when the
+thermal_throttle counters of the CPU (x86) increased during the interval.
+
+Times are in ns on the clock of the Timer trace, CLOCK_REALTIME by default as
+for SystemClock and CycleCounterClock. Files that do not exist (no cpufreq or
+thermal zones in a VM) are skipped. The sysfs and procfs roots can be moved
+to a fake directory tree. The thread runs as SCHED_OTHER even when started
+from an RT thread, and reading the files costs some tens of microseconds per
+period.
+
+The sampler is also a CycleProbe: attached to the timer, it copies the last
+sampled frequency, hottest temperature and throttling flags into every
+CycleRecord (PROBE_SYSTEM), so that the trace itself tells the state each
+cycle ran in. The RT side only reads a seqlock.
+
+  SystemSampler sampler(2);   // the Timer runs on CPU 2
+  sampler.start("state.csv");
+  t.attach_probe(sampler);
+  ... run, with a TraceWriter recording the cycles ...
+  sampler.stop();
+
+SystemSampler::load() reads the file back (see jitter_report.hpp).
+*/
+#ifndef SYSTEM_SAMPLER_HPP
+#define SYSTEM_SAMPLER_HPP
+
+#include "helper_thread.hpp"
+#include "seqlock.hpp"
+#include "timer.hpp"
+#include <dirent.h>
+#include <fstream>
+#include <glob.h>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+struct SystemSample {
+  enum Source { IRQ, SOFTIRQ, FREQ, TEMP, THROTTLE, SOURCES };
+
+  // Throttling flags, in the layout of the Raspberry Pi firmware; shifted by
+  // 16 bits, the same conditions since boot
+  static constexpr uint32_t UNDER_VOLTAGE = 1;
+  static constexpr uint32_t FREQ_CAPPED = 2;
+  static constexpr uint32_t THROTTLED = 4;
+  static constexpr uint32_t SOFT_TEMP_LIMIT = 8;
+  static constexpr uint32_t NOW = 0xF;
+
+  int64_t time = 0;     // end of the interval, ns on the trace clock
+  int64_t interval = 0; // length of the interval, ns
+  Source source = IRQ;
+  string name;
+  int64_t value = 0; // count during the interval, kHz, millidegrees or flags
+
+  static const char *source_name(Source s) {
+    static const char *names[SOURCES] = {"irq", "softirq", "freq", "temp",
+                                         "throttle"};
+    return names[s];
+  }
+
+  // "under-voltage,capped,..." for the current conditions of flags
+  static string throttle_names(uint32_t flags) {
+    static const char *names[] = {"under-voltage", "capped", "throttled",
+                                  "soft-temp-limit"};
+    string s;
+    for (int b = 0; b < 4; b++) {
+      if (flags & 1u << b)
+        s += (s.empty() ? "" : ",") + string(names[b]);
+    }
+    return s.empty() ? "none" : s;
+  }
+};
+
+// Last sampled state, as merged into the CycleRecords
+struct SystemState {
+  uint64_t rounds = 0;  // samples taken so far
+  int64_t time = 0;     // of the last sample
+  uint32_t freq = 0;    // kHz, 0 if unknown
+  int32_t temp = 0;     // hottest zone, millidegrees Celsius
+  uint32_t throttled = 0;
+};
+
+class SystemSampler : public CycleProbe {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // clock stamps the samples: that of the Timer trace
+  explicit SystemSampler(int cpu = -1, milliseconds period = milliseconds(100),
+                         const string &sysfs = "/sys",
+                         const string &procfs = "/proc",
+                         clockid_t clock = CLOCK_REALTIME)
+      : _cpu(cpu), _period(period), _sysfs(sysfs), _procfs(procfs),
+        _clock(clock) {}
+
+  ~SystemSampler() { stop(); }
+
+  SystemSampler(const SystemSampler &) = delete;
+  SystemSampler &operator=(const SystemSampler &) = delete;
+
+  // METHODS -------------------------------------------------------------------
+
+  // Starts the sampling thread, writing to path
+  void start(const string &path) {
+    stop();
+    ofstream out(path, ios::trunc);
+    if (!out) {
+      throw TimerError("SystemSampler: cannot open " + path);
+    }
+    out << header() << endl;
+    _last = 0;
+    _throttle_count = -1;
+    for (auto &counts : _counts)
+      counts.clear();
+    _running = true;
+    _thread = thread([this](ofstream out) { run(out); }, move(out));
+  }
+
+  void stop() {
+    if (_thread.joinable()) {
+      _running = false;
+      _thread.join();
+    }
+  }
+
+  // Samples taken so far (one per period)
+  size_t rounds() const { return _state.load().rounds; }
+
+  int cpu() const { return _cpu; }
+
+  // Takes one sample, writes its rows to out and publishes the state; the
+  // counts are those since the previous call (none at the first one). Used by
+  // the sampling thread, or alone when it is not running.
+  void sample(ostream &out) {
+    int64_t now = clock_ns();
+    int64_t interval = _last > 0 ? now - _last : 0;
+    string cpu = "cpu" + to_string(max(_cpu, 0));
+    string cpu_dir = _sysfs + "/devices/system/cpu/" + cpu;
+    read_counts(_procfs + "/interrupts", SystemSample::IRQ, now, interval, out);
+    read_counts(_procfs + "/softirqs", SystemSample::SOFTIRQ, now, interval,
+                out);
+
+    SystemState state = _state.load();
+    state.rounds++;
+    state.time = now;
+    int64_t khz;
+    state.freq = 0;
+    if (read_value(cpu_dir + "/cpufreq/scaling_cur_freq", khz)) {
+      state.freq = (uint32_t)khz;
+      write_row(out, now, interval, SystemSample::FREQ, cpu, khz);
+    }
+
+    state.throttled = read_throttled(cpu_dir);
+    write_row(out, now, interval, SystemSample::THROTTLE, cpu,
+              state.throttled);
+
+    state.temp = 0;
+    bool first = true;
+    string thermal = _sysfs + "/class/thermal";
+    for (const string &zone : list_dir(thermal, "thermal_zone")) {
+      string dir = thermal + "/" + zone, type;
+      int64_t mdeg;
+      if (!read_value(dir + "/temp", mdeg))
+        continue;
+      ifstream in(dir + "/type");
+      if (!getline(in, type) || type.empty())
+        type = zone;
+      replace(type.begin(), type.end(), ',', ';');
+      write_row(out, now, interval, SystemSample::TEMP, type, mdeg);
+      state.temp = first ? (int32_t)mdeg : max(state.temp, (int32_t)mdeg);
+      first = false;
+    }
+    _state.store(state);
+    _last = now;
+  }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  SystemState state() const { return _state.load(); }
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_wake(CycleRecord &record) override {
+    SystemState s = _state.load();
+    if (s.rounds == 0) {
+      return;
+    }
+    record.freq = s.freq;
+    record.temp = s.temp;
+    record.throttled = s.throttled;
+    record.probes |= CycleRecord::PROBE_SYSTEM;
+  }
+
+  // FILES ---------------------------------------------------------------------
+
+  static const char *header() { return "time,interval,source,name,value"; }
+
+  // Reads back a file written by start()
+  static vector<SystemSample> load(const string &path) {
+    ifstream in(path);
+    string line;
+    if (!in || !getline(in, line) || line != header()) {
+      throw TimerError("SystemSampler: invalid file " + path);
+    }
+    vector<SystemSample> samples;
+    while (getline(in, line)) {
+      SystemSample s;
+      istringstream row(line);
+      string field;
+      vector<string> fields;
+      while (getline(row, field, ','))
+        fields.push_back(field);
+      if (fields.size() != 5)
+        continue;
+      int source = 0;
+      while (source < SystemSample::SOURCES &&
+             fields[2] != SystemSample::source_name((SystemSample::Source)source))
+        source++;
+      if (source == SystemSample::SOURCES)
+        continue;
+      s.time = atoll(fields[0].c_str());
+      s.interval = atoll(fields[1].c_str());
+      s.source = (SystemSample::Source)source;
+      s.name = fields[3];
+      s.value = atoll(fields[4].c_str());
+      samples.push_back(s);
+    }
+    return samples;
+  }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  int _cpu;
+  milliseconds _period;
+  string _sysfs, _procfs;
+  clockid_t _clock;
+  int64_t _last = 0;                   // time of the previous sample
+  map<string, int64_t> _counts[SystemSample::SOURCES]; // previous counts
+  string _firmware;        // get_throttled file, if any
+  bool _firmware_searched = false;
+  int64_t _throttle_count = -1; // thermal_throttle counters, previous sum
+  Seqlock<SystemState> _state;
+  atomic<bool> _running{false};
+  thread _thread;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void run(ofstream &out) {
+    setup_helper_thread();
+    auto next = steady_clock::now();
+    while (_running.load()) {
+      sample(out);
+      out.flush();
+      next += _period;
+      while (_running.load() && steady_clock::now() < next)
+        this_thread::sleep_for(min<steady_clock::duration>(
+            next - steady_clock::now(), milliseconds(10)));
+    }
+  }
+
+  // Per-CPU counters in the /proc/interrupts layout: a "CPU0 CPU1 ..." header
+  // line, then "<id>: <count per CPU> <description>" lines
+  void read_counts(const string &path, SystemSample::Source source,
+                   int64_t now, int64_t interval, ostream &out) {
+    ifstream in(path);
+    string line, word;
+    if (!getline(in, line))
+      return;
+    // column of the watched CPU: only the online CPUs are listed
+    int column = -1, columns = 0;
+    istringstream head(line);
+    while (head >> word) {
+      if (word == "CPU" + to_string(_cpu))
+        column = columns;
+      columns++;
+    }
+    if (_cpu >= 0 && column < 0)
+      return;
+    map<string, int64_t> &previous = _counts[source];
+    while (getline(in, line)) {
+      istringstream row(line);
+      string id;
+      if (!(row >> id) || id.back() != ':')
+        continue;
+      id.pop_back();
+      int64_t count = 0, c;
+      int i = 0;
+      for (; i < columns && row >> c; i++) {
+        if (_cpu < 0 || i == column)
+          count += c;
+      }
+      if (i == 0)
+        continue;
+      row.clear();
+      string name = id, rest;
+      while (row >> word)
+        rest += " " + word;
+      if (source == SystemSample::IRQ && !rest.empty())
+        name += rest;
+      replace(name.begin(), name.end(), ',', ';');
+      auto it = previous.find(name);
+      if (it == previous.end()) {
+        previous[name] = count;
+        continue;
+      }
+      int64_t delta = count - it->second;
+      it->second = count;
+      if (delta > 0 && interval > 0)
+        write_row(out, now, interval, source, name, delta);
+    }
+  }
+
+  // Raspberry Pi firmware flags if available, derived from cpufreq and the
+  // thermal_throttle counters otherwise
+  uint32_t read_throttled(const string &cpu_dir) {
+    if (!_firmware_searched) {
+      _firmware_searched = true;
+      for (const char *pattern : {"/devices/platform/soc*/*firmware/get_throttled",
+                                  "/devices/platform/*firmware/get_throttled"}) {
+        glob_t g;
+        if (glob((_sysfs + pattern).c_str(), 0, NULL, &g) == 0 &&
+            g.gl_pathc > 0) {
+          _firmware = g.gl_pathv[0];
+        }
+        globfree(&g);
+        if (!_firmware.empty())
+          break;
+      }
+    }
+    string hex;
+    if (!_firmware.empty() && ifstream(_firmware) >> hex) {
+      return (uint32_t)strtoul(hex.c_str(), NULL, 16);
+    }
+    uint32_t flags = 0;
+    int64_t max_khz, limit_khz;
+    if (read_value(cpu_dir + "/cpufreq/cpuinfo_max_freq", max_khz) &&
+        read_value(cpu_dir + "/cpufreq/scaling_max_freq", limit_khz) &&
+        limit_khz < max_khz) {
+      flags |= SystemSample::FREQ_CAPPED;
+    }
+    int64_t core, package, count = -1;
+    if (read_value(cpu_dir + "/thermal_throttle/core_throttle_count", core))
+      count = core;
+    if (read_value(cpu_dir + "/thermal_throttle/package_throttle_count",
+                   package))
+      count = max<int64_t>(count, 0) + package;
+    if (count >= 0 && _throttle_count >= 0 && count > _throttle_count)
+      flags |= SystemSample::THROTTLED;
+    _throttle_count = count;
+    return flags;
+  }
+
+  static void write_row(ostream &out, int64_t now, int64_t interval,
+                        SystemSample::Source source, const string &name,
+                        int64_t value) {
+    out << now << "," << interval << "," << SystemSample::source_name(source)
+        << "," << name << "," << value << "\n";
+  }
+
+  static bool read_value(const string &path, int64_t &value) {
+    ifstream in(path);
+    return (bool)(in >> value);
+  }
+
+  static vector<string> list_dir(const string &path, const string &prefix) {
+    vector<string> names;
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+      return names;
+    while (struct dirent *e = readdir(dir)) {
+      if (strncmp(e->d_name, prefix.c_str(), prefix.size()) == 0)
+        names.push_back(e->d_name);
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+    return names;
+  }
+
+  int64_t clock_ns() const {
+    struct timespec ts;
+    clock_gettime(_clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+};
+
+#endif // SYSTEM_SAMPLER_HPP
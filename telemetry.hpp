@@ -0,0 +1,334 @@
+/*
+Shared-memory telemetry export for Timer
+
+TelemetryExport is a Timer observer that publishes, in a named POSIX
+shared-memory segment (/dev/shm/timer-<pid>-<name>):
+
+  - a summary of the cycles (count, dt min/max/mean/variance, TET, lateness,
+    errors), through a seqlock;
+  - a histogram of dt;
+  - a ring of the most recent CycleRecords, each slot behind its own seqlock;
+  - a ring of the most recent per-period Rollups (see rolling_stats.hpp).
+
+The RT side only writes to memory: no syscalls, no locks. Out-of-process
+monitors such as timer-top map the segment read-only and check the magic and
+the layout version before reading it.
+
+  TelemetryExport tel("control_loop", milliseconds(1));
+  t.attach(tel);
+*/
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include "seqlock.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+#define TELEMETRY_MAGIC 0x54524D54 // "TMRT"
+#define TELEMETRY_VERSION 6
+#define TELEMETRY_PREFIX "timer-"
+
+// Summary of all cycles so far; times in nanoseconds
+struct TelemetrySummary {
+  uint64_t n = 0;
+  uint64_t errors = 0;     // cycles where wait() did not return TIMER_OK
+  int64_t last_wake = 0;
+  int64_t last_dt = 0;
+  int64_t min_dt = INT64_MAX;
+  int64_t max_dt = 0;
+  double mean_dt = 0;
+  double m2_dt = 0;        // sum of squared deviations: var = m2 / (n - 1)
+  double mean_tet = 0;
+  int64_t max_tet = 0;
+  int64_t max_lateness = 0;
+};
+
+// Summary of the cycles woken up in [start, end); times in nanoseconds
+struct Rollup {
+  int64_t start = 0;
+  int64_t end = 0;
+  uint64_t n = 0;
+  uint64_t errors = 0;
+  double dt_mean = 0;
+  double dt_sd = 0;
+  int64_t dt_min = INT64_MAX;
+  int64_t dt_max = 0;
+  double tet_mean = 0;
+  int64_t tet_max = 0;
+  int64_t lateness_max = 0;
+};
+
+// Segment layout: the header, then hist_bins histogram counters at
+// hist_offset, ring_size record slots at ring_offset and rollup_size rollup
+// slots at rollup_offset
+struct TelemetryHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;           // total size of the segment
+  uint32_t ring_size;
+  uint32_t hist_bins;
+  uint64_t hist_offset;
+  uint64_t ring_offset;
+  uint32_t rollup_size;
+  uint64_t rollup_offset;
+  int32_t pid;
+  char name[32];
+  int64_t interval;        // nominal period
+  int64_t hist_min;        // lower bound of the first bin
+  int64_t hist_width;      // bin width; first and last bins are open
+  Seqlock<TelemetrySummary> summary;
+  alignas(64) atomic<uint64_t> ring_head; // records written so far
+  atomic<uint64_t> rollup_head;           // rollups written so far
+};
+
+// Read-only view of a segment, for monitors
+class TelemetryView {
+public:
+  explicit TelemetryView(const string &shm_name) {
+    int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      throw TimerError("Telemetry: cannot open " + shm_name);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TelemetryHeader)) {
+      close(fd);
+      throw TimerError("Telemetry: invalid segment " + shm_name);
+    }
+    _size = st.st_size;
+    _base = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (_base == MAP_FAILED) {
+      throw TimerError("Telemetry: cannot map " + shm_name);
+    }
+    const TelemetryHeader *h = header();
+    if (h->magic != TELEMETRY_MAGIC || h->version != TELEMETRY_VERSION ||
+        h->size > _size) {
+      munmap(_base, _size);
+      throw TimerError("Telemetry: unsupported layout in " + shm_name);
+    }
+    // the offsets and sizes come from another process: check them
+    if (!fits(h->hist_offset, h->hist_bins, sizeof(uint64_t)) ||
+        !fits(h->ring_offset, h->ring_size, sizeof(Seqlock<CycleRecord>)) ||
+        !fits(h->rollup_offset, h->rollup_size, sizeof(Seqlock<Rollup>))) {
+      munmap(_base, _size);
+      throw TimerError("Telemetry: inconsistent layout in " + shm_name);
+    }
+  }
+
+  ~TelemetryView() { munmap(_base, _size); }
+
+  TelemetryView(const TelemetryView &) = delete;
+  TelemetryView &operator=(const TelemetryView &) = delete;
+
+  const TelemetryHeader *header() const {
+    return (const TelemetryHeader *)_base;
+  }
+
+  TelemetrySummary summary() const { return header()->summary.load(); }
+
+  uint64_t bin(size_t i) const {
+    return hist()[i].load(memory_order_relaxed);
+  }
+
+  // Copies up to n most recent records, oldest first
+  vector<CycleRecord> recent(size_t n) const {
+    const TelemetryHeader *h = header();
+    uint64_t head = h->ring_head.load(memory_order_acquire);
+    n = min<uint64_t>({n, head, h->ring_size});
+    vector<CycleRecord> out;
+    for (uint64_t i = head - n; i < head; i++) {
+      CycleRecord r;
+      if (ring()[i % h->ring_size].try_load(r) && r.seq != 0)
+        out.push_back(r);
+    }
+    return out;
+  }
+
+  // Copies up to n most recent rollups, oldest first
+  vector<Rollup> rollups(size_t n) const {
+    const TelemetryHeader *h = header();
+    uint64_t head = h->rollup_head.load(memory_order_acquire);
+    n = min<uint64_t>({n, head, h->rollup_size});
+    vector<Rollup> out;
+    for (uint64_t i = head - n; i < head; i++) {
+      Rollup r;
+      if (rollup_ring()[i % h->rollup_size].try_load(r) && r.n != 0)
+        out.push_back(r);
+    }
+    return out;
+  }
+
+private:
+  void *_base;
+  size_t _size;
+
+  // True if count slots of the given size at offset lie within the mapping
+  bool fits(uint64_t offset, uint64_t count, size_t slot) const {
+    return offset >= sizeof(TelemetryHeader) && offset <= _size &&
+           count <= (_size - offset) / slot;
+  }
+
+  const Seqlock<Rollup> *rollup_ring() const {
+    return (const Seqlock<Rollup> *)((const char *)_base +
+                                     header()->rollup_offset);
+  }
+
+  const atomic<uint64_t> *hist() const {
+    return (const atomic<uint64_t> *)((const char *)_base +
+                                      header()->hist_offset);
+  }
+  const Seqlock<CycleRecord> *ring() const {
+    return (const Seqlock<CycleRecord> *)((const char *)_base +
+                                          header()->ring_offset);
+  }
+};
+
+class TelemetryExport : public CycleObserver {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // The histogram spans [0, 2 * interval) in hist_bins bins; all sizes must
+  // be at least 1
+  template <typename IntervalType>
+  TelemetryExport(const string &name, IntervalType interval,
+                  size_t ring_size = 256, size_t hist_bins = 64,
+                  size_t rollup_size = 64) {
+    if (ring_size == 0 || hist_bins == 0 || rollup_size == 0 ||
+        ring_size > UINT32_MAX || hist_bins > UINT32_MAX ||
+        rollup_size > UINT32_MAX) {
+      throw TimerError("Telemetry: ring, histogram and rollup sizes must be "
+                       "between 1 and 2^32 - 1");
+    }
+    _shm_name = "/" TELEMETRY_PREFIX + to_string(getpid()) + "-" + name;
+    size_t hist_offset = align(sizeof(TelemetryHeader));
+    size_t ring_offset = align(hist_offset + hist_bins * sizeof(uint64_t));
+    size_t rollup_offset =
+        align(ring_offset + ring_size * sizeof(Seqlock<CycleRecord>));
+    _size = rollup_offset + rollup_size * sizeof(Seqlock<Rollup>);
+
+    int fd = shm_open(_shm_name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+      throw TimerError("Telemetry: cannot create " + _shm_name + ": " +
+                       strerror(errno));
+    }
+    if (ftruncate(fd, _size) != 0) {
+      close(fd);
+      shm_unlink(_shm_name.c_str());
+      throw TimerError("Telemetry: cannot size " + _shm_name);
+    }
+    _base = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (_base == MAP_FAILED) {
+      shm_unlink(_shm_name.c_str());
+      throw TimerError("Telemetry: cannot map " + _shm_name);
+    }
+    // Touch all pages now, not in the RT loop
+    memset(_base, 0, _size);
+
+    _header = new (_base) TelemetryHeader();
+    _hist = (atomic<uint64_t> *)((char *)_base + hist_offset);
+    for (size_t i = 0; i < hist_bins; i++)
+      new (&_hist[i]) atomic<uint64_t>(0);
+    _ring = (Seqlock<CycleRecord> *)((char *)_base + ring_offset);
+    for (size_t i = 0; i < ring_size; i++)
+      new (&_ring[i]) Seqlock<CycleRecord>();
+    _rollups = (Seqlock<Rollup> *)((char *)_base + rollup_offset);
+    for (size_t i = 0; i < rollup_size; i++)
+      new (&_rollups[i]) Seqlock<Rollup>();
+    _header->size = _size;
+    _header->ring_size = ring_size;
+    _header->hist_bins = hist_bins;
+    _header->hist_offset = hist_offset;
+    _header->ring_offset = ring_offset;
+    _header->rollup_size = rollup_size;
+    _header->rollup_offset = rollup_offset;
+    _header->pid = getpid();
+    strncpy(_header->name, name.c_str(), sizeof(_header->name) - 1);
+    _header->interval = duration_cast<nanoseconds>(interval).count();
+    _header->hist_min = 0;
+    _header->hist_width = max<int64_t>(1, 2 * _header->interval / hist_bins);
+    _header->ring_head.store(0, memory_order_relaxed);
+    _header->rollup_head.store(0, memory_order_relaxed);
+    _header->version = TELEMETRY_VERSION;
+    atomic_thread_fence(memory_order_release);
+    _header->magic = TELEMETRY_MAGIC; // last: the segment is now valid
+  }
+
+  ~TelemetryExport() {
+    munmap(_base, _size);
+    shm_unlink(_shm_name.c_str());
+  }
+
+  TelemetryExport(const TelemetryExport &) = delete;
+  TelemetryExport &operator=(const TelemetryExport &) = delete;
+
+  const string &shm_name() const { return _shm_name; }
+
+  const TelemetryHeader &header() const { return *_header; }
+
+  // Copy of the dt histogram, for non-RT readers
+  vector<uint64_t> histogram() const {
+    vector<uint64_t> bins(_header->hist_bins);
+    for (size_t i = 0; i < bins.size(); i++)
+      bins[i] = _hist[i].load(memory_order_relaxed);
+    return bins;
+  }
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_cycle(const CycleRecord &r) override {
+    TelemetrySummary &s = _summary;
+    s.n++;
+    if (r.ret != 0)
+      s.errors++;
+    s.last_wake = r.wake;
+    s.last_dt = r.dt;
+    s.min_dt = min(s.min_dt, r.dt);
+    s.max_dt = max(s.max_dt, r.dt);
+    double d = r.dt - s.mean_dt;
+    s.mean_dt += d / s.n;
+    s.m2_dt += d * (r.dt - s.mean_dt);
+    s.mean_tet += (r.tet - s.mean_tet) / s.n;
+    s.max_tet = max(s.max_tet, r.tet);
+    s.max_lateness = max(s.max_lateness, r.lateness);
+    _header->summary.store(s);
+
+    int64_t bin = (r.dt - _header->hist_min) / _header->hist_width;
+    bin = bin < 0 ? 0 : min<int64_t>(bin, _header->hist_bins - 1);
+    // single writer: a plain load/store pair, no locked instruction
+    _hist[bin].store(_hist[bin].load(memory_order_relaxed) + 1,
+                     memory_order_relaxed);
+
+    uint64_t head = _header->ring_head.load(memory_order_relaxed);
+    _ring[head % _header->ring_size].store(r);
+    _header->ring_head.store(head + 1, memory_order_release);
+  }
+
+  // Publishes a rollup; same thread as on_cycle()
+  void push_rollup(const Rollup &rollup) {
+    uint64_t head = _header->rollup_head.load(memory_order_relaxed);
+    _rollups[head % _header->rollup_size].store(rollup);
+    _header->rollup_head.store(head + 1, memory_order_release);
+  }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  string _shm_name;
+  size_t _size;
+  void *_base;
+  TelemetryHeader *_header;
+  atomic<uint64_t> *_hist;
+  Seqlock<CycleRecord> *_ring;
+  Seqlock<Rollup> *_rollups;
+  TelemetrySummary _summary;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  static size_t align(size_t n) { return (n + 63) & ~size_t(63); }
+};
+
+#endif // TELEMETRY_HPP
@@ -11,11 +11,18 @@ Author: paolo.bosetti@unitn.it
 #ifndef TIMER_HPP
 #define TIMER_HPP
 
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <errno.h> // for errno
+#include "seqlock.hpp"
+#include "spsc_queue.hpp"
+#include "stats_collectors.hpp"
+#include "usdt.hpp"
 #include <map>
+#include <mutex>
 #include <signal.h> // for signal
 #include <sstream>
 #include <stdexcept> // for runtime_error
@@ -48,6 +55,22 @@ Time scheme for nanosleep-based timer:
 
 #define NSEC_PER_SEC 1000000000ULL
 
+#ifndef TIMER_MAX_OBSERVERS
+#define TIMER_MAX_OBSERVERS 8
+#endif
+
+#ifndef TIMER_MAX_PROBES
+#define TIMER_MAX_PROBES 4
+#endif
+
+#ifndef TIMER_MAX_SECTIONS
+#define TIMER_MAX_SECTIONS 8
+#endif
+
+#ifndef TIMER_MAX_PERIOD_BUCKETS
+#define TIMER_MAX_PERIOD_BUCKETS 8
+#endif
+
 using namespace std;
 using namespace chrono;
 
@@ -57,7 +80,127 @@ public:
   TimerError(const char *message) : runtime_error(message) {}
 };
 
-template <typename DurationType = duration<double>, bool EnableStats = false>
+// Counters of the loop body sampled by PerfProbe: indexes in CycleRecord::perf
+enum PerfEvent {
+  PERF_INSTRUCTIONS,
+  PERF_CYCLES,
+  PERF_CACHE_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_PAGE_FAULTS,
+  PERF_CONTEXT_SWITCHES,
+  PERF_EVENTS
+};
+
+// Per-cycle record, filled by Timer::wait() when observers or probes are
+// attached. Times are in nanoseconds on the timer clock; the scheduling fields
+// are filled by probes (see SchedProbe), and are -1 or 0 otherwise. Counts are
+// deltas since the previous wake-up, except perf and sections, which cover the
+// loop body measured by tet (see PerfProbe and SectionProfiler). freq, temp and
+// throttled are the last values sampled by a SystemSampler.
+struct CycleRecord {
+  static constexpr uint32_t PROBE_SCHED = 1; // flags in probes
+  static constexpr uint32_t PROBE_PERF = 2;
+  static constexpr uint32_t PROBE_SECTIONS = 4;
+  static constexpr uint32_t PROBE_SYSTEM = 8;
+
+  uint64_t seq = 0;      // cycle number since start()
+  int64_t wake = 0;      // wake-up time
+  int64_t dt = 0;        // time since previous wake-up
+  int64_t tet = 0;       // task execution time (previous wake-up to sleep)
+  int64_t lateness = 0;  // wake-up time minus scheduled deadline
+  int32_t ret = 0;       // TimerErrorType returned by wait()
+  int32_t cpu = -1;      // CPU at wake-up
+  uint64_t nvcsw = 0;    // voluntary context switches
+  uint64_t nivcsw = 0;   // involuntary context switches
+  uint64_t minflt = 0;   // minor page faults
+  uint64_t majflt = 0;   // major page faults
+  int64_t run_delay = 0; // time spent runnable, waiting for a CPU
+  uint32_t migrations = 0; // CPU changes
+  uint32_t probes = 0;   // probes that filled this record
+  uint32_t freq = 0;     // CPU frequency, kHz
+  int32_t temp = 0;      // hottest thermal zone, millidegrees Celsius
+  uint32_t throttled = 0; // throttling flags (see SystemSample)
+  uint64_t perf[PERF_EVENTS] = {0}; // loop body counters, by PerfEvent
+  uint32_t sections[TIMER_MAX_SECTIONS] = {0}; // time in each section
+};
+
+// Statistics of the cycles run with a given interval (see
+// Timer::set_period_buckets())
+struct PeriodStats {
+  double interval = 0;
+  TimerStats stats;
+  double m2 = 0; // sum of squared dt deviations: sd is computed by readers
+};
+
+// Change requested to a running Timer, applied by wait() at the next cycle
+// boundary (see Timer::post())
+struct TimerCommand {
+  enum Type {
+    SET_INTERVAL,       // value: new interval in nanoseconds
+    SET_MAX_WAIT,       // value: new maximum wait in nanoseconds
+    RESET_STATS,
+    SET_OVERRUN_POLICY  // value: Timer::OverrunPolicy
+  };
+  Type type;
+  int64_t value = 0;
+};
+
+// Receives every CycleRecord from the RT thread, right before wait() returns:
+// implementations must not block nor allocate
+class CycleObserver {
+public:
+  virtual ~CycleObserver() = default;
+  virtual void on_cycle(const CycleRecord &record) = 0;
+};
+
+// Samples per-cycle counters into the CycleRecord, before the observers see
+// it: on_sleep() is called by wait() before sleeping (end of the loop body),
+// on_wake() right after the wake-up. Same constraints as observers.
+class CycleProbe {
+public:
+  virtual ~CycleProbe() = default;
+  virtual void on_sleep(CycleRecord &) {}
+  virtual void on_wake(CycleRecord &record) = 0;
+};
+
+// Default clock policy: wall clock time, clock_nanosleep() on absolute
+// deadlines for the RT path, setitimer()/SIGALRM for the signal-based path.
+// Any other policy must provide the same members (see timer_bench.cpp for a
+// mock clock that never sleeps).
+struct SystemClock {
+  nanoseconds now() const {
+    return duration_cast<nanoseconds>(system_clock::now().time_since_epoch());
+  }
+
+  void gettime(struct timespec &ts) const { clock_gettime(CLOCK_REALTIME, &ts); }
+
+  int sleep_until(const struct timespec &ts) {
+    return clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL);
+  }
+
+  int sleep(const struct timespec &ts) { return nanosleep(&ts, NULL); }
+
+  int arm(const struct itimerval &rep) {
+    if (setitimer(ITIMER_REAL, &rep, NULL) != 0) {
+      return -1;
+    }
+    signal(SIGALRM, [](int signo) {});
+    return 0;
+  }
+
+  void disarm() {
+    struct itimerval timer;
+    timerclear(&timer.it_value);
+    timerclear(&timer.it_interval);
+    setitimer(ITIMER_REAL, &timer, NULL);
+    signal(SIGALRM, SIG_DFL);
+  }
+};
+
+// Stats is a list of collectors from stats_collectors.hpp, e.g. FullStats or
+// Collectors<MinMaxStats, QuantileStats<P2Quantiles>>; NoStats collects nothing
+template <typename DurationType = duration<double>, typename Stats = NoStats,
+          typename Clock = SystemClock>
 class Timer {
 public:
   enum TimerErrorType {
@@ -67,9 +210,24 @@ public:
     TIMER_ERR_INTERRUPTED = -3
   };
 
+  // What happens to the schedule after a wake-up later than the next deadline
+  // (RT path only: the signal-based path always behaves as OVERRUN_SKIP)
+  enum OverrunPolicy {
+    OVERRUN_CATCH_UP = 0, // keep the schedule, late cycles are followed by short ones
+    OVERRUN_SKIP = 1,     // drop the missed deadlines, keep the phase
+    OVERRUN_RESYNC = 2    // restart the schedule from the late wake-up
+  };
+
+  // Nanoseconds in a DurationType unit
+  static constexpr double NS_PER_UNIT = 1.0E9 * DurationType::period::num /
+                                        DurationType::period::den;
+
   // LIFE-CYCLE ----------------------------------------------------------------
   template <typename IntervalType, typename MaxWaitType>
   explicit Timer(IntervalType interval, MaxWaitType max_wait) {
+    if (!valid_interval(interval)) {
+      throw TimerError("Timer: interval below the DurationType resolution");
+    }
     _interval = duration_cast<DurationType>(interval);
     _max_wait = duration_cast<DurationType>(max_wait);
     time_to_time_struct(_interval, _rep.it_interval);
@@ -103,81 +261,236 @@ public:
   // METHODS -------------------------------------------------------------------
 
   void start() {
-    _last = system_clock::now().time_since_epoch();
+    _last = _clock.now();
 #ifdef ENABLE_RT_SCHEDULER
-    clock_gettime(CLOCK_REALTIME, &_now_ts);
+    _clock.gettime(_now_ts);
     timespec_add_interval(&_now_ts);
 #else
-    struct itimerval itimer;
-    // First interval:
-    itimer.it_interval.tv_sec = 0;
-    itimer.it_interval.tv_usec = 250 * 1000;
-    // Subsequent intervals:
-    itimer.it_value.tv_sec = 0;
-    itimer.it_value.tv_usec = 250 * 1000;
-
-    if (setitimer(ITIMER_REAL, &_rep, NULL) != 0) {
+    if (_clock.arm(_rep) != 0) {
       throw TimerError(std::strerror(errno));
     }
-    signal(SIGALRM, [](int signo) {});
 #endif
     _started = true;
   }
 
   void stop() {
-    struct itimerval timer;
-    timerclear(&timer.it_value);
-    timerclear(&timer.it_interval);
-    setitimer(ITIMER_REAL, &timer, NULL);
-    signal(SIGALRM, SIG_DFL);
-    _n = 0;
-    _min = INFINITY;
-    _max = 0;
-    _mean = 0;
-    _tet = 0;
-    _sd = 0;
+    _clock.disarm();
+    reset_stats();
     _started = false;
     _first = true;
+    _cycle = CycleRecord();
   }
 
   double dt() const { return _dt; }
 
+  Clock &clock() { return _clock; }
+
+  // The statistics collectors, e.g. for t.collectors().histogram(); only the
+  // ANY THREAD methods of a collector may be called outside the timed loop
+  Stats &collectors() { return _stats; }
+  const Stats &collectors() const { return _stats; }
+
+  void set_overrun_policy(OverrunPolicy policy) { _overrun_policy = policy; }
+
+  OverrunPolicy overrun_policy() const { return _overrun_policy; }
+
+  // Observers are called in order of attachment, at every cycle
+  void attach(CycleObserver &observer) {
+    if (_n_observers == TIMER_MAX_OBSERVERS) {
+      throw TimerError("Timer: too many observers");
+    }
+    _observers[_n_observers++] = &observer;
+  }
+
+  void detach(CycleObserver &observer) {
+    size_t j = 0;
+    for (size_t i = 0; i < _n_observers; i++) {
+      if (_observers[i] != &observer)
+        _observers[j++] = _observers[i];
+    }
+    _n_observers = j;
+  }
+
+  // Probes are sampled in order of attachment, at every cycle
+  void attach_probe(CycleProbe &probe) {
+    if (_n_probes == TIMER_MAX_PROBES) {
+      throw TimerError("Timer: too many probes");
+    }
+    _probes[_n_probes++] = &probe;
+  }
+
+  void detach_probe(CycleProbe &probe) {
+    size_t j = 0;
+    for (size_t i = 0; i < _n_probes; i++) {
+      if (_probes[i] != &probe)
+        _probes[j++] = _probes[i];
+    }
+    _n_probes = j;
+  }
+
+  const CycleRecord &cycle() const { return _cycle; }
+
+  // Queues a change, to be applied at the end of the next wait(): the
+  // deadline already scheduled is kept, and the following ones use the new
+  // settings. Can be called from any non-RT thread; returns false if the
+  // mailbox is full or the interval is not valid (see valid_interval()).
+  bool post(const TimerCommand &command) {
+    if (command.type == TimerCommand::SET_INTERVAL &&
+        !valid_interval(nanoseconds(command.value))) {
+      return false;
+    }
+    lock_guard<mutex> lock(_post_mutex); // producers only, never the RT side
+    return _mailbox.push(command);
+  }
+
+  // Same as posting SET_INTERVAL, without locks: to be called from the thread
+  // running the loop. The cycle in progress keeps its deadline, the following
+  // ones are spaced by the new interval; _first and stats are untouched.
+  template <typename IntervalType> void set_interval(IntervalType interval) {
+    if (!valid_interval(interval)) {
+      throw TimerError("Timer: interval below the DurationType resolution");
+    }
+    set_pending({TimerCommand::SET_INTERVAL,
+                 duration_cast<nanoseconds>(interval).count()});
+  }
+
+  // True if the interval is positive once converted to DurationType: with an
+  // integer DurationType, shorter intervals truncate to 0
+  template <typename IntervalType>
+  static bool valid_interval(IntervalType interval) {
+    return duration_cast<DurationType>(
+               duration_cast<nanoseconds>(interval)).count() > 0;
+  }
+
+  // Same as posting SET_MAX_WAIT, from the thread running the loop: the new
+  // value applies from the next cycle
+  template <typename MaxWaitType> void set_max_wait(MaxWaitType max_wait) {
+    set_pending({TimerCommand::SET_MAX_WAIT,
+                 duration_cast<nanoseconds>(max_wait).count()});
+  }
+
+  DurationType interval() const { return _interval; }
+
+  DurationType max_wait() const { return _max_wait; }
+
+  // With buckets enabled, statistics are also collected separately for each
+  // interval used, up to TIMER_MAX_PERIOD_BUCKETS (the last bucket then
+  // collects all further intervals). Set before start().
+  void set_period_buckets(bool enable) {
+    _period_buckets = enable;
+    reset_stats();
+  }
+
+  // Statistics by interval (in DurationType units), from any thread
+  map<double, TimerStats> period_stats() const {
+    if constexpr (Stats::enabled) {
+      map<double, TimerStats> result;
+      size_t n = _n_buckets_published.load(memory_order_acquire);
+      for (size_t i = 0; i < n; i++) {
+        PeriodStats b = _buckets_published[i].load();
+        b.stats.sd = b.stats.n > 1 ? sqrt(b.m2 / (b.stats.n - 1)) : 0;
+        result[b.interval] = b.stats;
+      }
+      return result;
+    } else {
+      throw TimerError("Timer: stats not enabled");
+    }
+  }
+
   TimerErrorType wait() {
     if (!_started) {
       throw TimerError("Timer: not started");
     }
+    TIMER_USDT(timer, wait_entry, (uintptr_t)this);
     TimerErrorType ret = TIMER_OK;
     _dt = 0;
-    chrono::duration<double> pre_sleep, now;
-    if constexpr (EnableStats) {
-      pre_sleep = system_clock::now().time_since_epoch();
+    nanoseconds pre_sleep, now, deadline;
+    if (Stats::enabled || _n_observers > 0) {
+      pre_sleep = _clock.now();
     }
+    for (size_t i = 0; i < _n_probes; i++)
+      _probes[i]->on_sleep(_cycle);
 #ifdef ENABLE_RT_SCHEDULER
-    if (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &_now_ts, NULL) != 0) {
+    deadline = seconds(_now_ts.tv_sec) + nanoseconds(_now_ts.tv_nsec);
+    if (_clock.sleep_until(_now_ts) != 0) {
       ret = TIMER_ERR_INTERRUPTED;
     }
     timespec_add_interval(&_now_ts);
 #else
     // call NOT interrupted by SIGALRM
-    if (nanosleep(&_rqtp, NULL) == 0) {
+    if (_clock.sleep(_rqtp) == 0) {
       ret = TIMER_ERR_SIGNAL_LATE;
     }
 #endif
-    now = system_clock::now().time_since_epoch();
+    now = _clock.now();
+#ifdef ENABLE_RT_SCHEDULER
+    if (_overrun_policy != OVERRUN_CATCH_UP) {
+      reschedule(now);
+    }
+#else
+    // the itimer is not tied to known deadlines: take the nominal one
+    deadline = _last + duration_cast<nanoseconds>(_interval);
+#endif
     _dt = duration_cast<DurationType>(now - _last).count();
-    if constexpr (EnableStats) {
-      _tet = _dt - duration_cast<DurationType>(now - pre_sleep).count();
+    const bool valid = ret == TIMER_OK; // don't update stats on signals
+    if (_dt > _max_wait.count()) {
+      ret = TIMER_ERR_MAX_WAIT_EXCEEDED; // indicate that max wait time exceeded
+    }
+    if constexpr (Stats::enabled) {
       if (!_first) {
-        _min = min(_min, _dt);
-        _max = max(_max, _dt);
-        if (ret == TIMER_OK)
-          update_stats(_dt); // don't update on signals
+        // period, TET (wake-up to wait()) and wake latency (wake-up minus
+        // deadline) are measured separately
+        const int64_t tet_ns = (pre_sleep - _last).count();
+        const int64_t latency_ns = (now - deadline).count();
+        const StatsSample sample = {_dt,
+                                    tet_ns / NS_PER_UNIT,
+                                    latency_ns / NS_PER_UNIT,
+                                    (double)_interval.count(),
+                                    (now - _last).count(),
+                                    tet_ns,
+                                    latency_ns,
+                                    NS_PER_UNIT,
+                                    ret,
+                                    valid};
+        _stats.add(sample);
+        TIMER_USDT(timer, stats_update, (uintptr_t)this, sample.dt_ns, tet_ns,
+                   latency_ns);
+        if (_period_buckets && valid)
+          update_bucket(sample);
       }
       _first = false;
     }
-    if (_dt > _max_wait.count()) {
-      ret = TIMER_ERR_MAX_WAIT_EXCEEDED; // indicate that max wait time exceeded
+    if (_n_probes > 0) {
+      _cycle.probes = 0;
+      for (size_t i = 0; i < _n_probes; i++)
+        _probes[i]->on_wake(_cycle);
+    }
+    if (_n_observers > 0) {
+      _cycle.seq++;
+      _cycle.wake = now.count();
+      _cycle.dt = (now - _last).count();
+      _cycle.tet = (pre_sleep - _last).count();
+      _cycle.lateness = (now - deadline).count();
+      _cycle.ret = ret;
+      for (size_t i = 0; i < _n_observers; i++)
+        _observers[i]->on_cycle(_cycle);
     }
+    if (_n_pending > 0) {
+      for (size_t i = 0; i < _n_pending; i++)
+        apply(_pending[i]);
+      _n_pending = 0;
+    }
+    if (!_mailbox.empty()) {
+      TimerCommand command;
+      while (_mailbox.pop(command))
+        apply(command);
+    }
+    if (ret != TIMER_OK) {
+      TIMER_USDT(timer, deadline_miss, (uintptr_t)this, (int)ret,
+                 (now - deadline).count());
+    }
+    TIMER_USDT(timer, wait_exit, (uintptr_t)this, (int)ret,
+               (now - _last).count(), (now - deadline).count());
     _last = now;
     return ret;
   }
@@ -197,48 +510,150 @@ public:
     }
   }
 
+  // Safe to call from any thread: reads the values last published by each
+  // collector (n, min, max, mean, sd, tet, dt_p99, ...)
   map<string, double> stats() const {
-    if constexpr (EnableStats) {
-      return {{"n", _n},       {"min", _min}, {"max", _max},
-              {"mean", _mean}, {"sd", _sd},   {"tet", _tet}};
+    if constexpr (Stats::enabled) {
+      map<string, double> result;
+      _stats.stats(result);
+      return result;
     } else {
       throw TimerError("Timer: stats not enabled");
     }
   }
 
-private:
+  // Copy of the statistics, lock-free for readers and wait-free for wait();
+  // each collector publishes a consistent group of fields
+  TimerStats stats_snapshot() const {
+    if constexpr (Stats::enabled) {
+      TimerStats s;
+      _stats.snapshot(s);
+      return s;
+    } else {
+      throw TimerError("Timer: stats not enabled");
+    }
+  }
+
+protected:
   // ATTRIBUTES ----------------------------------------------------------------
+  Clock _clock;
   DurationType _interval;
   DurationType _max_wait;
   struct itimerval _rep;
   struct timespec _rqtp;
-  map<string, double> _stats;
-  size_t _n = 0;
-  double _min = INFINITY, _max = 0, _mean = 0, _sd = 0, _tet = 0;
+  Stats _stats;
   bool _started = false, _first = true;
+  OverrunPolicy _overrun_policy = OVERRUN_CATCH_UP;
+  CycleRecord _cycle;
+  CycleObserver *_observers[TIMER_MAX_OBSERVERS];
+  size_t _n_observers = 0;
+  CycleProbe *_probes[TIMER_MAX_PROBES];
+  size_t _n_probes = 0;
+  SpscQueue<TimerCommand> _mailbox{16};
+  mutex _post_mutex;
+  TimerCommand _pending[4];
+  size_t _n_pending = 0;
+  bool _period_buckets = false;
+  size_t _bucket = 0, _n_buckets = 0;
+  PeriodStats _buckets[TIMER_MAX_PERIOD_BUCKETS];
+  Seqlock<PeriodStats> _buckets_published[TIMER_MAX_PERIOD_BUCKETS];
+  atomic<size_t> _n_buckets_published{0};
   struct timespec _now_ts;
-  duration<double> _last;
+  nanoseconds _last;
   double _dt = 0; // elapsed time in seconds
 
   // PRIVATE METHODS -----------------------------------------------------------
-  void update_stats(double x) {
-    _n++;
-    if (_n <= 1) { // recursion formula: first element (base-1)
-      _mean = x;
-      _tet = 0;
-      _sd = 0;
-    } else {
-      const double n1 = _n - 1;
-      const double n2 = _n - 2;
-      const double nr = 1.0 / _n;
-      const double n1r = 1.0 / n1;
-      const double nn1 = _n / n1;
-      _mean = nr * (n1 * _mean + x);
-      _tet = nr * (n1 * _tet + x);
-      _sd = sqrt(n1r * (n2 * pow(_sd, 2) + nn1 * pow(_mean - x, 2)));
+  void apply(const TimerCommand &command) {
+    switch (command.type) {
+    case TimerCommand::SET_INTERVAL: {
+      if (!valid_interval(nanoseconds(command.value))) {
+        break; // would divide by zero in reschedule()
+      }
+      nanoseconds old = duration_cast<nanoseconds>(_interval);
+      _interval = duration_cast<DurationType>(nanoseconds(command.value));
+      time_to_time_struct(_interval, _rep.it_interval);
+      time_to_time_struct(_interval, _rep.it_value);
+#ifdef ENABLE_RT_SCHEDULER
+      // the next deadline was computed with the old interval
+      nanoseconds next = seconds(_now_ts.tv_sec) + nanoseconds(_now_ts.tv_nsec);
+      next += duration_cast<nanoseconds>(_interval) - old;
+      _now_ts.tv_sec = next.count() / NSEC_PER_SEC;
+      _now_ts.tv_nsec = next.count() % NSEC_PER_SEC;
+#else
+      _clock.arm(_rep); // restarts the period from this wake-up
+#endif
+      if (_period_buckets) {
+        select_bucket();
+      }
+      break;
+    }
+    case TimerCommand::SET_MAX_WAIT:
+      _max_wait = duration_cast<DurationType>(nanoseconds(command.value));
+      time_to_time_struct(_max_wait, _rqtp);
+      break;
+    case TimerCommand::RESET_STATS:
+      reset_stats();
+      break;
+    case TimerCommand::SET_OVERRUN_POLICY:
+      _overrun_policy = (OverrunPolicy)command.value;
+      break;
+    }
+  }
+
+  void reset_stats() {
+    if constexpr (Stats::enabled) {
+      _stats.reset();
+      _n_buckets = 0;
+      _n_buckets_published.store(0, memory_order_release);
+      if (_period_buckets) {
+        select_bucket();
+      }
     }
   }
 
+  void set_pending(const TimerCommand &command) {
+    if (_n_pending == sizeof(_pending) / sizeof(_pending[0])) {
+      throw TimerError("Timer: too many pending changes");
+    }
+    _pending[_n_pending++] = command;
+  }
+
+  // Makes the bucket of the current interval the active one
+  void select_bucket() {
+    double interval = _interval.count();
+    for (_bucket = 0; _bucket < _n_buckets; _bucket++) {
+      if (_buckets[_bucket].interval == interval)
+        return;
+    }
+    if (_n_buckets == TIMER_MAX_PERIOD_BUCKETS) {
+      _bucket = _n_buckets - 1;
+      return;
+    }
+    _bucket = _n_buckets++;
+    _buckets[_bucket] = PeriodStats();
+    _buckets[_bucket].interval = interval;
+    _buckets_published[_bucket].store(_buckets[_bucket]);
+    _n_buckets_published.store(_n_buckets, memory_order_release);
+  }
+
+  // Welford update of the active bucket, sd left to period_stats()
+  void update_bucket(const StatsSample &sample) {
+    TimerStats &s = _buckets[_bucket].stats;
+    double &m2 = _buckets[_bucket].m2;
+    const double x = sample.dt;
+    s.n++;
+    s.min = min(s.min, x);
+    s.max = max(s.max, x);
+    double d = x - s.mean;
+    s.mean += d / s.n;
+    m2 += d * (x - s.mean);
+    s.tet += (sample.tet - s.tet) / s.n;
+    s.tet_max = max(s.tet_max, sample.tet);
+    s.latency += (sample.latency - s.latency) / s.n;
+    s.latency_max = max(s.latency_max, sample.latency);
+    _buckets_published[_bucket].store(_buckets[_bucket]);
+  }
+
   template <typename T, typename S>
   static void time_to_time_struct(T d, S &ts) {
     ts.tv_sec = duration_cast<seconds>(d).count();
@@ -251,14 +666,28 @@ private:
     }
   }
 
-#ifdef ENABLE_RT_SCHEDULER
   inline void timespec_add_interval(struct timespec *t) {
     long dns = duration_cast<nanoseconds>(_interval).count();
     t->tv_nsec += dns;
     t->tv_sec += t->tv_nsec / NSEC_PER_SEC;
     t->tv_nsec %= NSEC_PER_SEC;
   }
-#endif
+
+  // Moves the next deadline past now, according to the overrun policy
+  void reschedule(nanoseconds now) {
+    nanoseconds next = seconds(_now_ts.tv_sec) + nanoseconds(_now_ts.tv_nsec);
+    if (next > now) {
+      return;
+    }
+    nanoseconds iv = duration_cast<nanoseconds>(_interval);
+    if (_overrun_policy == OVERRUN_SKIP) {
+      next += ((now - next) / iv + 1) * iv;
+    } else {
+      next = now + iv;
+    }
+    _now_ts.tv_sec = next.count() / NSEC_PER_SEC;
+    _now_ts.tv_nsec = next.count() % NSEC_PER_SEC;
+  }
 };
 
 #endif // TIMER_HPP
@@ -293,7 +722,7 @@ int main(int argc, const char *argv[]) {
   duration<double> max_d(delay * 1.1); // 1 second
 
   // Default template parameter is duration<double> in secs
-  Timer<duration<double>, true> t(d, max_d);
+  Timer<duration<double>, FullStats> t(d, max_d);
   // Or:
   // Timer<milliseconds> t(milliseconds(200), milliseconds(1000));
 
@@ -326,6 +755,7 @@ int main(int argc, const char *argv[]) {
   cout << "Max time: " << t.stats()["max"] << " sec" << endl;
   cout << "Mean time: " << t.stats()["mean"] << " sec" << endl;
   cout << "Mean TET: " << t.stats()["tet"] << " sec" << endl;
+  cout << "Mean wake latency: " << t.stats()["latency"] << " sec" << endl;
   cout << "Standard deviation: " << t.stats()["sd"] << " sec" << endl;
 
   t.stop();
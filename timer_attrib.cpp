@@ -0,0 +1,89 @@
+/*
+timer-attrib: why were the worst cycles of a run late?
+
+Reads the cycles of a Timer run, recorded by TraceWriter (or the dumps of a
+FlightRecorder: several files are merged), and the system state sampled by
+SystemSampler during the same run, then lists the latest cycles with their
+most likely causes, ranked (see jitter_report.hpp). If the sampler was
+attached to the timer as a probe, the cycles are also grouped by CPU
+frequency and throttling state, with their mean and maximum tet. The
+conditions of the run stored in the trace header (LatencyGuard report) are
+printed first.
+
+Compile with: clang++ -std=c++17 -O2 -o timer-attrib timer_attrib.cpp
+Run as:       ./timer-attrib [-n cycles] [-c causes] [-s state.csv] trace.bin...
+
+`timer_bench trace` records a trace and a state file to try it.
+*/
+#include "flight_recorder.hpp"
+#include "jitter_report.hpp"
+#include <iostream>
+
+int main(int argc, const char *argv[]) {
+  size_t worst = 100, causes = 3;
+  string state;
+  vector<string> traces;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc)
+      worst = atol(argv[++i]);
+    else if (arg == "-c" && i + 1 < argc)
+      causes = atol(argv[++i]);
+    else if (arg == "-s" && i + 1 < argc)
+      state = argv[++i];
+    else if (arg[0] != '-')
+      traces.push_back(arg);
+    else {
+      traces.clear();
+      break;
+    }
+  }
+  if (traces.empty()) {
+    cerr << "Usage: " << argv[0]
+         << " [-n cycles] [-c causes] [-s state.csv] trace.bin..." << endl;
+    return 1;
+  }
+  try {
+    vector<CycleRecord> records;
+    uint64_t dropped = 0;
+    string conditions;
+    for (auto &path : traces) {
+      FlightRecorderHeader h;
+      string text;
+      auto r = FlightRecorder::load(path, &h, &text);
+      records.insert(records.end(), r.begin(), r.end());
+      dropped += h.dropped;
+      if (conditions.empty())
+        conditions = text;
+    }
+    if (!conditions.empty())
+      cout << "Conditions: " << conditions << endl;
+    // flight recorder windows may overlap
+    sort(records.begin(), records.end(),
+         [](const CycleRecord &a, const CycleRecord &b) {
+           return a.seq < b.seq;
+         });
+    records.erase(unique(records.begin(), records.end(),
+                         [](const CycleRecord &a, const CycleRecord &b) {
+                           return a.seq == b.seq;
+                         }),
+                  records.end());
+    vector<SystemSample> samples;
+    if (!state.empty())
+      samples = SystemSampler::load(state);
+    size_t sched = count_if(records.begin(), records.end(),
+                            [](const CycleRecord &r) {
+                              return r.probes & CycleRecord::PROBE_SCHED;
+                            });
+    cout << records.size() << " cycles (" << dropped << " dropped, " << sched
+         << " with scheduling counters), " << samples.size()
+         << " system samples" << endl;
+    print_jitter_report(attribute_jitter(records, samples, worst), cout,
+                        causes, records.empty() ? 0 : records[0].wake);
+    print_tet_by_frequency(records, cout);
+  } catch (const TimerError &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
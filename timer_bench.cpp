@@ -0,0 +1,1414 @@
+/*
+Timer hot-path microbenchmark
+
+Measures the cost of wait(), stats() and timespec_add_interval() in ns/call,
+with and without stats and for each DurationType, then the cost of wait() and
+of the update of the collectors alone for each combination of statistics
+collectors. A mock clock replaces the system clock so that no call ever
+sleeps: what remains is the overhead of the Timer itself. The cost of a
+SchedProbe sample and of a PerfProbe cycle (syscalls included) is reported
+as well, and so is the cost of a timestamp from the system clock and from
+the calibrated CPU counter (CycleClock), and the cost of a cycle with two
+profiled sections (build with -DTIMER_PROFILE to enable the profiler,
+without it the cost must be that of an empty loop). The cost of the
+trace_marker writes per cycle is measured on a file stand-in, and on tracefs
+when it is available. A USDT probe with no tracer attached is compared with
+the same loop without it: the difference must be that of a nop.
+
+It then stress-tests the seqlock publishing the stats: one writer and
+several reader threads, counting torn reads (the exit code is 1 if any).
+
+It validates the running moments (WelfordStats, WelfordStats128) against
+exact integer arithmetic on a synthetic trace of the given number of days at
+1 kHz (2.6 * 10^9 cycles for 30 days), reporting the relative errors of mean
+and standard deviation of period, TET and wake latency; the legacy recursion
+formula and naive double sums are shown for comparison. The exit code is 1 if
+the error of a collector exceeds 1e-12.
+
+Finally it checks the accuracy of the streaming quantile policies: the same
+simulated traces (VirtualClock) are run through P2Quantiles and
+TDigestQuantiles, and the estimates are compared with the exact quantiles of
+the trace, as rank errors |F(estimate) - p|. The exit code is 1 if any error
+exceeds the tolerance. SystemSampler and LatencyGuard are checked against a
+fake sysfs and procfs tree, and a Pipeline, serial and threaded, on a mock
+device driven by a simulated timer (every frame written once, in order,
+with the right outputs), then with a fixed output latency on a real timer
+(no write before its release time; all late when the compute outlasts the
+delay, late outputs counted otherwise). Interval changes are run on virtual
+time: the dt of every cycle around each change and the statistics of each
+interval are checked. So are RollingStats: windows of the last N cycles and
+of the last T seconds against a brute-force recomputation, and the aligned
+rollups read back from a TelemetryExport. correlate_noise() is run on
+synthetic noise gaps inside, across and around late wake-ups, and
+attribute_jitter() on synthetic cycles and samples (the causes of each late
+cycle, in order).
+
+In every mode, the process holds /dev/cpu_dma_latency at 0 (LatencyGuard)
+and the output starts with a "# conditions" line: the JSON report of the
+system configuration checks.
+
+With "noise" as first argument, it runs instead a noise detector (see
+noise_detector.hpp) on the last CPU for the given seconds, while a 1 kHz
+Timer runs on the first one, and correlates the late wake-ups of the Timer
+with the gaps seen by the detector.
+
+With "trace", it runs a 1 kHz Timer on the first CPU for the given seconds,
+recording every cycle with its scheduling counters and CPU frequency,
+temperature and throttling state (TraceWriter) and the system state
+(SystemSampler) to <prefix>.bin and <prefix>.csv, to be read by
+timer-attrib.
+
+With "pipeline", a 1 kHz Timer on the first CPU reads, computes and writes a
+mock device, each stage spinning for the given cost: first serially on the
+timer thread, then as a Pipeline with the compute and output stages on the
+second and third CPUs and the outputs released 3 cycles after their
+deadline. The time in each stage is printed as CSV, then the frames written,
+overruns, and the jitter of the writes. With a cost of a third of the period
+or more, the serial loop overruns and the pipeline keeps up.
+
+Compile with: clang++ -std=c++17 -O2 -DENABLE_RT_SCHEDULER -o timer_bench timer_bench.cpp
+Run as:       ./timer_bench [iterations] [trace days]
+              sudo ./timer_bench noise [seconds] [threshold us] [late us]
+              sudo ./timer_bench trace [seconds] [prefix]
+              sudo ./timer_bench pipeline [seconds] [stage cost us]
+*/
+#include "cycle_clock.hpp"
+#include "jitter_report.hpp"
+#include "latency_guard.hpp"
+#include "mock_device.hpp"
+#include "noise_detector.hpp"
+#include "perf_probe.hpp"
+#include "pipeline.hpp"
+#include "rolling_stats.hpp"
+#include "sched_probe.hpp"
+#include "section_profiler.hpp"
+#include "system_sampler.hpp"
+#include "trace_marker.hpp"
+#include "trace_writer.hpp"
+#include "timer.hpp"
+#include "virtual_clock.hpp"
+#include <atomic>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Clock policy that never sleeps: time advances by a fixed step on every
+// reading, and sleeping jumps straight to the deadline
+struct MockClock {
+  nanoseconds t{1000000000};
+  nanoseconds step{1000};
+
+  nanoseconds now() { return t += step; }
+
+  void gettime(struct timespec &ts) const {
+    ts.tv_sec = t.count() / NSEC_PER_SEC;
+    ts.tv_nsec = t.count() % NSEC_PER_SEC;
+  }
+
+  int sleep_until(const struct timespec &ts) {
+    t = seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+    return 0;
+  }
+
+  int sleep(const struct timespec &ts) {
+    t += seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+    return -1; // as if interrupted by SIGALRM
+  }
+
+  int arm(const struct itimerval &) { return 0; }
+  void disarm() {}
+};
+
+// Exposes the protected hot-path methods of Timer
+template <typename DurationType, typename Stats>
+struct TimerProbe : Timer<DurationType, Stats, MockClock> {
+  using Base = Timer<DurationType, Stats, MockClock>;
+  using Base::Base;
+  using Base::timespec_add_interval;
+};
+
+template <typename T> static inline void do_not_optimize(T const &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Forces pending stores to memory, without copying anything
+static inline void clobber_memory() { asm volatile("" : : : "memory"); }
+
+template <typename F> static double ns_per_call(size_t n, F &&f) {
+  for (size_t i = 0; i < n / 10; i++) // warm-up
+    f(i);
+  auto t0 = steady_clock::now();
+  for (size_t i = 0; i < n; i++)
+    f(i);
+  auto t1 = steady_clock::now();
+  return duration_cast<duration<double, nano>>(t1 - t0).count() / n;
+}
+
+static void report(const string &name, const string &type,
+                   const string &stats, double ns) {
+  cout << name << "," << type << "," << stats << "," << ns << endl;
+}
+
+template <typename DurationType, typename Stats>
+static void bench(const string &type, const string &stats, size_t n) {
+  TimerProbe<DurationType, Stats> t(milliseconds(1), milliseconds(2));
+  t.start();
+
+  report("wait", type, stats, ns_per_call(n, [&](size_t) {
+           do_not_optimize(t.wait());
+         }));
+
+  struct timespec ts = {0, 0};
+  report("timespec_add_interval", type, stats, ns_per_call(n, [&](size_t) {
+           t.timespec_add_interval(&ts);
+           do_not_optimize(ts);
+         }));
+
+  if constexpr (Stats::enabled) {
+    report("stats_snapshot", type, stats, ns_per_call(n, [&](size_t) {
+             auto s = t.stats_snapshot();
+             do_not_optimize(s);
+           }));
+    report("stats", type, stats, ns_per_call(n / 10, [&](size_t) {
+             auto s = t.stats();
+             do_not_optimize(s);
+           }));
+  }
+  t.stop();
+}
+
+template <typename DurationType>
+static void bench_both(const string &type, size_t n) {
+  bench<DurationType, NoStats>(type, "none", n);
+  bench<DurationType, FullStats>(type, "full", n);
+}
+
+// Cost of wait() and of the collectors update alone, for a combination
+template <typename Stats>
+static void bench_collectors(const string &stats, size_t n) {
+  TimerProbe<duration<double>, Stats> t(milliseconds(1), milliseconds(2));
+  t.start();
+  report("wait", "duration<double>", stats,
+         ns_per_call(n, [&](size_t) { do_not_optimize(t.wait()); }));
+  report("collect", "duration<double>", stats, ns_per_call(n, [&](size_t i) {
+           int64_t dt = 1000000 + (i & 0xFF);
+           t.collectors().add(
+               {dt * 1.0E-9, 2.0E-4, 2.0E-5, 1.0E-3, dt, 200000, 20000, 1.0E9,
+                0, true});
+           clobber_memory();
+         }));
+  t.stop();
+}
+
+// Fraction of the sorted samples not greater than x
+static double cdf(const vector<double> &sorted, double x) {
+  return (double)(upper_bound(sorted.begin(), sorted.end(), x) -
+                  sorted.begin()) /
+         sorted.size();
+}
+
+// Records period, TET and wake latency of each cycle, in seconds
+struct TraceLog : CycleObserver {
+  vector<double> dt, tet, latency;
+
+  void on_cycle(const CycleRecord &r) override {
+    if (r.seq > 1 && r.ret == 0) { // the first cycle is not in the stats
+      dt.push_back(r.dt * 1.0E-9);
+      tet.push_back(r.tet * 1.0E-9);
+      latency.push_back(r.lateness * 1.0E-9);
+    }
+  }
+};
+
+// Runs n simulated cycles with the given lateness and loop body, then
+// returns the worst rank error of the estimated quantiles of period, TET and
+// wake latency
+template <typename Quantiles>
+static double quantile_accuracy(const string &policy, const string &trace,
+                                VirtualClock::Jitter lateness,
+                                VirtualClock::Jitter body, size_t n) {
+  Timer<duration<double>, Collectors<QuantileStats<Quantiles>>, VirtualClock>
+      t(milliseconds(1), milliseconds(10));
+  t.clock().set_jitter(lateness);
+  TraceLog log;
+  for (auto *v : {&log.dt, &log.tet, &log.latency})
+    v->reserve(n);
+  t.attach(log);
+  t.start();
+  for (size_t i = 0; i <= n; i++) {
+    t.clock().advance(body());
+    t.wait();
+  }
+  map<string, double> est = t.stats();
+  t.stop();
+  for (auto *v : {&log.dt, &log.tet, &log.latency})
+    sort(v->begin(), v->end());
+
+  double worst = 0;
+  cerr << "Quantiles " << policy << ", " << trace << " (" << log.dt.size()
+       << " cycles), rank errors of dt/tet/latency:";
+  for (double p : QUANTILE_PS) {
+    char name[16];
+    snprintf(name, sizeof(name), "p%g", p * 100);
+    double e_dt = fabs(cdf(log.dt, est[string("dt_") + name]) - p);
+    double e_tet = fabs(cdf(log.tet, est[string("tet_") + name]) - p);
+    double e_lat = fabs(cdf(log.latency, est[string("latency_") + name]) - p);
+    cerr << " " << name << " " << e_dt << "/" << e_tet << "/" << e_lat;
+    worst = max({worst, e_dt, e_tet, e_lat});
+  }
+  cerr << endl;
+  return worst;
+}
+
+// Same traces for both policies (all sources are seeded); returns the number
+// of failures
+static size_t quantile_accuracy_all(size_t n) {
+  struct Trace {
+    string name;
+    function<VirtualClock::Jitter()> lateness, body;
+  };
+  vector<Trace> traces = {
+      {"normal",
+       [] { return VirtualClock::normal_jitter(microseconds(20),
+                                               microseconds(5), 1); },
+       [] { return VirtualClock::normal_jitter(microseconds(200),
+                                               microseconds(30), 2); }},
+      {"exponential",
+       [] { return VirtualClock::exponential_jitter(microseconds(20), 3); },
+       [] { return VirtualClock::exponential_jitter(microseconds(100), 4); }},
+      {"bimodal",
+       [] {
+         auto fast = VirtualClock::normal_jitter(microseconds(10),
+                                                 microseconds(2), 5);
+         auto slow = VirtualClock::uniform_jitter(microseconds(100),
+                                                  microseconds(400), 6);
+         auto pick = VirtualClock::uniform_jitter(nanoseconds(0),
+                                                  nanoseconds(99), 7);
+         return [=]() { return pick().count() < 95 ? fast() : slow(); };
+       },
+       [] { return VirtualClock::uniform_jitter(microseconds(50),
+                                                microseconds(500), 8); }}};
+  // With compression 100, t-digest centroids around the median hold about 1%
+  // of the samples: rank errors up to ~1e-3 are expected there
+  const double tolerance = 0.005;
+  size_t failures = 0;
+  for (auto &tr : traces) {
+    failures += quantile_accuracy<P2Quantiles>("p2", tr.name, tr.lateness(),
+                                               tr.body(), n) > tolerance;
+    failures += quantile_accuracy<TDigestQuantiles>(
+                    "tdigest", tr.name, tr.lateness(), tr.body(), n) > tolerance;
+  }
+  if (failures > 0) {
+    cerr << "Quantile accuracy: " << failures << " traces above tolerance"
+         << endl;
+  }
+  return failures;
+}
+
+static void write_file(const filesystem::path &path, const string &text) {
+  filesystem::create_directories(path.parent_path());
+  ofstream(path) << text;
+}
+
+// Runs SystemSampler against a fake sysfs and procfs tree, first with the
+// Raspberry Pi firmware throttling flags, then with the cpufreq and
+// thermal_throttle fallback; returns the number of failed checks
+static size_t system_sampler_check() {
+  filesystem::path root = filesystem::temp_directory_path() /
+                          ("timer_bench_sysfs." + to_string(getpid()));
+  filesystem::path sys = root / "sys", proc = root / "proc";
+  filesystem::path cpu = sys / "devices/system/cpu/cpu1";
+  size_t failures = 0;
+  auto check = [&failures](bool ok, const string &what) {
+    if (!ok) {
+      cerr << "System sampler: " << what << endl;
+      failures++;
+    }
+  };
+  auto rows = [](const string &csv) {
+    set<string> r;
+    istringstream in(csv);
+    string line;
+    while (getline(in, line))
+      r.insert(line.substr(line.find(',', line.find(',') + 1) + 1));
+    return r;
+  };
+
+  write_file(cpu / "cpufreq/scaling_cur_freq", "1500000\n");
+  write_file(sys / "devices/platform/soc/soc:firmware/get_throttled",
+             "50006\n");
+  write_file(sys / "class/thermal/thermal_zone0/temp", "61234\n");
+  write_file(sys / "class/thermal/thermal_zone0/type", "cpu-thermal\n");
+  write_file(sys / "class/thermal/thermal_zone1/temp", "48000\n");
+  write_file(sys / "class/thermal/thermal_zone1/type", "gpu-thermal\n");
+  write_file(proc / "interrupts", "      CPU0   CPU1\n"
+                                  " 24:     5     10  GICv2  eth0\n"
+                                  "LOC:   100    200  Local timer interrupts\n"
+                                  "ERR:     0\n");
+  write_file(proc / "softirqs", "      CPU0   CPU1\n TIMER: 7 9\n RCU: 1 1\n");
+  {
+    SystemSampler sampler(1, milliseconds(100), sys.string(), proc.string());
+    ostringstream first, second;
+    sampler.sample(first);
+    write_file(proc / "interrupts", "      CPU0   CPU1\n"
+                                    " 24:     5     25  GICv2  eth0\n"
+                                    "LOC:   100    300  Local timer interrupts\n"
+                                    "ERR:     0\n");
+    write_file(proc / "softirqs", "      CPU0   CPU1\n TIMER: 7 12\n RCU: 1 1\n");
+    sampler.sample(second);
+    set<string> r = rows(second.str());
+    check(r == set<string>{"irq,24 GICv2 eth0,15",
+                           "irq,LOC Local timer interrupts,100",
+                           "softirq,TIMER,3", "freq,cpu1,1500000",
+                           "throttle,cpu1,327686",
+                           "temp,cpu-thermal,61234", "temp,gpu-thermal,48000"},
+          "unexpected rows\n" + second.str());
+    check(rows(first.str()).count("irq,24 GICv2 eth0,10") == 0,
+          "counts in the first sample");
+    CycleRecord record;
+    sampler.on_wake(record);
+    check((record.probes & CycleRecord::PROBE_SYSTEM) &&
+              record.freq == 1500000 && record.temp == 61234 &&
+              record.throttled == 0x50006,
+          "state not merged into the record");
+  }
+
+  filesystem::remove_all(sys / "devices/platform");
+  write_file(cpu / "cpufreq/cpuinfo_max_freq", "2400000\n");
+  write_file(cpu / "cpufreq/scaling_max_freq", "1500000\n");
+  write_file(cpu / "thermal_throttle/core_throttle_count", "3\n");
+  {
+    SystemSampler sampler(1, milliseconds(100), sys.string(), proc.string());
+    ostringstream out;
+    sampler.sample(out);
+    check(sampler.state().throttled == SystemSample::FREQ_CAPPED,
+          "frequency cap not seen");
+    write_file(cpu / "thermal_throttle/core_throttle_count", "4\n");
+    sampler.sample(out);
+    check(sampler.state().throttled ==
+              (SystemSample::FREQ_CAPPED | SystemSample::THROTTLED),
+          "thermal_throttle counter not seen");
+  }
+  filesystem::remove_all(root);
+  cout << "System sampler on a fake sysfs tree: "
+       << (failures == 0 ? "ok" : "FAILED") << endl;
+  return failures;
+}
+
+// Runs LatencyGuard against a fake sysfs and procfs tree, with a regular file
+// standing for /dev/cpu_dma_latency; returns the number of failed checks
+static size_t latency_guard_check() {
+  filesystem::path root = filesystem::temp_directory_path() /
+                          ("timer_bench_guard." + to_string(getpid()));
+  filesystem::path sys = root / "sys", proc = root / "proc";
+  filesystem::path qos = root / "cpu_dma_latency";
+  size_t failures = 0;
+  auto expect = [&failures](const LatencyGuard &g, const string &name,
+                            LatencyCheck::Status status, const string &value) {
+    for (auto &c : g.checks()) {
+      if (c.name == name && (c.status != status || c.value != value)) {
+        cerr << "Latency guard: " << name << " is "
+             << LatencyCheck::status_name(c.status) << " " << c.value
+             << ", expected " << LatencyCheck::status_name(status) << " "
+             << value << endl;
+        failures++;
+      }
+    }
+  };
+
+  write_file(qos, "");
+  write_file(sys / "kernel/realtime", "1\n");
+  write_file(sys / "devices/system/cpu/cpu1/cpufreq/scaling_governor",
+             "ondemand\n");
+  write_file(sys / "devices/system/cpu/isolated", "1-3\n");
+  write_file(sys / "devices/system/cpu/nohz_full", "2-3\n");
+  write_file(proc / "sys/kernel/sched_rt_runtime_us", "950000\n");
+  write_file(proc / "sys/kernel/sched_rt_period_us", "1000000\n");
+  write_file(proc / "interrupts", "      CPU0   CPU1\n"
+                                  " 24:     5     10  GICv2  eth0\n"
+                                  " 25:     5      0  GICv2  mmc0\n"
+                                  "LOC:   100    200  Local timer interrupts\n");
+  write_file(proc / "irq/24/effective_affinity_list", "1\n");
+  write_file(proc / "irq/25/smp_affinity_list", "0\n");
+  {
+    LatencyGuard guard(1, 0, sys.string(), proc.string(), qos.string());
+    expect(guard, "cpu_dma_latency", LatencyCheck::PASS, "0 us");
+    expect(guard, "preempt_rt", LatencyCheck::PASS, "1");
+    expect(guard, "governor", LatencyCheck::FAIL, "ondemand");
+    expect(guard, "isolcpus", LatencyCheck::PASS, "1-3");
+    expect(guard, "nohz_full", LatencyCheck::WARN, "2-3");
+    expect(guard, "rt_throttling", LatencyCheck::WARN, "950000/1000000 us");
+    expect(guard, "irq_affinity", LatencyCheck::WARN, "1 of 2: 24");
+    if (guard.ok() || guard.report().find("\"governor\":{\"status\":\"fail\"") ==
+                          string::npos) {
+      cerr << "Latency guard: failure not reported" << endl;
+      failures++;
+    }
+  }
+  write_file(sys / "devices/system/cpu/cpu1/cpufreq/scaling_governor",
+             "performance\n");
+  write_file(proc / "sys/kernel/sched_rt_runtime_us", "-1\n");
+  write_file(proc / "irq/24/effective_affinity_list", "0\n");
+  {
+    LatencyGuard guard(1, 0, sys.string(), proc.string(), qos.string());
+    expect(guard, "governor", LatencyCheck::PASS, "performance");
+    expect(guard, "rt_throttling", LatencyCheck::PASS, "-1");
+    expect(guard, "irq_affinity", LatencyCheck::PASS, "0 of 2");
+    try {
+      guard.require();
+    } catch (const TimerError &e) {
+      cerr << e.what() << endl;
+      failures++;
+    }
+  }
+  filesystem::remove_all(root);
+  cout << "Latency guard on a fake sysfs tree: "
+       << (failures == 0 ? "ok" : "FAILED") << endl;
+  return failures;
+}
+
+// Records every cycle, with no allocation up to capacity
+struct RecordLog : CycleObserver {
+  vector<CycleRecord> records;
+
+  explicit RecordLog(size_t capacity) { records.reserve(capacity); }
+
+  void on_cycle(const CycleRecord &r) override {
+    if (records.size() < records.capacity())
+      records.push_back(r);
+  }
+};
+
+// Busy loop standing for a loop body, a transfer or a computation
+static void spin_for(nanoseconds span) {
+  const CycleClock &clock = CycleClock::global();
+  uint64_t end = clock.stamp() + clock.to_ticks(span.count());
+  while (clock.stamp() < end) {
+  }
+}
+
+// Fixed-latency release on a real 1 kHz timer: no write before deadline +
+// delay periods, and with a compute time above the delay, every frame late.
+// Otherwise how many are late depends on the load of the machine: the count
+// is printed, not checked
+template <typename Law>
+static size_t pipeline_release_check(Law law, unsigned delay,
+                                     nanoseconds compute, bool all_late) {
+  using Device = MockDevice<4>;
+  const size_t cycles = 200;
+  const int64_t interval = 1000000;
+  auto slow_law = [&](const Device::Input &in, Device::Output &out) {
+    law(in, out);
+    spin_for(compute);
+  };
+  Device dev(nanoseconds(0), nanoseconds(0), cycles);
+  PipelineConfig cfg;
+  cfg.output_delay = delay;
+  cfg.depth = cycles;
+  Pipeline<Device, decltype(slow_law)> p(dev, slow_law, nanoseconds(interval),
+                                         cfg);
+  RecordLog log(cycles);
+  Timer<duration<double>, NoStats> t(nanoseconds(interval),
+                                     nanoseconds(interval * 100));
+  p.start();
+  t.attach(log);
+  t.attach(p);
+  t.start();
+  for (size_t i = 0; i < cycles; i++)
+    t.wait();
+  t.stop();
+  p.stop();
+  size_t early = 0;
+  for (auto &w : dev.writes()) {
+    const CycleRecord &r = log.records[w.seq - 1];
+    early += w.time < r.wake - r.lateness + delay * interval;
+  }
+  if (!all_late)
+    cout << "Pipeline release after " << delay << " cycles: " << p.late()
+         << " of " << cycles << " outputs late" << endl;
+  if (dev.count() != cycles || early || (all_late && p.late() != cycles)) {
+    cerr << "Pipeline release (" << delay << " cycles, compute "
+         << compute.count() / 1000 << " us): " << dev.count() << " of "
+         << cycles << " frames written, " << early
+         << " before their release time, " << p.late() << " late" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Serial and threaded pipelines on a simulated timer: every frame written
+// once, in order, with the outputs of its own inputs; then the release of the
+// outputs at a fixed latency on a real timer
+static size_t pipeline_check() {
+  using Device = MockDevice<4>;
+  const size_t cycles = 10000;
+  auto law = [](const Device::Input &in, Device::Output &out) {
+    for (size_t i = 0; i < in.size(); i++)
+      out[i] = 2 * in[i] + 1;
+  };
+  size_t failures = 0;
+  for (bool threaded : {false, true}) {
+    Device dev(nanoseconds(0), nanoseconds(0), cycles);
+    PipelineConfig cfg;
+    cfg.threaded = threaded;
+    cfg.depth = cycles; // the simulated timer outruns the stage threads
+    Pipeline<Device, decltype(law)> p(dev, law, milliseconds(1), cfg);
+    Timer<duration<double>, NoStats, VirtualClock> t(milliseconds(1),
+                                                     milliseconds(2));
+    p.start();
+    t.attach(p);
+    t.start();
+    for (size_t i = 0; i < cycles; i++)
+      t.wait();
+    t.stop();
+    p.stop();
+    size_t wrong = 0;
+    for (auto &w : dev.writes()) {
+      for (size_t i = 0; i < w.out.size(); i++)
+        wrong += w.out[i] != 2 * Device::value(w.seq, i) + 1;
+    }
+    if (dev.count() != cycles || p.frames() != cycles || dev.gaps() ||
+        dev.out_of_order() || p.overruns() || wrong ||
+        p.stats(STAGE_END_TO_END).n != cycles) {
+      cerr << "Pipeline (" << (threaded ? "threaded" : "serial")
+           << "): " << dev.count() << " of " << cycles << " frames written, "
+           << dev.gaps() << " gaps, " << dev.out_of_order()
+           << " out of order, " << p.overruns() << " overruns, " << wrong
+           << " wrong outputs" << endl;
+      failures++;
+    }
+  }
+  failures += pipeline_release_check(law, 2, nanoseconds(0), false);
+  failures += pipeline_release_check(law, 1, microseconds(1500), true);
+  cout << "Pipeline on a mock device: " << (failures == 0 ? "ok" : "FAILED")
+       << endl;
+  return failures;
+}
+
+// Interval changes on virtual time, 1000 -> 2000 -> 500 us: the cycle in
+// progress when set_interval() is called keeps its deadline, the following
+// ones are spaced by the new interval, and each interval gets its own bucket
+static size_t period_change_check() {
+  const size_t n[3] = {50, 30, 80};
+  const int64_t us[3] = {1000, 2000, 500};
+  Timer<duration<double>, FullStats, VirtualClock> t(microseconds(us[0]),
+                                                     milliseconds(10));
+  RecordLog log(n[0] + n[1] + n[2]);
+  t.attach(log);
+  t.set_period_buckets(true);
+  t.start();
+  for (int phase = 0; phase < 3; phase++) {
+    if (phase > 0)
+      t.set_interval(microseconds(us[phase]));
+    for (size_t i = 0; i < n[phase]; i++) {
+      t.clock().advance(microseconds(100)); // loop body
+      t.wait();
+    }
+  }
+  size_t failures = 0;
+  // the first cycle after each switch still ends on the old deadline
+  size_t k = 0;
+  for (int phase = 0; phase < 3; phase++) {
+    for (size_t i = 0; i < n[phase]; i++, k++) {
+      int64_t expected = us[i == 0 && phase > 0 ? phase - 1 : phase] * 1000;
+      if (log.records[k].dt != expected) {
+        cerr << "Interval change: cycle " << k + 1 << " lasted "
+             << log.records[k].dt << " ns, expected " << expected << endl;
+        failures++;
+      }
+    }
+  }
+  // the very first cycle has no stats; each bucket then gets the cycles
+  // ending on its deadlines
+  auto buckets = t.period_stats();
+  const double counts[3] = {(double)n[0], (double)n[1], (double)n[2] - 1};
+  if (buckets.size() != 3)
+    failures++;
+  for (int phase = 0; phase < 3; phase++) {
+    auto it = buckets.find(us[phase] / 1.0E6);
+    if (it == buckets.end() || it->second.n != counts[phase] ||
+        fabs(it->second.mean - us[phase] / 1.0E6) > 1.0E-12 ||
+        it->second.sd > 1.0E-12) {
+      cerr << "Interval change: bucket " << us[phase] << " us "
+           << (it == buckets.end() ? string("missing")
+                                   : "n " + to_string(it->second.n) +
+                                         ", mean " +
+                                         to_string(it->second.mean))
+           << ", expected n " << counts[phase] << endl;
+      failures++;
+    }
+  }
+  if (t.stats()["n"] != n[0] + n[1] + n[2] - 1)
+    failures++;
+  t.stop();
+  cout << "Interval changes on virtual time: "
+       << (failures == 0 ? "ok" : "FAILED") << endl;
+  return failures;
+}
+
+// Rolling windows of the last 100 cycles and of the last 250 ms against a
+// brute-force recomputation at every cycle, and 1 s rollups published to a
+// TelemetryExport, read back through a TelemetryView
+static size_t rolling_stats_check() {
+  const size_t cycles = 5000, count = 100;
+  const int64_t span = 250000000, period = 1000000000;
+  Timer<duration<double>, NoStats, VirtualClock> t(milliseconds(1),
+                                                   milliseconds(10));
+  t.clock().set_jitter(VirtualClock::exponential_jitter(microseconds(20), 9));
+  auto body = VirtualClock::uniform_jitter(microseconds(50),
+                                           microseconds(500), 10);
+  TelemetryExport tel("timer_bench_rollups." + to_string(getpid()),
+                      milliseconds(1));
+  RollingStats by_count(count, nanoseconds(0), nanoseconds(0));
+  RollingStats by_time(cycles, nanoseconds(span), nanoseconds(period), &tel);
+  RecordLog log(cycles);
+  t.attach(log);
+  t.attach(by_count);
+  t.attach(by_time);
+  size_t failures = 0;
+  auto expect = [&failures](const char *what, const WindowStats &w,
+                            size_t first, size_t last,
+                            int64_t CycleRecord::*field,
+                            const vector<CycleRecord> &records) {
+    long double sum = 0, sq = 0;
+    int64_t lo = INT64_MAX, hi = INT64_MIN;
+    for (size_t i = first; i < last; i++) {
+      sum += records[i].*field;
+      lo = min(lo, records[i].*field);
+      hi = max(hi, records[i].*field);
+    }
+    const size_t n = last - first;
+    const long double mean = sum / n;
+    for (size_t i = first; i < last; i++)
+      sq += (records[i].*field - mean) * (records[i].*field - mean);
+    const long double var = n > 1 ? sq / (n - 1) : 0;
+    if (w.n != n || fabsl(w.mean - mean) > 1.0E-9 * fabsl(mean) ||
+        fabsl(w.variance - var) > 1.0E-9 * var + 1.0E-9 || w.min != lo ||
+        w.max != hi) {
+      if (failures++ < 5)
+        cerr << "Rolling window " << what << " at cycle " << last << ": n "
+             << w.n << "/" << n << ", mean " << w.mean << "/"
+             << (double)mean << ", variance " << w.variance << "/"
+             << (double)var << ", min " << w.min << "/" << lo << ", max "
+             << w.max << "/" << hi << endl;
+    }
+  };
+  t.start();
+  for (size_t i = 0; i < cycles; i++) {
+    t.clock().advance(body());
+    t.wait();
+    const auto &r = log.records;
+    const size_t last = r.size();
+    size_t first = last > count ? last - count : 0;
+    expect("dt, last 100", by_count.dt(), first, last, &CycleRecord::dt, r);
+    expect("tet, last 100", by_count.tet(), first, last, &CycleRecord::tet, r);
+    first = last - 1;
+    while (first > 0 && r[first - 1].wake > r[last - 1].wake - span)
+      first--;
+    expect("dt, last 250 ms", by_time.dt(), first, last, &CycleRecord::dt, r);
+    expect("tet, last 250 ms", by_time.tet(), first, last, &CycleRecord::tet,
+           r);
+  }
+  t.stop();
+
+  // every period completed by a later wake-up, aligned on the period
+  const auto &r = log.records;
+  map<int64_t, vector<const CycleRecord *>> periods;
+  for (auto &rec : r)
+    periods[rec.wake - rec.wake % period].push_back(&rec);
+  periods.erase(prev(periods.end())); // still open
+  TelemetryView view(tel.shm_name());
+  vector<Rollup> rollups = view.rollups(64);
+  if (rollups.size() != periods.size()) {
+    cerr << "Rollups: " << rollups.size() << " in the telemetry, expected "
+         << periods.size() << endl;
+    failures++;
+  }
+  for (auto &ru : rollups) {
+    auto it = periods.find(ru.start);
+    if (it == periods.end() || ru.end != ru.start + period ||
+        ru.n != it->second.size()) {
+      cerr << "Rollup [" << ru.start << ", " << ru.end << "): " << ru.n
+           << " cycles, not an aligned period of the run" << endl;
+      failures++;
+      continue;
+    }
+    long double sum = 0;
+    int64_t lo = INT64_MAX, hi = INT64_MIN, tet_max = 0;
+    for (auto *rec : it->second) {
+      sum += rec->dt;
+      lo = min(lo, rec->dt);
+      hi = max(hi, rec->dt);
+      tet_max = max(tet_max, rec->tet);
+    }
+    if (fabsl(ru.dt_mean - sum / ru.n) > 1.0E-6 || ru.dt_min != lo ||
+        ru.dt_max != hi || ru.tet_max != tet_max) {
+      cerr << "Rollup at " << ru.start << ": dt mean " << ru.dt_mean
+           << ", min " << ru.dt_min << ", max " << ru.dt_max
+           << " differ from the cycles" << endl;
+      failures++;
+    }
+  }
+  cout << "Rolling statistics and rollups on virtual time: "
+       << (failures == 0 ? "ok" : "FAILED") << endl;
+  return failures;
+}
+
+// correlate_noise() on synthetic gaps around late wake-ups: a gap inside the
+// [deadline, wake-up] span of a cycle, gaps overlapping its start and its
+// end, gaps just before and just after it, and an on-time cycle with a gap
+static size_t noise_correlation_check() {
+  const int64_t late_ns = 50000;
+  auto record = [](uint64_t seq, int64_t deadline, int64_t lateness) {
+    CycleRecord r;
+    r.seq = seq;
+    r.wake = deadline + lateness;
+    r.lateness = lateness;
+    return r;
+  };
+  // sorted and disjoint, as NoiseDetector stores them
+  const vector<NoiseEvent> events = {
+      {1050000, 30000}, // inside cycle 1: 30 us
+      {1980000, 40000}, // overlaps the deadline of cycle 2: 20 us
+      {2090000, 50000}, // overlaps the wake-up of cycle 2: 10 us
+      {2900000, 50000}, // ends before the deadline of cycle 3
+      {3080000, 20000}, // starts at the wake-up of cycle 3
+      {4002000, 5000},  // inside cycle 4, on time
+  };
+  struct Case {
+    CycleRecord r;
+    size_t late, late_with_noise;
+    int64_t noise_ns;
+  };
+  const vector<Case> cases = {
+      {record(1, 1000000, 200000), 1, 1, 30000},
+      {record(2, 2000000, 100000), 1, 1, 30000},
+      {record(3, 3000000, 80000), 1, 0, 0},
+      {record(4, 4000000, 10000), 0, 0, 0},
+  };
+  size_t failures = 0;
+  auto expect = [&failures](const string &what, const NoiseCorrelation &c,
+                            size_t cycles, size_t late,
+                            size_t late_with_noise, int64_t lateness_ns,
+                            int64_t noise_ns) {
+    if (c.cycles != cycles || c.late != late ||
+        c.late_with_noise != late_with_noise ||
+        c.lateness_ns != lateness_ns || c.noise_ns != noise_ns) {
+      cerr << "Noise correlation, " << what << ": " << c.late << " late of "
+           << c.cycles << ", " << c.late_with_noise << " with noise, "
+           << c.noise_ns << " ns of noise, expected " << late << " late of "
+           << cycles << ", " << late_with_noise << " with noise, " << noise_ns
+           << " ns of noise" << endl;
+      failures++;
+    }
+  };
+  vector<CycleRecord> all;
+  for (auto &k : cases) {
+    expect("cycle " + to_string(k.r.seq),
+           correlate_noise(events, {k.r}, late_ns), 1, k.late,
+           k.late_with_noise, k.late ? k.r.lateness : 0, k.noise_ns);
+    all.push_back(k.r);
+  }
+  expect("all cycles", correlate_noise(events, all, late_ns), 4, 3, 2,
+         380000, 60000);
+  expect("no gaps", correlate_noise({}, all, late_ns), 4, 3, 0, 380000, 0);
+  cout << "Noise correlation on synthetic gaps: "
+       << (failures == 0 ? "ok" : "FAILED") << endl;
+  return failures;
+}
+
+// attribute_jitter() on a synthetic second of 1 kHz cycles sampled every
+// 100 ms: four late cycles, each with its own set of causes (scheduling
+// counters, frequency and throttling from the records, an interrupt burst in
+// the interval of the wake-up), among on-time cycles that must not be listed
+static size_t jitter_attribution_check() {
+  const int64_t t0 = 10000000000, ms = 1000000;
+  vector<CycleRecord> records(1000);
+  for (size_t i = 0; i < records.size(); i++) {
+    CycleRecord &r = records[i];
+    r.seq = i + 1;
+    r.wake = t0 + (int64_t)(i + 1) * ms;
+    r.dt = ms;
+    r.probes = CycleRecord::PROBE_SCHED | CycleRecord::PROBE_SYSTEM;
+    r.freq = 1500000;
+    r.cpu = 1;
+  }
+  // on time, with causes that would be reported if it were late
+  records[99].lateness = -2000;
+  records[99].run_delay = 50000;
+  records[199].run_delay = 50000;
+  records[199].majflt = 1;
+  // late cycles, latest first
+  CycleRecord &delayed = records[149], &faulted = records[249],
+              &slowed = records[349], &interrupted = records[449];
+  delayed.lateness = 100000;
+  delayed.run_delay = 80000; // 0.8
+  delayed.nivcsw = 2;        // 0.5
+  faulted.lateness = 80000;
+  faulted.majflt = 1;        // 0.9
+  faulted.nivcsw = 1;        // 0.25
+  faulted.run_delay = 12000; // 0.15
+  slowed.lateness = 60000;
+  slowed.freq = 600000;                         // 1.0
+  slowed.throttled = SystemSample::THROTTLED;   // 0.8
+  interrupted.lateness = 40000;
+  interrupted.minflt = 4;    // 0.2
+
+  // eth0 interrupts: 10 per interval, 200 in the one ending at 500 ms
+  vector<SystemSample> samples;
+  for (int k = 1; k <= 10; k++) {
+    SystemSample x;
+    x.time = t0 + k * 100 * ms;
+    x.interval = 100 * ms;
+    x.source = SystemSample::IRQ;
+    x.name = "24 eth0";
+    x.value = k == 5 ? 200 : 10;
+    samples.push_back(x);
+  }
+
+  size_t failures = 0;
+  auto expect = [&failures](const string &what,
+                            const vector<JitterAttribution> &report,
+                            const vector<pair<uint64_t, vector<string>>> &ok) {
+    bool same = report.size() == ok.size();
+    for (size_t i = 0; same && i < ok.size(); i++) {
+      same = report[i].record.seq == ok[i].first &&
+             report[i].causes.size() == ok[i].second.size();
+      for (size_t j = 0; same && j < ok[i].second.size(); j++)
+        same = report[i].causes[j].what == ok[i].second[j];
+    }
+    if (!same) {
+      cerr << "Jitter attribution, " << what << ":" << endl;
+      print_jitter_report(report, cerr, 10);
+      failures++;
+    }
+  };
+  expect("scheduling counters, records and samples",
+         attribute_jitter(records, samples),
+         {{150, {"run delay", "preemption"}},
+          {250, {"page faults", "preemption", "run delay"}},
+          {350, {"frequency", "throttling"}},
+          {450, {"irq 24 eth0", "page faults"}}});
+  expect("worst 2", attribute_jitter(records, samples, 2),
+         {{150, {"run delay", "preemption"}},
+          {250, {"page faults", "preemption", "run delay"}}});
+  expect("no samples", attribute_jitter(records, {}),
+         {{150, {"run delay", "preemption"}},
+          {250, {"page faults", "preemption", "run delay"}},
+          {350, {"frequency", "throttling"}},
+          {450, {"page faults"}}});
+  cout << "Jitter attribution on synthetic cycles: "
+       << (failures == 0 ? "ok" : "FAILED") << endl;
+  return failures;
+}
+
+// Relative error, against a long double reference
+static double rel_error(double x, long double exact) {
+  return exact == 0 ? fabs(x) : (double)fabsl((x - exact) / exact);
+}
+
+// Exact sums of integer samples
+struct ExactMoments {
+  __int128 sum = 0, sumsq = 0;
+
+  void add(int64_t x) {
+    sum += x;
+    sumsq += (__int128)x * x;
+  }
+
+  // integer part plus remainder, then the only rounding
+  long double mean(uint64_t n) const {
+    return (long double)(int64_t)(sum / n) + (long double)(int64_t)(sum % n) / n;
+  }
+
+  long double sd(uint64_t n) const {
+    return sqrtl((long double)((__int128)n * sumsq - sum * sum) /
+                 ((long double)n * (n - 1)));
+  }
+};
+
+// Feeds a synthetic trace to the moment collectors, directly in nanoseconds,
+// and compares them with exact integer sums; returns the number of failures
+static size_t moments_validation(double days) {
+  const uint64_t n = (uint64_t)(days * 86400 * 1000); // 1 kHz
+  const int64_t period = 1000000;
+  uint64_t rng = 88172645463325252ULL; // xorshift64
+  auto next = [&]() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+  };
+  WelfordStats welford;
+  WelfordStats128 welford128;
+  ExactMoments exact_dt, exact_tet, exact_latency;
+  double naive_sum = 0, naive_sumsq = 0;
+  double legacy_mean = 0, legacy_sd = 0; // the formula used before
+  auto t0 = steady_clock::now();
+  for (uint64_t i = 1; i <= n; i++) {
+    uint64_t r = next();
+    // latency: sum of 4 uniforms over 0-5 us, plus a rare 0-500 us spike;
+    // the period follows it
+    int64_t latency = 0;
+    for (int k = 0; k < 4; k++)
+      latency += (int64_t)((r >> (16 * k)) & 0xFFFF) * 1250 / 0xFFFF;
+    if ((r & 0x3FFF) == 0)
+      latency += (next() >> 40) % 500000;
+    int64_t dt = period + latency - 2500;
+    int64_t tet = 300000 + (int64_t)(next() >> 52);
+    StatsSample s = {dt * 1.0E-9, tet * 1.0E-9, latency * 1.0E-9, 1.0E-3,
+                     dt,          tet,          latency,          1,
+                     0,           true};
+    welford.add(s);
+    welford128.add(s);
+    exact_dt.add(dt);
+    exact_tet.add(tet);
+    exact_latency.add(latency);
+    naive_sum += dt;
+    naive_sumsq += (double)dt * dt;
+    if (i == 1) {
+      legacy_mean = dt;
+    } else {
+      const double n1 = i - 1, n2 = i - 2, nn1 = i / n1;
+      legacy_mean = (n1 * legacy_mean + dt) / i;
+      legacy_sd = sqrt((n2 * pow(legacy_sd, 2) +
+                        nn1 * pow(legacy_mean - dt, 2)) / n1);
+    }
+  }
+  double secs = duration<double>(steady_clock::now() - t0).count();
+
+  cerr << "Moments over " << days << " days at 1 kHz (" << n << " cycles, "
+       << secs << " s), relative errors of mean and sd of dt, tet, latency:"
+       << endl;
+  // m: mean and sd of dt, tet and latency
+  auto line = [&](const string &name, const double m[6]) {
+    const ExactMoments *exact[3] = {&exact_dt, &exact_tet, &exact_latency};
+    double worst = 0;
+    cerr << "  " << name << ":";
+    for (int q = 0; q < 3; q++) {
+      double e_mean = rel_error(m[2 * q], exact[q]->mean(n));
+      double e_sd = rel_error(m[2 * q + 1], exact[q]->sd(n));
+      cerr << " " << e_mean << " " << e_sd;
+      worst = max({worst, e_mean, e_sd});
+    }
+    cerr << endl;
+    return worst;
+  };
+  const double legacy[6] = {legacy_mean, legacy_sd, NAN, NAN, NAN, NAN};
+  line("legacy recursion", legacy);
+  const double naive[6] = {
+      naive_sum / n, sqrt((naive_sumsq - naive_sum * naive_sum / n) / (n - 1)),
+      NAN, NAN, NAN, NAN};
+  line("naive sums", naive);
+  auto check = [&](const string &name, const auto &collector) {
+    map<string, double> m;
+    collector.stats(m);
+    const double v[6] = {m["mean"], m["sd"],         m["tet"],
+                         m["tet_sd"], m["latency"], m["latency_sd"]};
+    return line(name, v) > 1.0E-12;
+  };
+  return check("WelfordStats", welford) + check("WelfordStats128", welford128);
+}
+
+// Cost of a timestamp; the duration_type column is the counter source
+static void bench_clocks(size_t n) {
+  const CycleClock &cc = CycleClock::global();
+  SystemClock sys;
+  CycleCounterClock policy;
+  report("clock_now", "system_clock", "-",
+         ns_per_call(n, [&](size_t) { do_not_optimize(sys.now()); }));
+  report("clock_ticks", cc.source(), "-",
+         ns_per_call(n, [&](size_t) { do_not_optimize(CycleClock::ticks()); }));
+  report("clock_now", cc.source(), "-",
+         ns_per_call(n, [&](size_t) { do_not_optimize(cc.now()); }));
+  report("clock_now", string(cc.source()) + " policy", "-",
+         ns_per_call(n, [&](size_t) { do_not_optimize(policy.now()); }));
+}
+
+#ifdef TIMER_PROFILE
+#define PROFILER_STATE "on"
+#else
+#define PROFILER_STATE "off"
+#endif
+
+// Cost of a cycle with two sections, and of one section alone
+static void bench_sections(size_t n) {
+  enum { SEC_A, SEC_B, SECTIONS };
+  SectionProfiler<SECTIONS> prof({"a", "b"});
+  TimerProbe<duration<double>, NoStats> t(milliseconds(1), milliseconds(2));
+  prof.attach_to(t);
+  t.start();
+  report("wait_sections", "duration<double>", PROFILER_STATE,
+         ns_per_call(n, [&](size_t) {
+           {
+             TIMER_SECTION(prof, SEC_A);
+             clobber_memory();
+           }
+           {
+             TIMER_SECTION(prof, SEC_B);
+             clobber_memory();
+           }
+           do_not_optimize(t.wait());
+         }));
+  t.stop();
+  report("section_scope", "-", PROFILER_STATE, ns_per_call(n, [&](size_t) {
+           TIMER_SECTION(prof, SEC_A);
+           clobber_memory();
+         }));
+}
+
+// Cost of a cycle marker and of a pair of section markers per cycle; the
+// duration_type column is the marker file
+static void bench_trace_marker(size_t n, const string &path) {
+  TimerProbe<duration<double>, NoStats> t(milliseconds(1), milliseconds(2));
+  try {
+    TraceMarker marker("timer_bench", path, 1.0E9);
+    t.attach(marker);
+    t.start();
+    double ns = ns_per_call(n, [&](size_t) {
+      TraceMarker::Scope s(marker, "body");
+      do_not_optimize(t.wait());
+    });
+    t.stop();
+    report("trace_marker", marker.path(), "-", ns);
+    report("trace_marker_write", marker.path(), "-", marker.stats().write_ns);
+  } catch (const TimerError &e) {
+    cerr << e.what() << endl; // no tracefs
+  }
+}
+
+// Cost of a USDT probe with no tracer attached (the stats column tells if
+// probes are compiled), against the same loop without the probe
+static void bench_usdt(size_t n) {
+  report("empty_loop", "-", "-",
+         ns_per_call(n, [&](size_t i) { do_not_optimize(i); }));
+  report("usdt_probe", "-", TIMER_USDT_ENABLED ? "on" : "off",
+         ns_per_call(n, [&](size_t i) {
+           do_not_optimize(i);
+           TIMER_USDT(timer_bench, probe, i, i >> 1);
+         }));
+}
+
+// Cost of a scheduling probe sample, syscalls included
+static void bench_sched_probe(size_t n) {
+  SchedProbe probe;
+  CycleRecord record;
+  report("sched_probe", "-", "-", ns_per_call(n, [&](size_t) {
+           probe.on_wake(record);
+           clobber_memory();
+         }));
+}
+
+// Cost of the two group reads of a perf probe per cycle; the duration_type
+// column tells how they are read
+static void bench_perf_probe(size_t n) {
+  PerfProbe probe;
+  CycleRecord record;
+  probe.bind();
+  report("perf_probe", probe.rdpmc() ? "rdpmc" : "read", "-",
+         ns_per_call(n, [&](size_t) {
+           probe.on_wake(record);
+           probe.on_sleep(record);
+           clobber_memory();
+         }));
+}
+
+// One writer publishes snapshots whose fields all derive from a counter,
+// readers check that every snapshot they get is consistent. Runs for at least
+// one second, so that readers get scheduled even on a single core.
+static size_t seqlock_stress(size_t n, size_t readers) {
+  // every field of the snapshot is n + its index
+  static_assert(sizeof(TimerStats) % sizeof(double) == 0,
+                "TimerStats holds doubles only");
+  auto pattern = [](double x) {
+    double fields[sizeof(TimerStats) / sizeof(double)];
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+      fields[i] = x + i;
+    TimerStats s;
+    memcpy(&s, fields, sizeof(s));
+    return s;
+  };
+  Seqlock<TimerStats> lock(pattern(0));
+  atomic<bool> done{false};
+  atomic<size_t> torn{0}, reads{0};
+  vector<thread> threads;
+  for (size_t r = 0; r < readers; r++) {
+    threads.emplace_back([&]() {
+      size_t local_reads = 0, local_torn = 0;
+      while (!done.load(memory_order_relaxed)) {
+        TimerStats s = lock.load(), expected = pattern(s.n);
+        if (memcmp(&s, &expected, sizeof(s)) != 0)
+          local_torn++;
+        local_reads++;
+      }
+      torn += local_torn;
+      reads += local_reads;
+    });
+  }
+  size_t stores = 0;
+  auto t0 = steady_clock::now(), stop = t0 + seconds(1);
+  while (stores < n || steady_clock::now() < stop) {
+    lock.store(pattern((double)stores++));
+  }
+  double ns =
+      duration_cast<duration<double, nano>>(steady_clock::now() - t0).count() /
+      stores;
+  done = true;
+  for (auto &t : threads)
+    t.join();
+  report("seqlock_store", to_string(readers) + " readers", "-", ns);
+  cerr << "Seqlock stress: " << reads.load() << " reads, " << torn.load()
+       << " torn" << endl;
+  return torn.load();
+}
+
+// Noise detector on the last CPU, 1 kHz Timer on the first one
+static int noise_mode(double secs, double threshold_us, double late_us) {
+  int cpus = thread::hardware_concurrency();
+  int timer_cpu = 0, detector_cpu = max(0, cpus - 1);
+  if (cpus < 2) {
+    // a SCHED_FIFO spinner would starve the Timer
+    cerr << "Only one CPU: the detector shares it with the Timer and runs "
+            "as SCHED_OTHER; its gaps include the Timer cycles"
+         << endl;
+  }
+  cout << "# conditions " << LatencyGuard::hold_for_process(timer_cpu).report()
+       << endl;
+  NoiseDetector det(duration<double, micro>(threshold_us), detector_cpu,
+                    cpus < 2 ? 0 : 99);
+  size_t cycles = secs * 1000;
+  RecordLog log(cycles);
+  Timer<duration<double>, FullStats> t(milliseconds(1), milliseconds(2));
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(timer_cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+  try {
+    t.enable_rt_scheduler();
+  } catch (const TimerError &e) {
+    cerr << e.what() << endl;
+  }
+  det.start();
+  t.attach(log);
+  t.start();
+  for (size_t i = 0; i < cycles; i++)
+    t.wait();
+  auto stats = t.stats();
+  t.stop();
+  det.stop();
+
+  NoiseSummary s = det.summary();
+  cout << "Noise detector on CPU " << detector_cpu
+       << (det.realtime() ? " (SCHED_FIFO 99" : " (SCHED_OTHER")
+       << (det.pinned() ? ")" : ", not pinned)") << ", "
+       << CycleClock::global().source() << " clock, threshold "
+       << threshold_us << " us" << endl;
+  cout << "  spinning " << s.spin_ns / 1.0E9 << " s, " << s.loops
+       << " reads, " << s.events << " gaps (" << s.lost << " not stored), "
+       << "noise " << 1.0E6 * s.noise_ns / max<int64_t>(1, s.spin_ns)
+       << " ppm, max gap " << s.max_gap / 1000.0 << " us" << endl;
+  vector<uint64_t> hist = det.histogram();
+  for (size_t b = 0; b < hist.size(); b++) {
+    if (hist[b] > 0)
+      cout << "  " << setw(10) << (1ULL << b) / 1000.0 << " us " << setw(10)
+           << hist[b] << endl;
+  }
+  cout << "Timer on CPU " << timer_cpu << ": " << stats["n"]
+       << " cycles, wake latency mean " << stats["latency"] * 1.0E6
+       << " us, max " << stats["latency_max"] * 1.0E6 << " us" << endl;
+  correlate_noise(det.events(), log.records, late_us * 1000, &cout);
+  return 0;
+}
+
+// 1 kHz Timer on the first CPU, traced along with the system state
+static int trace_mode(double secs, const string &prefix) {
+  const int timer_cpu = 0;
+  LatencyGuard &guard = LatencyGuard::hold_for_process(timer_cpu);
+  cout << "# conditions " << guard.report() << endl;
+  SchedProbe probe;
+  TraceWriter trace;
+  trace.set_conditions(guard.report());
+  SystemSampler sampler(timer_cpu);
+  Timer<duration<double>, FullStats> t(milliseconds(1), milliseconds(2));
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(timer_cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+  try {
+    t.enable_rt_scheduler();
+  } catch (const TimerError &e) {
+    cerr << e.what() << endl;
+  }
+  trace.start_writer(prefix + ".bin");
+  sampler.start(prefix + ".csv");
+  t.attach_probe(probe);
+  t.attach_probe(sampler);
+  t.attach(trace);
+  t.start();
+  for (size_t i = 0; i < secs * 1000; i++)
+    t.wait();
+  auto stats = t.stats();
+  t.stop();
+  sampler.stop();
+  trace.stop_writer();
+  cout << "Timer on CPU " << timer_cpu << ": " << stats["n"]
+       << " cycles, wake latency mean " << stats["latency"] * 1.0E6
+       << " us, max " << stats["latency_max"] * 1.0E6 << " us" << endl;
+  cout << "  " << prefix << ".bin: " << trace.written() << " cycles ("
+       << trace.dropped() << " dropped), " << prefix
+       << ".csv: " << sampler.rounds() << " system samples" << endl;
+  cout << "Run: timer-attrib -s " << prefix << ".csv " << prefix << ".bin"
+       << endl;
+  return 0;
+}
+
+// Mock device read, computed and written each cycle of a 1 kHz Timer on the
+// first CPU, with each stage costing cost_us: serially on the timer thread,
+// then as a pipeline with the compute and output stages on the next CPUs
+static int pipeline_mode(double secs, double cost_us) {
+  using Device = MockDevice<4>;
+  const int timer_cpu = 0;
+  const int cpus = thread::hardware_concurrency();
+  const auto cost = duration_cast<nanoseconds>(
+      duration<double, micro>(cost_us));
+  const size_t cycles = secs * 1000;
+  cout << "# conditions " << LatencyGuard::hold_for_process(timer_cpu).report()
+       << endl;
+  if (cpus < 3) {
+    cerr << "Only " << cpus << " CPUs: the stages share them, the pipeline "
+         << "cannot run faster than the serial loop" << endl;
+  }
+  auto law = [cost](const Device::Input &in, Device::Output &out) {
+    for (size_t i = 0; i < in.size(); i++)
+      out[i] = 2 * in[i] + 1;
+    spin_for(cost);
+  };
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(timer_cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+
+  cout << "mode,stage,n,min_us,mean_us,max_us" << endl;
+  for (bool threaded : {false, true}) {
+    const char *mode = threaded ? "pipelined" : "serial";
+    Device dev(cost, cost, cycles);
+    PipelineConfig cfg;
+    cfg.threaded = threaded;
+    cfg.compute_cpu = cpus >= 3 ? 1 : -1;
+    cfg.output_cpu = cpus >= 3 ? 2 : -1;
+    cfg.priority = cpus >= 3 ? 1 : 0;
+    cfg.idle = cpus >= 3 ? nanoseconds(0) : microseconds(10);
+    cfg.output_delay = 3;
+    Pipeline<Device, decltype(law)> p(dev, law, milliseconds(1), cfg);
+    Timer<duration<double>, FullStats> t(milliseconds(1), milliseconds(2));
+    try {
+      t.enable_rt_scheduler();
+    } catch (const TimerError &e) {
+      cerr << e.what() << endl;
+    }
+    p.start();
+    t.attach(p);
+    t.start();
+    for (size_t i = 0; i < cycles; i++)
+      t.wait();
+    auto stats = t.stats();
+    t.stop();
+    p.stop();
+
+    for (size_t s = 0; s < PIPELINE_STAGES; s++) {
+      StageStats st = p.stats((PipelineStage)s);
+      if (st.n == 0)
+        continue;
+      cout << mode << "," << PIPELINE_STAGE_NAMES[s] << "," << st.n << ","
+           << st.min / 1000.0 << "," << st.mean / 1000.0 << ","
+           << st.max / 1000.0 << endl;
+    }
+    // output jitter: spread of the intervals between consecutive writes
+    double jitter = 0;
+    const auto &w = dev.writes();
+    for (size_t i = 1; i < w.size(); i++) {
+      if (w[i].seq == w[i - 1].seq + 1)
+        jitter = max(jitter, fabs(w[i].time - w[i - 1].time - 1.0E6));
+    }
+    cerr << mode << ": " << p.frames() << " of " << cycles
+         << " frames written (" << p.overruns() << " overruns, " << p.late()
+         << " late, " << dev.gaps() << " gaps), " << stats["n"] / secs
+         << " cycles/s, wake latency max " << stats["latency_max"] * 1.0E6
+         << " us, write interval jitter max " << jitter / 1000.0 << " us";
+    if (threaded)
+      cerr << ", nominal latency "
+           << duration<double, micro>(p.latency()).count() << " us";
+    if (p.setup_failures())
+      cerr << ", " << p.setup_failures()
+           << " stage threads not pinned or without their priority";
+    cerr << endl;
+  }
+  return 0;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc > 1 && string(argv[1]) == "noise") {
+    return noise_mode(argc > 2 ? atof(argv[2]) : 10,
+                      argc > 3 ? atof(argv[3]) : 10,
+                      argc > 4 ? atof(argv[4]) : 50);
+  }
+  if (argc > 1 && string(argv[1]) == "trace") {
+    return trace_mode(argc > 2 ? atof(argv[2]) : 60,
+                      argc > 3 ? argv[3] : "timer-trace");
+  }
+  if (argc > 1 && string(argv[1]) == "pipeline") {
+    return pipeline_mode(argc > 2 ? atof(argv[2]) : 10,
+                         argc > 3 ? atof(argv[3]) : 400);
+  }
+  size_t n = 10000000;
+  double days = 1;
+  if (argc > 1)
+    n = atol(argv[1]);
+  if (argc > 2)
+    days = atof(argv[2]);
+
+  cout << "# conditions " << LatencyGuard::hold_for_process().report() << endl;
+  cout << "function,duration_type,stats,ns_per_call" << endl;
+  bench_both<duration<double>>("duration<double>", n);
+  bench_both<milliseconds>("milliseconds", n);
+  bench_both<microseconds>("microseconds", n);
+  bench_both<nanoseconds>("nanoseconds", n);
+  bench_collectors<NoStats>("none", n);
+  bench_collectors<Collectors<CounterStats>>("counters", n);
+  bench_collectors<Collectors<MinMaxStats>>("minmax", n);
+  bench_collectors<Collectors<WelfordStats>>("welford", n);
+  bench_collectors<Collectors<WelfordStats128>>("welford128", n);
+  bench_collectors<Collectors<HistogramStats<>>>("histogram", n);
+  bench_collectors<Collectors<QuantileStats<P2Quantiles>>>("p2", n);
+  bench_collectors<Collectors<QuantileStats<TDigestQuantiles>>>("tdigest", n);
+  bench_collectors<Collectors<TraceStats<>>>("trace", n);
+  bench_collectors<FullStats>("full", n);
+  bench_collectors<
+      Collectors<CounterStats, MinMaxStats, WelfordStats, HistogramStats<>,
+                 QuantileStats<P2Quantiles>, TraceStats<>>>("all", n);
+  bench_clocks(n);
+  bench_sections(n);
+  bench_usdt(n * 10);
+  string marker_file = "/tmp/timer_bench_trace_marker." + to_string(getpid());
+  bench_trace_marker(n / 100, marker_file);
+  unlink(marker_file.c_str());
+  bench_trace_marker(n / 100, "");
+  bench_sched_probe(n / 100);
+  bench_perf_probe(n / 100);
+
+  size_t readers = max(1u, thread::hardware_concurrency() - 1);
+  size_t torn = seqlock_stress(n, readers);
+  size_t inaccurate = moments_validation(days);
+  inaccurate += quantile_accuracy_all(1000000);
+  inaccurate += system_sampler_check();
+  inaccurate += latency_guard_check();
+  inaccurate += pipeline_check();
+  inaccurate += period_change_check();
+  inaccurate += rolling_stats_check();
+  inaccurate += noise_correlation_check();
+  inaccurate += jitter_attribution_check();
+  return torn == 0 && inaccurate == 0 ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+/*
+Timer control plane example
+
+Compile with: clang++ -std=c++17 -o timer_control timer_control.cpp -lrt -lpthread
+Run as:       sudo ./timer_control 0.01 /tmp/timer.sock
+Then:         socat - UNIX-CONNECT:/tmp/timer.sock
+*/
+#define TIMER_CONTROL_MAIN
+#include "timer_control.hpp"
@@ -0,0 +1,236 @@
+/*
+Local control plane for a running Timer
+
+TimerControl serves a UNIX stream socket from a non-RT thread. Each line
+received is a command; each reply is one or more lines, the last one
+starting with OK or ERR:
+
+  period <seconds>            set the interval
+  max_wait <seconds>          set the maximum wait
+  reset                       reset the statistics
+  policy catch_up|skip|resync set the overrun policy
+  stats                       print the statistics
+  histogram                   print the dt histogram (needs TelemetryExport)
+  help
+
+Changes go through the Timer mailbox (Timer::post()) and are applied by
+wait() at the next cycle boundary, keeping the deadline already scheduled.
+Try it with: socat - UNIX-CONNECT:/tmp/timer.sock
+*/
+#ifndef TIMER_CONTROL_HPP
+#define TIMER_CONTROL_HPP
+
+#include "telemetry.hpp"
+#include "timer.hpp"
+#include <atomic>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+
+template <typename TimerType> class TimerControl {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  TimerControl(TimerType &timer, const string &path,
+               const TelemetryExport *telemetry = nullptr)
+      : _timer(timer), _path(path), _telemetry(telemetry) {}
+
+  ~TimerControl() { stop(); }
+
+  TimerControl(const TimerControl &) = delete;
+  TimerControl &operator=(const TimerControl &) = delete;
+
+  // METHODS -------------------------------------------------------------------
+
+  void start() {
+    struct sockaddr_un addr;
+    if (_path.size() >= sizeof(addr.sun_path)) {
+      throw TimerError("TimerControl: socket path too long");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, _path.c_str(), sizeof(addr.sun_path) - 1);
+    _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_fd < 0) {
+      throw TimerError(string("TimerControl: socket: ") + strerror(errno));
+    }
+    unlink(_path.c_str());
+    if (::bind(_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(_fd, 4) != 0) {
+      string err = strerror(errno);
+      close(_fd);
+      _fd = -1;
+      throw TimerError("TimerControl: cannot listen on " + _path + ": " + err);
+    }
+    _running = true;
+    _thread = thread([this]() { serve(); });
+  }
+
+  void stop() {
+    _running = false;
+    if (_thread.joinable()) {
+      _thread.join();
+    }
+    if (_fd >= 0) {
+      close(_fd);
+      unlink(_path.c_str());
+      _fd = -1;
+    }
+  }
+
+  // Runs a single command line and returns the reply
+  string execute(const string &line) {
+    istringstream in(line);
+    string cmd;
+    in >> cmd;
+    double value;
+    if (cmd == "period" || cmd == "max_wait") {
+      if (!(in >> value) || value <= 0) {
+        return "ERR expected a positive number of seconds\n";
+      }
+      auto ns = duration_cast<nanoseconds>(duration<double>(value));
+      if (cmd == "period" && !TimerType::valid_interval(ns)) {
+        return "ERR period below the timer resolution\n";
+      }
+      return post({cmd == "period" ? TimerCommand::SET_INTERVAL
+                                   : TimerCommand::SET_MAX_WAIT,
+                   ns.count()});
+    } else if (cmd == "reset") {
+      return post({TimerCommand::RESET_STATS});
+    } else if (cmd == "policy") {
+      string name;
+      in >> name;
+      static const char *names[3] = {"catch_up", "skip", "resync"};
+      for (int i = 0; i < 3; i++) {
+        if (name == names[i])
+          return post({TimerCommand::SET_OVERRUN_POLICY, i});
+      }
+      return "ERR unknown policy\n";
+    } else if (cmd == "stats") {
+      stringstream ss;
+      try {
+        for (auto &[k, v] : _timer.stats())
+          ss << k << " " << v << "\n";
+      } catch (const TimerError &e) {
+        return string("ERR ") + e.what() + "\n";
+      }
+      return ss.str() + "OK\n";
+    } else if (cmd == "histogram") {
+      if (!_telemetry) {
+        return "ERR no telemetry attached\n";
+      }
+      const TelemetryHeader &h = _telemetry->header();
+      auto bins = _telemetry->histogram();
+      stringstream ss;
+      for (size_t i = 0; i < bins.size(); i++)
+        ss << h.hist_min + (int64_t)i * h.hist_width << " " << bins[i]
+           << "\n";
+      return ss.str() + "OK\n";
+    } else if (cmd == "help" || cmd.empty()) {
+      return "period <s>\nmax_wait <s>\nreset\npolicy catch_up|skip|resync\n"
+             "stats\nhistogram\nOK\n";
+    }
+    return "ERR unknown command " + cmd + "\n";
+  }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  TimerType &_timer;
+  string _path;
+  const TelemetryExport *_telemetry;
+  int _fd = -1;
+  atomic<bool> _running{false};
+  thread _thread;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  string post(const TimerCommand &command) {
+    return _timer.post(command) ? "OK\n" : "ERR mailbox full\n";
+  }
+
+  // Waits for input on fd, checking for stop() every 100 ms
+  bool wait_readable(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (_running.load()) {
+      int r = poll(&pfd, 1, 100);
+      if (r > 0)
+        return true;
+      if (r < 0 && errno != EINTR)
+        return false;
+    }
+    return false;
+  }
+
+  void serve() {
+    while (wait_readable(_fd)) {
+      int client = accept4(_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (client < 0)
+        continue;
+      string buffer;
+      char chunk[256];
+      while (wait_readable(client)) {
+        ssize_t n = read(client, chunk, sizeof(chunk));
+        if (n <= 0)
+          break;
+        buffer.append(chunk, n);
+        size_t eol;
+        while ((eol = buffer.find('\n')) != string::npos) {
+          string reply = execute(buffer.substr(0, eol));
+          buffer.erase(0, eol + 1);
+          if (send(client, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+            break;
+        }
+      }
+      close(client);
+    }
+  }
+};
+
+#endif // TIMER_CONTROL_HPP
+
+/*
+  Example: a timed loop that can be controlled through the socket
+*/
+
+#ifdef TIMER_CONTROL_MAIN
+
+#include "rolling_stats.hpp"
+#include <iostream>
+
+bool Running = true;
+
+int main(int argc, const char *argv[]) {
+  double delay = 0.01;
+  string path = "/tmp/timer.sock";
+  if (argc > 1)
+    delay = atof(argv[1]);
+  if (argc > 2)
+    path = argv[2];
+
+  signal(SIGINT, [](int /*signo*/) { Running = false; });
+
+  duration<double> d(delay);
+  Timer<duration<double>, FullStats> t(d, d * 2);
+  TelemetryExport telemetry("timer_control", d);
+  TimerControl<decltype(t)> control(t, path, &telemetry);
+  t.attach(telemetry);
+  RollingStats roll(1000, seconds(0), seconds(1), &telemetry);
+  t.attach(roll);
+
+  try {
+    t.enable_rt_scheduler();
+  } catch (const TimerError &e) {
+    cerr << "Error enabling real-time scheduler: " << e.what() << endl;
+  }
+
+  control.start();
+  cerr << t.what() << "Control socket: " << path << endl;
+  t.start();
+  while (Running) {
+    t.wait();
+  }
+  control.stop();
+  t.stop();
+  return 0;
+}
+
+#endif
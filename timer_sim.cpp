@@ -0,0 +1,149 @@
+/*
+Timer simulation on virtual time
+
+Runs a timed loop on a VirtualClock: the loop body and the wake-up lateness
+are simulated, so a day of 1 kHz cycles takes seconds and every run with the
+same arguments gives the same statistics.
+
+Compile with: clang++ -std=c++17 -O2 -DENABLE_RT_SCHEDULER -o timer_sim timer_sim.cpp
+Run as:       ./timer_sim [cycles] [interval] [body] [jitter sd] [dump.bin] [log.csv]
+              (times in seconds, "-" to skip an output file)
+
+With a dump file, a FlightRecorder is attached to the timer and the window
+around the injected overrun is written to that file. With a log file, an
+AnomalyLogger writes every 10000th cycle and the cycles beyond the 99.9th
+percentile of dt, with 5 cycles of context.
+
+With -DTIMER_FAULT_INJECTION it also runs a fault campaign under each overrun
+policy and prints how the timer reacted, then checks that body overruns are
+measured as TET and not as wake latency (the exit code is 1 if not).
+*/
+#include "anomaly_logger.hpp"
+#include "fault_injection.hpp"
+#include "flight_recorder.hpp"
+#include "virtual_clock.hpp"
+#include <iostream>
+
+#ifdef TIMER_FAULT_INJECTION
+using FaultyTimer = Timer<duration<double>, FullStats, FaultyClock<VirtualClock>>;
+
+static void run_fault_campaigns(size_t cycles, duration<double> d,
+                                duration<double> max_d, nanoseconds body) {
+  auto iv = duration_cast<nanoseconds>(d);
+  for (int policy = FaultyTimer::OVERRUN_CATCH_UP;
+       policy <= FaultyTimer::OVERRUN_RESYNC; policy++) {
+    for (bool use_throw : {false, true}) {
+      FaultyTimer t(d, max_d);
+      auto &clock = t.clock();
+      clock.inject_at(cycles / 4, FAULT_BODY_OVERRUN, iv * 3);
+      clock.inject_at(cycles / 2, FAULT_CLOCK_STEP, iv * 10);
+      clock.inject_at(cycles * 3 / 4, FAULT_CLOCK_STEP, -iv * 10);
+      clock.inject_randomly(1.0E-4, FAULT_SPURIOUS_SIGNAL);
+      clock.inject_randomly(1.0E-4, FAULT_SIGNAL_LATE);
+      clock.inject_randomly(1.0E-4, FAULT_BODY_OVERRUN, iv / 2);
+      fault_campaign(t, cycles, (FaultyTimer::OverrunPolicy)policy, use_throw,
+                     [&]() { clock.advance(body); })
+          .print(cout);
+    }
+  }
+}
+
+// Body overruns that still fit in the period are loop body time: they must
+// raise tet_max by their length and leave the wake latency untouched
+static size_t body_overrun_check(size_t cycles, duration<double> d,
+                                 duration<double> max_d, nanoseconds body) {
+  auto overrun = (duration_cast<nanoseconds>(d) - body) / 2;
+  map<string, double> stats[2];
+  for (int faulty = 0; faulty < 2; faulty++) {
+    FaultyTimer t(d, max_d);
+    auto &clock = t.clock();
+    if (faulty)
+      clock.inject_randomly(1.0E-2, FAULT_BODY_OVERRUN, overrun);
+    stats[faulty] = fault_campaign(t, cycles, FaultyTimer::OVERRUN_CATCH_UP,
+                                   false, [&]() { clock.advance(body); })
+                        .stats;
+  }
+  double raised = stats[1]["tet_max"] - stats[0]["tet_max"];
+  bool ok = fabs(raised - duration<double>(overrun).count()) < 1.0E-9 &&
+            stats[1]["latency_max"] == stats[0]["latency_max"];
+  cout << "Body overruns of " << duration<double>(overrun).count()
+       << " s: tet_max +" << raised << " s, latency_max "
+       << stats[0]["latency_max"] << " -> " << stats[1]["latency_max"]
+       << " s: " << (ok ? "ok" : "FAILED") << endl;
+  return ok ? 0 : 1;
+}
+#endif
+
+int main(int argc, const char *argv[]) {
+  size_t cycles = 86400000; // 24 h at 1 kHz
+  double interval = 0.001, body = 0.0002, jitter = 0.000003;
+  if (argc > 1)
+    cycles = atol(argv[1]);
+  if (argc > 2)
+    interval = atof(argv[2]);
+  if (argc > 3)
+    body = atof(argv[3]);
+  if (argc > 4)
+    jitter = atof(argv[4]);
+  const char *dump = argc > 5 && strcmp(argv[5], "-") ? argv[5] : nullptr;
+  const char *log = argc > 6 && strcmp(argv[6], "-") ? argv[6] : nullptr;
+
+  duration<double> d(interval), max_d(interval * 1.1);
+  Timer<duration<double>, FullStats, VirtualClock> t(d, max_d);
+  auto body_ns = duration_cast<nanoseconds>(duration<double>(body));
+  auto jitter_ns = duration_cast<nanoseconds>(duration<double>(jitter));
+  t.clock().set_jitter(VirtualClock::normal_jitter(jitter_ns, jitter_ns));
+  // One overrun of the maximum wait halfway through the run
+  size_t overrun_at = cycles / 2;
+  FlightRecorder recorder(1024, 128, false, false);
+  if (dump)
+    t.attach(recorder);
+  AnomalyLogger logger(10000, 5);
+  ofstream log_file;
+  if (log) {
+    logger.set_dt_quantile(0.999);
+    log_file.open(log);
+    log_file << AnomalyLogger::header() << endl;
+    t.attach(logger);
+  }
+
+  map<int, size_t> results;
+  auto t0 = steady_clock::now();
+  t.start();
+  for (size_t i = 0; i < cycles; i++) {
+    t.clock().advance(body_ns);
+    if (i == overrun_at)
+      t.clock().advance(duration_cast<nanoseconds>(max_d));
+    results[t.wait()]++;
+    if (log && i % 1000 == 0)
+      logger.drain(log_file); // not RT: no need for a writer thread
+  }
+  auto wall = duration_cast<duration<double>>(steady_clock::now() - t0);
+
+  cout << "Simulated " << cycles << " cycles in " << wall.count() << " s"
+       << endl;
+  for (auto &[k, v] : t.stats())
+    cout << k << ": " << v << endl;
+  cout << "TIMER_OK: " << results[0] << endl
+       << "TIMER_ERR_SIGNAL_LATE: " << results[-1] << endl
+       << "TIMER_ERR_MAX_WAIT_EXCEEDED: " << results[-2] << endl
+       << "TIMER_ERR_INTERRUPTED: " << results[-3] << endl;
+  if (log) {
+    logger.drain(log_file);
+    cout << "Anomaly log: " << logger.anomalies() << " anomalies, "
+         << logger.dropped() << " entries dropped, written to " << log << endl;
+  }
+  if (dump && recorder.dump(dump)) {
+    FlightRecorderHeader header;
+    auto records = FlightRecorder::load(dump, &header);
+    cout << "Flight recorder: " << records.size() << " cycles around cycle "
+         << header.trigger_seq << " written to " << dump << endl;
+  }
+  t.stop();
+
+#ifdef TIMER_FAULT_INJECTION
+  run_fault_campaigns(min<size_t>(cycles, 1000000), d, max_d, body_ns);
+  return body_overrun_check(min<size_t>(cycles, 100000), d, max_d, body_ns);
+#endif
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+timer-top: live view of all the Timers exporting telemetry on this machine
+
+Lists the shared-memory segments created by TelemetryExport and shows their
+summary, optionally with the dt histogram, the most recent cycles and the
+most recent rollups. Reading never disturbs the RT side: the segments are
+mapped read-only.
+
+Compile with: clang++ -std=c++17 -O2 -o timer-top timer_top.cpp -lrt
+Run as:       ./timer-top [-1] [-d seconds] [-H] [-r records] [-R rollups]
+*/
+#include "telemetry.hpp"
+#include <algorithm>
+#include <dirent.h>
+#include <iomanip>
+#include <iostream>
+#include <signal.h>
+#include <thread>
+#include <vector>
+
+static vector<string> list_segments() {
+  vector<string> names;
+  DIR *dir = opendir("/dev/shm");
+  if (!dir)
+    return names;
+  while (struct dirent *e = readdir(dir)) {
+    if (strncmp(e->d_name, TELEMETRY_PREFIX, strlen(TELEMETRY_PREFIX)) == 0)
+      names.push_back(string("/") + e->d_name);
+  }
+  closedir(dir);
+  sort(names.begin(), names.end());
+  return names;
+}
+
+static void show_histogram(const TelemetryView &view) {
+  const TelemetryHeader *h = view.header();
+  uint64_t top = 1;
+  for (size_t i = 0; i < h->hist_bins; i++)
+    top = max(top, view.bin(i));
+  for (size_t i = 0; i < h->hist_bins; i++) {
+    uint64_t c = view.bin(i);
+    if (c == 0)
+      continue;
+    cout << "    " << setw(10) << (h->hist_min + i * h->hist_width) / 1000.0
+         << " us " << setw(12) << c << " " << string(40 * c / top, '#')
+         << endl;
+  }
+}
+
+static void show_recent(const TelemetryView &view, size_t n) {
+  cout << "    " << setw(12) << "seq" << setw(12) << "dt_us" << setw(12)
+       << "tet_us" << setw(12) << "late_us" << setw(6) << "ret" << endl;
+  for (auto &r : view.recent(n))
+    cout << "    " << setw(12) << r.seq << setw(12) << r.dt / 1000.0
+         << setw(12) << r.tet / 1000.0 << setw(12) << r.lateness / 1000.0
+         << setw(6) << r.ret << endl;
+}
+
+static void show_rollups(const TelemetryView &view, size_t n) {
+  cout << "    " << setw(12) << "start_s" << setw(10) << "cycles" << setw(8)
+       << "errors" << setw(12) << "dt_us" << setw(10) << "sd_us" << setw(12)
+       << "max_us" << setw(12) << "tet_us" << setw(12) << "late_us" << endl;
+  for (auto &r : view.rollups(n))
+    cout << "    " << setw(12) << r.start / 1.0E9 << setw(10) << r.n
+         << setw(8) << r.errors << setw(12) << r.dt_mean / 1000 << setw(10)
+         << r.dt_sd / 1000 << setw(12) << r.dt_max / 1000.0 << setw(12)
+         << r.tet_mean / 1000 << setw(12) << r.lateness_max / 1000.0 << endl;
+}
+
+static void show(bool histogram, size_t recent, size_t rollups) {
+  cout << left << setw(8) << "PID" << setw(20) << "NAME" << right << setw(12)
+       << "CYCLES" << setw(10) << "ERRORS" << setw(12) << "DT_US"
+       << setw(10) << "SD_US" << setw(12) << "MIN_US" << setw(12) << "MAX_US"
+       << setw(12) << "TET_US" << setw(12) << "LATE_US" << endl;
+  cout << fixed << setprecision(1);
+  for (auto &name : list_segments()) {
+    try {
+      TelemetryView view(name);
+      const TelemetryHeader *h = view.header();
+      TelemetrySummary s = view.summary();
+      bool alive = kill(h->pid, 0) == 0 || errno == EPERM;
+      double sd = s.n > 1 ? sqrt(s.m2_dt / (s.n - 1)) : 0;
+      cout << left << setw(8) << h->pid << setw(20)
+           << (string(h->name) + (alive ? "" : " (dead)")) << right
+           << setw(12) << s.n << setw(10) << s.errors << setw(12)
+           << s.mean_dt / 1000 << setw(10) << sd / 1000 << setw(12)
+           << (s.n ? s.min_dt / 1000.0 : 0) << setw(12) << s.max_dt / 1000.0
+           << setw(12) << s.mean_tet / 1000 << setw(12)
+           << s.max_lateness / 1000.0 << endl;
+      if (histogram)
+        show_histogram(view);
+      if (recent)
+        show_recent(view, recent);
+      if (rollups)
+        show_rollups(view, rollups);
+    } catch (const TimerError &e) {
+      cerr << e.what() << endl;
+    }
+  }
+}
+
+int main(int argc, const char *argv[]) {
+  bool once = false, histogram = false;
+  double delay = 1.0;
+  size_t recent = 0, rollups = 0;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-1")
+      once = true;
+    else if (arg == "-H")
+      histogram = true;
+    else if (arg == "-d" && i + 1 < argc)
+      delay = atof(argv[++i]);
+    else if (arg == "-r" && i + 1 < argc)
+      recent = atol(argv[++i]);
+    else if (arg == "-R" && i + 1 < argc)
+      rollups = atol(argv[++i]);
+    else {
+      cerr << "Usage: " << argv[0] << " [-1] [-d seconds] [-H] [-r records]"
+           << " [-R rollups]"
+           << endl;
+      return 1;
+    }
+  }
+  while (true) {
+    if (!once)
+      cout << "\033[H\033[2J"; // clear screen
+    show(histogram, recent, rollups);
+    if (once)
+      break;
+    this_thread::sleep_for(duration<double>(delay));
+  }
+  return 0;
+}
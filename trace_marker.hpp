@@ -0,0 +1,246 @@
+/*
+ftrace trace_marker output for Timer
+
+TraceMarker is a Timer observer writing compact markers to the kernel
+trace_marker file, so that Timer cycles can be lined up with the kernel
+events recorded by ftrace or trace-cmd:
+
+  timer C seq=1234 dt=1000210 tet=201344 late=8120      cycle (wake-up)
+  timer M seq=1240 ret=-2 late=2004410 dt=3004410       deadline miss
+  timer B control / timer E control                     section begin/end
+
+Times are in nanoseconds. The file is opened once at construction and each
+marker is formatted in a fixed buffer and written with a single write(): no
+allocation, no stdio. Cycle and section markers go through a token-bucket
+rate limit (markers dropped meanwhile are reported as drop=N in the next
+one); deadline misses are always written. The cost of the writes is measured
+and published, per marker and per cycle.
+
+Any other path can replace the trace_marker file, e.g. a regular file to
+test without tracefs:
+
+  TraceMarker marker("control");     // /sys/kernel/tracing/trace_marker
+  t.attach(marker);
+  ...
+  { TraceMarker::Scope s(marker, "control"); control_law(); }
+*/
+#ifndef TRACE_MARKER_HPP
+#define TRACE_MARKER_HPP
+
+#include "cycle_clock.hpp"
+#include "seqlock.hpp"
+#include "timer.hpp"
+#include <fcntl.h>
+
+// Marker writes so far; costs in nanoseconds
+struct TraceMarkerStats {
+  uint64_t written = 0;
+  uint64_t dropped = 0;    // by the rate limit
+  uint64_t errors = 0;     // failed writes
+  uint64_t cycles = 0;
+  double write_ns = 0;     // mean cost of a write
+  int64_t write_max_ns = 0;
+  double cycle_ns = 0;     // mean cost of the markers of a cycle
+  int64_t cycle_max_ns = 0;
+};
+
+class TraceMarker : public CycleObserver {
+public:
+  // Guard writing a begin and an end marker around a section; label must
+  // outlive the guard
+  class Scope {
+  public:
+    Scope(TraceMarker &marker, const char *label)
+        : _marker(marker), _label(label) {
+      _marker.section('B', _label);
+    }
+    ~Scope() { _marker.section('E', _label); }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    TraceMarker &_marker;
+    const char *_label;
+  };
+
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // An empty path means the tracefs trace_marker (/sys/kernel/tracing, then
+  // /sys/kernel/debug/tracing); other paths are created if needed and
+  // appended to. rate is the maximum of cycle and section markers per
+  // second, with bursts of up to rate / 10; a cycle marker is written every
+  // `every` cycles (0 for misses only).
+  explicit TraceMarker(const string &name = "timer", const string &path = "",
+                       double rate = 10000, size_t every = 1)
+      : _clock(CycleClock::global()), _rate(rate), _every(every) {
+    if (path.empty()) {
+      for (const char *p : {"/sys/kernel/tracing/trace_marker",
+                            "/sys/kernel/debug/tracing/trace_marker"}) {
+        _fd = open(p, O_WRONLY | O_CLOEXEC);
+        if (_fd >= 0) {
+          _path = p;
+          break;
+        }
+      }
+    } else {
+      _path = path;
+      _fd = open(path.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_APPEND,
+                 0644);
+    }
+    if (_fd < 0) {
+      throw TimerError("TraceMarker: cannot open " +
+                       (path.empty() ? string("trace_marker") : path) + ": " +
+                       strerror(errno));
+    }
+    _burst = max(1.0, rate / 10);
+    _tokens = _burst;
+    _last_refill = _clock.stamp();
+    _prefix = min<size_t>(name.size(), 32);
+    memcpy(_buf, name.data(), _prefix);
+    _buf[_prefix++] = ' ';
+  }
+
+  ~TraceMarker() { close(_fd); }
+
+  TraceMarker(const TraceMarker &) = delete;
+  TraceMarker &operator=(const TraceMarker &) = delete;
+
+  const string &path() const { return _path; }
+
+  // Also marks as misses the wake-ups later than this; by default only the
+  // cycles where wait() did not return TIMER_OK are
+  template <typename T> void set_miss_lateness(T lateness) {
+    _miss_lateness = duration_cast<nanoseconds>(lateness).count();
+  }
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_cycle(const CycleRecord &r) override {
+    if (r.ret != 0 || (_miss_lateness > 0 && r.lateness > _miss_lateness)) {
+      begin('M');
+      put(" seq=", r.seq);
+      put(" ret=", r.ret);
+      put(" late=", r.lateness);
+      put(" dt=", r.dt);
+      emit(true);
+    }
+    if (_every > 0 && r.seq % _every == 0) {
+      begin('C');
+      put(" seq=", r.seq);
+      put(" dt=", r.dt);
+      put(" tet=", r.tet);
+      put(" late=", r.lateness);
+      emit(false);
+    }
+    _acc.cycles++;
+    _acc.cycle_ns += (_cycle_cost - _acc.cycle_ns) / _acc.cycles;
+    _acc.cycle_max_ns = max(_acc.cycle_max_ns, _cycle_cost);
+    _cycle_cost = 0;
+    _published.store(_acc);
+  }
+
+  // Section begin ('B') or end ('E') marker
+  void section(char kind, const char *label) {
+    begin(kind);
+    _buf[_len++] = ' ';
+    put(label);
+    emit(false);
+  }
+
+  // Free-form marker, rate limited
+  void mark(const char *text) {
+    begin('T');
+    _buf[_len++] = ' ';
+    put(text);
+    emit(false);
+  }
+
+  // ANY THREAD ----------------------------------------------------------------
+
+  TraceMarkerStats stats() const { return _published.load(); }
+
+  // Adds trace_marker_written, _dropped, _errors, _write_ns, _write_max_ns,
+  // _cycle_ns and _cycle_max_ns
+  void stats(map<string, double> &out) const {
+    TraceMarkerStats s = _published.load();
+    out["trace_marker_written"] = s.written;
+    out["trace_marker_dropped"] = s.dropped;
+    out["trace_marker_errors"] = s.errors;
+    out["trace_marker_write_ns"] = s.write_ns;
+    out["trace_marker_write_max_ns"] = s.write_max_ns;
+    out["trace_marker_cycle_ns"] = s.cycle_ns;
+    out["trace_marker_cycle_max_ns"] = s.cycle_max_ns;
+  }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  const CycleClock &_clock;
+  string _path;
+  int _fd = -1;
+  double _rate, _burst, _tokens;
+  uint64_t _last_refill;
+  size_t _every;
+  int64_t _miss_lateness = 0;
+  char _buf[160];
+  size_t _prefix, _len = 0;
+  uint64_t _drop_pending = 0; // dropped since the last written marker
+  int64_t _cycle_cost = 0;
+  TraceMarkerStats _acc; // written by the RT thread only
+  Seqlock<TraceMarkerStats> _published;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void begin(char kind) {
+    _len = _prefix;
+    _buf[_len++] = kind;
+  }
+
+  void put(const char *s) {
+    while (*s && _len < sizeof(_buf) - 32)
+      _buf[_len++] = *s++;
+  }
+
+  void put(const char *key, int64_t v) {
+    put(key);
+    char digits[20];
+    size_t n = 0;
+    uint64_t u = v < 0 ? -(uint64_t)v : v;
+    do {
+      digits[n++] = '0' + u % 10;
+      u /= 10;
+    } while (u > 0);
+    if (v < 0)
+      _buf[_len++] = '-';
+    while (n > 0)
+      _buf[_len++] = digits[--n];
+  }
+
+  // Writes the marker in the buffer, unless the rate limit says otherwise
+  void emit(bool always) {
+    uint64_t t0 = _clock.stamp();
+    _tokens = min(_burst, _tokens + _clock.to_ns(t0 - _last_refill) *
+                                        _rate * 1.0E-9);
+    _last_refill = t0;
+    if (_tokens < 1 && !always) {
+      _acc.dropped++;
+      _drop_pending++;
+      return;
+    }
+    _tokens = max(0.0, _tokens - 1);
+    if (_drop_pending > 0) {
+      put(" drop=", _drop_pending);
+    }
+    _buf[_len++] = '\n';
+    if (write(_fd, _buf, _len) == (ssize_t)_len) {
+      _acc.written++;
+      _drop_pending = 0;
+    } else {
+      _acc.errors++;
+    }
+    int64_t ns = _clock.to_ns(_clock.stamp() - t0);
+    uint64_t writes = _acc.written + _acc.errors;
+    _acc.write_ns += (ns - _acc.write_ns) / writes;
+    _acc.write_max_ns = max(_acc.write_max_ns, ns);
+    _cycle_cost += ns;
+  }
+};
+
+#endif // TRACE_MARKER_HPP
@@ -0,0 +1,134 @@
+/*
+Full cycle trace for Timer
+
+TraceWriter is an observer streaming every CycleRecord to a binary file, for
+offline analysis of long runs (see jitter_report.hpp and timer-attrib). The
+RT side only copies the record into a lock-free queue; a non-RT writer thread
+drains the queue to the file. Records that do not fit in the queue, because
+the writer fell behind, are counted as dropped. Like FlightRecorder, the
+writer samples the CPU and the scheduling counters itself unless a SchedProbe
+is attached to the timer.
+
+  TraceWriter trace;
+  trace.start_writer("run.bin");
+  t.attach(trace);
+  ...
+  trace.stop_writer();
+
+The file has the layout of the flight recorder dumps (FlightRecorderHeader
+with trigger_seq 0, the conditions text, then the records), so
+FlightRecorder::load() reads it back. The header is rewritten after each
+drain: the file is readable while the run goes on, and after a crash.
+*/
+#ifndef TRACE_WRITER_HPP
+#define TRACE_WRITER_HPP
+
+#include "flight_recorder.hpp"
+#include "spsc_queue.hpp"
+
+class TraceWriter : public CycleObserver {
+public:
+  // LIFE-CYCLE ----------------------------------------------------------------
+  // queue is the number of records buffered between two drains (it must hold
+  // at least poll / interval of them)
+  explicit TraceWriter(size_t queue = 4096, bool sample_cpu = true,
+                       bool sample_sched = true)
+      : _queue(queue), _probe(sample_sched, sample_sched, sample_cpu),
+        _sample(sample_cpu || sample_sched) {}
+
+  ~TraceWriter() { stop_writer(); }
+
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+
+  // RT SIDE -------------------------------------------------------------------
+
+  void on_cycle(const CycleRecord &record) override {
+    _record = record;
+    if (_sample && !(record.probes & CycleRecord::PROBE_SCHED)) {
+      _probe.on_wake(_record);
+    }
+    if (!_queue.push(_record)) {
+      _dropped.fetch_add(1, memory_order_relaxed);
+    }
+  }
+
+  // NON-RT SIDE ---------------------------------------------------------------
+
+  // Text stored in the header, e.g. the LatencyGuard report; set it before
+  // start_writer()
+  void set_conditions(const string &text) { _conditions = text; }
+
+  // Starts a thread that appends the queued records to path every poll period
+  void start_writer(const string &path,
+                    milliseconds poll = milliseconds(100)) {
+    stop_writer();
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out) {
+      throw TimerError("TraceWriter: cannot open " + path);
+    }
+    _written = 0;
+    _writing = true;
+    _writer = thread([this, poll](ofstream out) {
+      write_header(out);
+      out.write(_conditions.data(), _conditions.size());
+      while (_writing.load()) {
+        drain(out);
+        this_thread::sleep_for(poll);
+      }
+      drain(out);
+    }, move(out));
+  }
+
+  void stop_writer() {
+    _writing = false;
+    if (_writer.joinable()) {
+      _writer.join();
+    }
+  }
+
+  // Records written to the file so far
+  size_t written() const { return _written.load(memory_order_relaxed); }
+
+  // Records lost because the writer did not keep up
+  size_t dropped() const { return _dropped.load(memory_order_relaxed); }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  SpscQueue<CycleRecord> _queue;
+  CycleRecord _record; // written by the RT thread only
+  SchedProbe _probe;
+  bool _sample;
+  string _conditions;
+  atomic<size_t> _written{0};
+  atomic<size_t> _dropped{0};
+  atomic<bool> _writing{false};
+  thread _writer;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  void drain(ofstream &out) {
+    CycleRecord r;
+    size_t n = 0;
+    while (_queue.pop(r)) {
+      out.write((const char *)&r, sizeof(r));
+      n++;
+    }
+    if (n > 0) {
+      _written.fetch_add(n, memory_order_relaxed);
+      write_header(out);
+    }
+  }
+
+  void write_header(ofstream &out) {
+    FlightRecorderHeader header;
+    header.count = (uint32_t)_written.load(memory_order_relaxed);
+    header.dropped = _dropped.load(memory_order_relaxed);
+    header.conditions_size = (uint32_t)_conditions.size();
+    out.seekp(0);
+    out.write((const char *)&header, sizeof(header));
+    out.seekp(0, ios::end);
+    out.flush();
+  }
+};
+
+#endif // TRACE_WRITER_HPP
@@ -0,0 +1,101 @@
+/*
+USDT probe points
+
+TIMER_USDT(provider, name, args...) places a statically defined tracepoint,
+compatible with systemtap's sys/sdt.h but self-contained: a single nop in the
+code, and a note in the .note.stapsdt section of the binary telling tracers
+where the nop is and where to find the arguments. bpftrace, perf probe and
+bcc find the notes with no extra setup:
+
+  bpftrace -e 'usdt:./timer:timer:deadline_miss { printf("%d\n", arg2); }'
+  perf probe -x ./timer sdt_timer:wait_exit
+
+When no tracer is attached the cost is that nop (arguments are only
+referenced, in registers or memory, never copied); an attached tracer
+replaces it with a breakpoint. Arguments must be integers (1 to 4 of them).
+Probes are compiled on ELF x86-64 and aarch64 targets, unless
+TIMER_NO_USDT is defined; elsewhere the macros expand to nothing.
+
+Probes of Timer (provider "timer"; times in ns):
+
+  wait_entry(timer)                            wait() called
+  wait_exit(timer, ret, dt, lateness)          wait() returning
+  deadline_miss(timer, ret, lateness)          wait() not returning TIMER_OK
+  stats_update(timer, dt, tet, latency)        collectors updated
+*/
+#ifndef USDT_HPP
+#define USDT_HPP
+
+#include <type_traits>
+
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) &&    \
+    !defined(TIMER_NO_USDT)
+#define TIMER_USDT_ENABLED 1
+
+// Size of an argument as "-8" (signed) or "8" (unsigned), printed by %n
+#define TIMER_USDT_SIZE(x)                                                     \
+  ((std::is_signed<std::decay_t<decltype(x)>>::value ? 1 : -1) *              \
+   (int)sizeof(x))
+
+#define TIMER_USDT_OP(i, x) [s##i] "n"(TIMER_USDT_SIZE(x)), [a##i] "nor"(x)
+
+// Note layout: namesz, descsz, type 3, "stapsdt", then the probe address, the
+// address of _.stapsdt.base (for prelink adjustment), the semaphore address
+// (none) and the provider, name and argument strings
+#define TIMER_USDT_ASM(provider, name, args, ...)                              \
+  __asm__ __volatile__(                                                        \
+      "990: nop\n"                                                             \
+      ".pushsection .note.stapsdt,\"?\",\"note\"\n"                            \
+      ".balign 4\n"                                                            \
+      ".4byte 992f-991f, 994f-993f, 3\n"                                       \
+      "991: .asciz \"stapsdt\"\n"                                              \
+      "992: .balign 4\n"                                                       \
+      "993: .8byte 990b\n"                                                     \
+      ".8byte _.stapsdt.base\n"                                                \
+      ".8byte 0\n"                                                             \
+      ".asciz \"" #provider "\"\n"                                             \
+      ".asciz \"" #name "\"\n"                                                 \
+      ".asciz \"" args "\"\n"                                                  \
+      "994: .balign 4\n"                                                       \
+      ".popsection\n"                                                          \
+      ".ifndef _.stapsdt.base\n"                                               \
+      ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"  \
+      ".weak _.stapsdt.base\n"                                                 \
+      ".hidden _.stapsdt.base\n"                                               \
+      "_.stapsdt.base: .space 1\n"                                             \
+      ".size _.stapsdt.base, 1\n"                                              \
+      ".popsection\n"                                                          \
+      ".endif\n"                                                               \
+      :                                                                        \
+      : __VA_ARGS__)
+
+#define TIMER_USDT1(p, n, a1)                                                  \
+  TIMER_USDT_ASM(p, n, "%n[s1]@%[a1]", TIMER_USDT_OP(1, a1))
+#define TIMER_USDT2(p, n, a1, a2)                                              \
+  TIMER_USDT_ASM(p, n, "%n[s1]@%[a1] %n[s2]@%[a2]", TIMER_USDT_OP(1, a1),      \
+                 TIMER_USDT_OP(2, a2))
+#define TIMER_USDT3(p, n, a1, a2, a3)                                          \
+  TIMER_USDT_ASM(p, n, "%n[s1]@%[a1] %n[s2]@%[a2] %n[s3]@%[a3]",               \
+                 TIMER_USDT_OP(1, a1), TIMER_USDT_OP(2, a2),                   \
+                 TIMER_USDT_OP(3, a3))
+#define TIMER_USDT4(p, n, a1, a2, a3, a4)                                      \
+  TIMER_USDT_ASM(p, n, "%n[s1]@%[a1] %n[s2]@%[a2] %n[s3]@%[a3] %n[s4]@%[a4]",  \
+                 TIMER_USDT_OP(1, a1), TIMER_USDT_OP(2, a2),                   \
+                 TIMER_USDT_OP(3, a3), TIMER_USDT_OP(4, a4))
+
+#else
+#define TIMER_USDT_ENABLED 0
+#define TIMER_USDT1(p, n, a1) ((void)0)
+#define TIMER_USDT2(p, n, a1, a2) ((void)0)
+#define TIMER_USDT3(p, n, a1, a2, a3) ((void)0)
+#define TIMER_USDT4(p, n, a1, a2, a3, a4) ((void)0)
+#endif
+
+// TIMER_USDT(provider, name, arg1[, arg2[, arg3[, arg4]]])
+#define TIMER_USDT_PICK(_1, _2, _3, _4, macro, ...) macro
+#define TIMER_USDT(p, n, ...)                                                  \
+  TIMER_USDT_PICK(__VA_ARGS__, TIMER_USDT4, TIMER_USDT3, TIMER_USDT2,          \
+                  TIMER_USDT1, )                                               \
+  (p, n, __VA_ARGS__)
+
+#endif // USDT_HPP
@@ -0,0 +1,150 @@
+/*
+Virtual clock policy for Timer
+
+Simulated time that advances instantly: sleeping jumps straight to the
+deadline, plus an optional lateness drawn from a script or from a jitter
+distribution. Use it as the third template parameter of Timer to run
+millions of cycles in seconds, deterministically:
+
+  Timer<duration<double>, FullStats, VirtualClock> t(milliseconds(1), milliseconds(2));
+  t.clock().set_jitter(VirtualClock::normal_jitter(microseconds(3), microseconds(1)));
+  t.start();
+  for (...) {
+    t.clock().advance(microseconds(200)); // simulated loop body
+    t.wait();
+  }
+*/
+#ifndef VIRTUAL_CLOCK_HPP
+#define VIRTUAL_CLOCK_HPP
+
+#include "timer.hpp"
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+class VirtualClock {
+public:
+  using Jitter = function<nanoseconds()>;
+
+  // LIFE-CYCLE ----------------------------------------------------------------
+  explicit VirtualClock(nanoseconds epoch = seconds(1)) : _t(epoch) {}
+
+  // JITTER SOURCES ------------------------------------------------------------
+  // All sources are seeded, so that the same seed gives the same trace
+
+  static Jitter normal_jitter(nanoseconds mean, nanoseconds sd,
+                              unsigned seed = 1) {
+    auto gen = make_shared<mt19937_64>(seed);
+    auto dist = make_shared<normal_distribution<double>>(mean.count(),
+                                                         sd.count());
+    return [=]() { return nanoseconds(llround((*dist)(*gen))); };
+  }
+
+  static Jitter uniform_jitter(nanoseconds lo, nanoseconds hi,
+                               unsigned seed = 1) {
+    auto gen = make_shared<mt19937_64>(seed);
+    auto dist = make_shared<uniform_int_distribution<long long>>(lo.count(),
+                                                                 hi.count());
+    return [=]() { return nanoseconds((*dist)(*gen)); };
+  }
+
+  static Jitter exponential_jitter(nanoseconds mean, unsigned seed = 1) {
+    auto gen = make_shared<mt19937_64>(seed);
+    auto dist = make_shared<exponential_distribution<double>>(
+        1.0 / max<double>(1, mean.count()));
+    return [=]() { return nanoseconds(llround((*dist)(*gen))); };
+  }
+
+  // METHODS -------------------------------------------------------------------
+
+  // Lateness of every wake-up not covered by the script
+  void set_jitter(Jitter jitter) { _jitter = jitter; }
+
+  // Lateness of the next wake-ups, one per element, consumed before jitter
+  void script_lateness(const vector<nanoseconds> &lateness) {
+    _script.insert(_script.end(), lateness.begin(), lateness.end());
+  }
+
+  // Simulates time spent outside of sleep (e.g. the loop body)
+  void advance(nanoseconds d) { _t += d; }
+
+  // Simulates a cost for every reading of the clock
+  void set_read_cost(nanoseconds d) { _read_cost = d; }
+
+  size_t wakeups() const { return _wakeups; }
+
+  // CLOCK POLICY --------------------------------------------------------------
+
+  nanoseconds now() {
+    _t += _read_cost;
+    return _t;
+  }
+
+  void gettime(struct timespec &ts) const { to_timespec(_t, ts); }
+
+  int sleep_until(const struct timespec &ts) {
+    nanoseconds deadline = from_timespec(ts);
+    if (deadline > _t) { // overruns return immediately, as clock_nanosleep()
+      _t = deadline + lateness();
+    }
+    return 0;
+  }
+
+  int sleep(const struct timespec &ts) {
+    nanoseconds wake = _t + from_timespec(ts);
+    if (_period.count() > 0 && _next <= wake) {
+      _t = max(_t, _next + lateness());
+      while (_next <= _t)
+        _next += _period;
+      errno = EINTR;
+      return -1; // interrupted by the simulated SIGALRM
+    }
+    _t = wake;
+    return 0;
+  }
+
+  int arm(const struct itimerval &rep) {
+    _period = seconds(rep.it_interval.tv_sec) +
+              microseconds(rep.it_interval.tv_usec);
+    _next = _t + seconds(rep.it_value.tv_sec) +
+            microseconds(rep.it_value.tv_usec);
+    return 0;
+  }
+
+  void disarm() { _period = nanoseconds(0); }
+
+private:
+  // ATTRIBUTES ----------------------------------------------------------------
+  nanoseconds _t;
+  nanoseconds _read_cost{0};
+  nanoseconds _period{0}, _next{0};
+  deque<nanoseconds> _script;
+  Jitter _jitter;
+  size_t _wakeups = 0;
+
+  // PRIVATE METHODS -----------------------------------------------------------
+  nanoseconds lateness() {
+    nanoseconds l(0);
+    if (!_script.empty()) {
+      l = _script.front();
+      _script.pop_front();
+    } else if (_jitter) {
+      l = _jitter();
+    }
+    _wakeups++;
+    return max(l, nanoseconds(0)); // wake-ups are never early
+  }
+
+  static nanoseconds from_timespec(const struct timespec &ts) {
+    return seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+  }
+
+  static void to_timespec(nanoseconds t, struct timespec &ts) {
+    ts.tv_sec = t.count() / NSEC_PER_SEC;
+    ts.tv_nsec = t.count() % NSEC_PER_SEC;
+  }
+};
+
+#endif // VIRTUAL_CLOCK_HPP